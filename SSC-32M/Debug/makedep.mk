@@ -12,6 +12,8 @@ Src\parse_commands.c
 
 Src\servo_calculations.c
 
+Src\servo_control.c
+
 Src\servo_current.c
 
 Src\servo_pulse.c
@@ -0,0 +1,109 @@
+/*
+ * host_regs.h
+ *
+ * List of the ATmega4809 registers that are modeled by the host build.
+ * Each register is a plain variable.  This file is included twice: once
+ * by io.h to declare the registers, and once by host_hw.c to define them.
+ * HOST_REG8/HOST_REG16 must be defined before including this file.
+ */
+
+// Ports.  The OUTSET/OUTCLR/OUTTGL registers latch the last value
+// written; host_port_sync() folds them into OUT.
+HOST_REG8(PORTA_DIRSET)
+HOST_REG8(PORTA_DIRCLR)
+HOST_REG8(PORTA_OUT)
+HOST_REG8(PORTA_OUTSET)
+HOST_REG8(PORTA_OUTCLR)
+HOST_REG8(PORTA_OUTTGL)
+HOST_REG8(PORTB_DIRSET)
+HOST_REG8(PORTB_DIRCLR)
+HOST_REG8(PORTB_OUT)
+HOST_REG8(PORTB_OUTSET)
+HOST_REG8(PORTB_OUTCLR)
+HOST_REG8(PORTB_OUTTGL)
+HOST_REG8(PORTC_DIRSET)
+HOST_REG8(PORTC_DIRCLR)
+HOST_REG8(PORTC_OUT)
+HOST_REG8(PORTC_OUTSET)
+HOST_REG8(PORTC_OUTCLR)
+HOST_REG8(PORTC_OUTTGL)
+HOST_REG8(PORTE_DIRSET)
+HOST_REG8(PORTE_DIRCLR)
+HOST_REG8(PORTE_OUT)
+HOST_REG8(PORTE_OUTSET)
+HOST_REG8(PORTE_OUTCLR)
+HOST_REG8(PORTE_OUTTGL)
+HOST_REG8(PORTF_DIRSET)
+HOST_REG8(PORTF_DIRCLR)
+HOST_REG8(PORTF_OUT)
+HOST_REG8(PORTF_OUTSET)
+HOST_REG8(PORTF_OUTCLR)
+HOST_REG8(PORTF_OUTTGL)
+HOST_REG8(PORTD_PIN0CTRL)
+HOST_REG8(PORTD_PIN1CTRL)
+HOST_REG8(PORTD_PIN2CTRL)
+HOST_REG8(PORTD_PIN3CTRL)
+HOST_REG8(PORTD_PIN4CTRL)
+HOST_REG8(PORTD_PIN5CTRL)
+HOST_REG8(PORTD_PIN6CTRL)
+HOST_REG8(PORTD_PIN7CTRL)
+HOST_REG8(PORTE_PIN0CTRL)
+HOST_REG8(PORTE_PIN1CTRL)
+HOST_REG8(PORTE_PIN2CTRL)
+HOST_REG8(PORTE_PIN3CTRL)
+HOST_REG8(PORTF_PIN2CTRL)
+HOST_REG8(PORTF_PIN3CTRL)
+HOST_REG8(PORTF_PIN4CTRL)
+HOST_REG8(PORTF_PIN5CTRL)
+HOST_REG8(PORTMUX_USARTROUTEA)
+HOST_REG8(PORTMUX_TCAROUTEA)
+
+// Clock controller and interrupt controller
+HOST_REG8(CLKCTRL_MCLKCTRLA)
+HOST_REG8(CLKCTRL_MCLKCTRLB)
+HOST_REG8(CPUINT_LVL1VEC)
+
+// TCA0 in single (16 bit) mode
+HOST_REG8(TCA0_SINGLE_CTRLA)
+HOST_REG8(TCA0_SINGLE_CTRLB)
+HOST_REG8(TCA0_SINGLE_INTCTRL)
+HOST_REG8(TCA0_SINGLE_INTFLAGS)
+HOST_REG16(TCA0_SINGLE_CNT)
+HOST_REG16(TCA0_SINGLE_PER)
+HOST_REG16(TCA0_SINGLE_CMP0)
+HOST_REG16(TCA0_SINGLE_CMP1)
+HOST_REG16(TCA0_SINGLE_CMP2)
+HOST_REG16(TCA0_SINGLE_CMP1BUF)
+HOST_REG16(TCA0_SINGLE_CMP2BUF)
+
+// USART0
+HOST_REG8(USART0_RXDATAL)
+HOST_REG8(USART0_RXDATAH)
+HOST_REG8(USART0_TXDATAL)
+HOST_REG8(USART0_STATUS)
+HOST_REG8(USART0_CTRLA)
+HOST_REG8(USART0_CTRLB)
+HOST_REG8(USART0_CTRLC)
+HOST_REG16(USART0_BAUD)
+
+// USART1
+HOST_REG8(USART1_RXDATAL)
+HOST_REG8(USART1_TXDATAL)
+HOST_REG8(USART1_CTRLA)
+HOST_REG8(USART1_CTRLB)
+HOST_REG8(USART1_CTRLC)
+HOST_REG16(USART1_BAUD)
+
+// ADC0
+HOST_REG8(ADC0_CTRLA)
+HOST_REG8(ADC0_CTRLB)
+HOST_REG8(ADC0_CTRLC)
+HOST_REG8(ADC0_CTRLD)
+HOST_REG8(ADC0_CTRLE)
+HOST_REG8(ADC0_SAMPCTRL)
+HOST_REG8(ADC0_MUXPOS)
+HOST_REG8(ADC0_COMMAND)
+HOST_REG8(ADC0_INTCTRL)
+HOST_REG8(ADC0_INTFLAGS)
+HOST_REG8(ADC0_CALIB)
+HOST_REG16(ADC0_RES)
@@ -0,0 +1,25 @@
+/*
+ * interrupt.h
+ *
+ * Host stand-in for <avr/interrupt.h>.  Each ISR becomes an ordinary
+ * function named after its vector, so the host hardware model can call
+ * it directly when it simulates the corresponding interrupt.
+ */
+
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#define ISR(vector, ...) void vector(void)
+
+#define sei()
+#define cli()
+
+// Vectors used by the firmware
+void TCA0_CMP0_vect(void);
+void USART0_RXC_vect(void);
+void USART0_DRE_vect(void);
+void USART1_RXC_vect(void);
+void USART1_DRE_vect(void);
+void ADC0_RESRDY_vect(void);
+
+#endif // HOST_AVR_INTERRUPT_H
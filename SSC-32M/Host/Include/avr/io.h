@@ -0,0 +1,90 @@
+/*
+ * io.h
+ *
+ * Host stand-in for <avr/io.h>.  Declares the subset of the ATmega4809
+ * register set used by the firmware as plain variables, along with the
+ * bit masks and group configurations that the firmware writes to them.
+ * The constant values match the ATmega4809 device header.
+ */
+
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <stdint.h>
+
+#define HOST_BUILD 1
+
+#define _BV(bit) (1 << (bit))
+#define _PROTECTED_WRITE(reg, value) ((reg) = (value))
+
+// Registers
+#define HOST_REG8(name) extern volatile uint8_t name;
+#define HOST_REG16(name) extern volatile uint16_t name;
+#include "host_regs.h"
+#undef HOST_REG8
+#undef HOST_REG16
+
+// PORT
+#define PORT_ISC_INPUT_DISABLE_gc (0x04<<0)
+
+// PORTMUX
+#define PORTMUX_USART0_gm 0x03
+#define PORTMUX_USART0_ALT1_gc (0x01<<0)
+#define PORTMUX_USART1_gm 0x0C
+#define PORTMUX_USART1_ALT1_gc (0x01<<2)
+#define PORTMUX_TCA0_PORTB_gc (0x01<<0)
+
+// CLKCTRL
+#define CLKCTRL_CLKSEL_OSC20M_gc (0x00<<0)
+#define CLKCTRL_CLKSEL_EXTCLK_gc (0x03<<0)
+#define CLKCTRL_PDIV_2X_gc (0x00<<1)
+#define CLKCTRL_PEN_bm 0x01
+
+// TCA
+#define TCA_SINGLE_ENABLE_bm 0x01
+#define TCA_SINGLE_CLKSEL_DIV8_gc (0x03<<1)
+#define TCA_SINGLE_WGMODE_NORMAL_gc (0x00<<0)
+#define TCA_SINGLE_WGMODE_SINGLESLOPE_gc (0x03<<0)
+#define TCA_SINGLE_CMP1EN_bm 0x20
+#define TCA_SINGLE_CMP2EN_bm 0x40
+#define TCA_SINGLE_OVF_bm 0x01
+#define TCA_SINGLE_CMP0_bm 0x10
+
+// USART
+#define USART_RXCIE_bm 0x80
+#define USART_TXCIE_bm 0x40
+#define USART_DREIE_bm 0x20
+#define USART_RXEN_bm 0x80
+#define USART_TXEN_bm 0x40
+#define USART_RXMODE_NORMAL_gc (0x00<<1)
+#define USART_RXMODE_CLK2X_gc (0x01<<1)
+#define USART_CMODE_ASYNCHRONOUS_gc (0x00<<6)
+#define USART_PMODE_DISABLED_gc (0x00<<4)
+#define USART_SBMODE_1BIT_gc (0x00<<3)
+#define USART_CHSIZE_8BIT_gc (0x03<<0)
+#define USART_RXCIF_bm 0x80
+#define USART_TXCIF_bm 0x40
+#define USART_BUFOVF_bm 0x40
+#define USART_DREIF_bm 0x20
+
+// ADC
+#define ADC_ENABLE_bm 0x01
+#define ADC_SAMPNUM_ACC1_gc (0x00<<0)
+#define ADC_SAMPNUM_ACC2_gc (0x01<<0)
+#define ADC_SAMPNUM_ACC4_gc (0x02<<0)
+#define ADC_SAMPNUM_ACC8_gc (0x03<<0)
+#define ADC_SAMPNUM_ACC16_gc (0x04<<0)
+#define ADC_SAMPNUM_gm 0x07
+#define ADC_SAMPCAP_bm 0x40
+#define ADC_REFSEL_VDDREF_gc (0x01<<4)
+#define ADC_PRESC_DIV8_gc (0x02<<0)
+#define ADC_INITDLY_DLY32_gc (0x02<<5)
+#define ADC_WINCM_NONE_gc (0x00<<0)
+#define ADC_DUTYCYC_DUTY25_gc (0x01<<0)
+#define ADC_RESRDY_bm 0x01
+#define ADC_STCONV_bm 0x01
+
+// Interrupt vector numbers
+#define TCA0_CMP0_vect_num 10
+
+#endif // HOST_AVR_IO_H
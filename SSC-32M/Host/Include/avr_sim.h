@@ -0,0 +1,79 @@
+/*
+ * avr_sim.h
+ *
+ * Instruction level simulator of the ATmega4809 (AVRxt) core, used by the
+ * bench to count the AVR cycles taken by code that is too small to time
+ * on the host.  It runs the disassembly in an avr-objdump listing (.lss),
+ * so the code measured is the compiler output rather than a model of it.
+ *
+ * Only the CPU is simulated: the registers, the status register, the
+ * stack and a flat data space.  Calls to functions outside the code
+ * under test are handed to stubs registered by name.
+ */
+
+#ifndef AVR_SIM_H
+#define AVR_SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// ATmega4809 memory map
+#define AVR_SIM_FLASH_NBYTES 0xC000
+#define AVR_SIM_MAPPED_FLASH 0x4000
+#define AVR_SIM_RAMEND 0x3FFF
+
+#define AVR_SIM_MAX_SYMBOLS 256
+
+// One decoded instruction.  The operands are as in the listing: a and b
+// are register numbers or bit numbers, k is an address, offset or
+// constant.
+struct AvrInsn_s
+{
+	uint8_t op;
+	uint8_t nBytes;
+	uint8_t a;
+	uint8_t b;
+	int32_t k;
+};
+typedef struct AvrInsn_s AvrInsn_t;
+
+struct AvrSymbol_s
+{
+	char name[32];
+	uint16_t addr;
+};
+typedef struct AvrSymbol_s AvrSymbol_t;
+
+typedef struct AvrSim_s AvrSim_t;
+
+// Called in place of a function.  The arguments are in the registers as
+// set up by the caller.
+typedef void (*AvrStub_t)(AvrSim_t * sim);
+
+struct AvrSim_s
+{
+	// Program, indexed by word address, and the flash contents.  The
+	// flash is also read through the data space from AVR_SIM_MAPPED_FLASH.
+	AvrInsn_t insns[AVR_SIM_FLASH_NBYTES / 2];
+	uint8_t flash[AVR_SIM_FLASH_NBYTES];
+	AvrSymbol_t symbols[AVR_SIM_MAX_SYMBOLS];
+	AvrStub_t stubs[AVR_SIM_MAX_SYMBOLS];
+	uint16_t nSymbols;
+
+	// CPU state.  SP and SREG are kept in the data space, at their I/O
+	// addresses.
+	uint8_t r[32];
+	uint8_t data[0x10000];
+	uint16_t pc;
+	uint32_t cycles;
+
+	// Why the last avr_sim_call() failed
+	char error[80];
+};
+
+bool avr_sim_load(AvrSim_t * sim, const char * path);
+int32_t avr_sim_symbol(const AvrSim_t * sim, const char * name);
+bool avr_sim_stub(AvrSim_t * sim, const char * name, AvrStub_t stub);
+int32_t avr_sim_call(AvrSim_t * sim, uint16_t addr, uint32_t maxCycles);
+
+#endif // AVR_SIM_H
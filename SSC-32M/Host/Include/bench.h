@@ -0,0 +1,103 @@
+/*
+ * bench.h
+ *
+ * Shared helpers for the host benchmark and checks.  bench.c holds the
+ * helpers and main(); the benchmarks and checks for each firmware
+ * module are in bench_<module>.c.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Number of frames/commands measured per benchmark
+#define BENCH_FRAMES 20000
+#define BENCH_COMMANDS 5000
+
+// Size of a command buffer, enough for a move of every servo with a
+// speed and a move time
+#define BENCH_CMD_NBYTES 512
+
+// Accumulated timing for one benchmark
+struct BenchStat_s
+{
+	const char * name;
+	uint32_t calls;
+	uint64_t totalNs;
+	uint64_t worstNs;
+};
+typedef struct BenchStat_s BenchStat_t;
+
+// Scratch buffer for transmitted bytes
+extern char txBuf[512];
+
+// Timing helpers
+uint64_t now_ns(void);
+void stat_add(BenchStat_t * stat, uint64_t startNs);
+void stat_print(const BenchStat_t * stat);
+
+// Check helpers
+void check_report(const char * name, bool failed, const char * format, ...)
+	__attribute__((format(printf, 3, 4)));
+uint32_t next_random(uint32_t * seed);
+uint8_t crc8(const uint8_t * bytes, uint16_t nBytes);
+
+// Firmware helpers
+void firmware_init(void);
+void main_loop_pass(void);
+void main_loop_passes(uint8_t nPasses);
+void rx_command(const char * cmd);
+void send_command(const char * cmd);
+bool reply_is(const char * cmd, const char * reply);
+uint16_t tx_drain_string(void);
+void run_until_settled(void);
+void run_frames(uint16_t nFrames);
+void center_servos(void);
+void adc_scan(void);
+uint16_t position_millivolts(uint8_t servoNum);
+void make_group_move(char * cmd, uint32_t * seed, uint16_t moveTime);
+
+// Pulse measurement (bench_servo_pulse.c)
+int32_t measure_pulse(uint8_t servoNum);
+void check_pulses(const char * name);
+
+// bench_servo_pulse.c
+void bench_servo_pulse(void);
+void bench_profiles(void);
+void bench_edge_isr(void);
+void bench_interpolation(void);
+void bench_frame_check(void);
+void bench_pulse_check(void);
+
+// bench_servo_calculations.c
+void bench_servo_calculations(void);
+void bench_move_math_check(void);
+void bench_profile_check(void);
+void bench_queue_check(void);
+
+// bench_parse_commands.c
+void bench_binary_check(void);
+void bench_trie_check(void);
+void bench_dispatch_check(void);
+void bench_parse_commands(void);
+void bench_bulk_query_check(void);
+void bench_telemetry_check(void);
+
+// bench_uart.c
+void bench_baud_check(void);
+void bench_rx_flow_check(void);
+void bench_rx_headroom(void);
+void bench_format(void);
+
+// bench_adc.c
+void bench_adc_check(void);
+
+// bench_servo_current.c
+void bench_current_check(void);
+
+// bench_servo_control.c
+void bench_control_check(void);
+
+#endif // BENCH_H
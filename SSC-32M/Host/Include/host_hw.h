@@ -0,0 +1,51 @@
+/*
+ * host_hw.h
+ *
+ * Host model of the ATmega4809 peripherals used by the servo controller.
+ * The firmware sources are compiled unchanged against the register
+ * stand-ins in avr/io.h; these functions play the role of the hardware
+ * by updating the registers and calling the ISRs.
+ */
+
+#ifndef HOST_HW_H
+#define HOST_HW_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Maximum number of edge interrupts recorded for one servo frame
+#define HOST_MAX_FRAME_EDGES 128
+
+// Value of a TCA0 compare buffer register that has not been written since
+// the last update.  The hardware keeps a buffer valid flag instead; the
+// firmware never writes this value.
+#define HOST_TCA_BUF_EMPTY 0xFFFE
+
+// One entry per TCA0 compare interrupt: the timer value at which the
+// ISR ran and the port output values after it returned.
+struct HostEdgeLog_s
+{
+	uint16_t time;
+	uint8_t portA;
+	uint8_t portB;
+	uint8_t portC;
+	uint8_t portE;
+	uint8_t portF;
+};
+typedef struct HostEdgeLog_s HostEdgeLog_t;
+
+extern HostEdgeLog_t HostFrameLog[HOST_MAX_FRAME_EDGES];
+extern uint8_t HostFrameLogCount;
+
+void host_hw_reset(void);
+void host_port_sync(void);
+void host_uart_rx(const char * bytes, uint16_t nBytes);
+uint16_t host_uart_tx_drain(char * buf, uint16_t maxBytes);
+void host_adc_set_input(uint8_t channel, uint16_t value);
+void host_adc_complete(void);
+void host_current_set(uint8_t servoNum, uint16_t milliAmps);
+uint8_t host_current_device(uint8_t maxReplies);
+uint8_t host_current_waiting(void);
+uint8_t host_timer_run_frame(uint16_t latency);
+
+#endif // HOST_HW_H
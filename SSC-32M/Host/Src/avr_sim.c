@@ -0,0 +1,788 @@
+/*
+ * avr_sim.c
+ *
+ * Instruction level simulator of the ATmega4809 (AVRxt) core.  See
+ * avr_sim.h.
+ *
+ * The cycle counts are the AVRxt column of the AVR instruction set
+ * manual.  Loads from internal SRAM take the listed time; loads from
+ * flash through the data space take one more cycle, the minimum the
+ * manual gives for access through the NVM controller.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../Include/avr_sim.h"
+
+// I/O addresses of the CPU registers
+#define AVR_SPL 0x3D
+#define AVR_SPH 0x3E
+#define AVR_SREG 0x3F
+
+// Status register bits
+#define SREG_C 0
+#define SREG_Z 1
+#define SREG_N 2
+#define SREG_V 3
+#define SREG_S 4
+#define SREG_H 5
+#define SREG_T 6
+#define SREG_I 7
+
+// Return address pushed by avr_sim_call(), as a word address.  Returning
+// to it ends the call.  It is outside the flash, so it is never code.
+#define AVR_SIM_RETURN_WORD 0xFFFF
+#define AVR_SIM_RETURN_ADDR ((uint16_t)(AVR_SIM_RETURN_WORD * 2))
+
+// Pointer register addressing modes of LD and ST
+#define PTR_PLAIN 0
+#define PTR_POST_INC 1
+#define PTR_PRE_DEC 2
+
+enum
+{
+	OP_NONE,
+	OP_ADC, OP_ADD, OP_ADIW, OP_AND, OP_ANDI, OP_ASR, OP_BCLR, OP_BLD,
+	OP_BRBC, OP_BRBS, OP_BSET, OP_BST, OP_CALL, OP_CBI, OP_COM, OP_CP,
+	OP_CPC, OP_CPI, OP_CPSE, OP_DEC, OP_EOR, OP_ICALL, OP_IJMP, OP_IN,
+	OP_INC, OP_JMP, OP_LD, OP_LDD, OP_LDI, OP_LDS, OP_LPM, OP_LSR, OP_MOV,
+	OP_MOVW, OP_MUL, OP_MULS, OP_MULSU, OP_NEG, OP_NOP, OP_OR, OP_ORI,
+	OP_OUT, OP_POP, OP_PUSH, OP_RCALL, OP_RET, OP_RETI, OP_RJMP, OP_ROR,
+	OP_SBC, OP_SBCI, OP_SBI, OP_SBIC, OP_SBIS, OP_SBIW, OP_SBRC, OP_SBRS,
+	OP_ST, OP_STD, OP_STS, OP_SUB, OP_SUBI, OP_SWAP
+};
+
+// Mnemonics as printed by avr-objdump.  The branch and flag aliases
+// carry the status register bit they test or change.
+struct Mnemonic_s
+{
+	const char * name;
+	uint8_t op;
+	uint8_t bit;
+};
+
+static const struct Mnemonic_s mnemonics[] =
+{
+	{"adc", OP_ADC, 0}, {"add", OP_ADD, 0}, {"adiw", OP_ADIW, 0},
+	{"and", OP_AND, 0}, {"andi", OP_ANDI, 0}, {"asr", OP_ASR, 0},
+	{"bld", OP_BLD, 0}, {"bst", OP_BST, 0}, {"call", OP_CALL, 0},
+	{"cbi", OP_CBI, 0}, {"com", OP_COM, 0}, {"cp", OP_CP, 0},
+	{"cpc", OP_CPC, 0}, {"cpi", OP_CPI, 0}, {"cpse", OP_CPSE, 0},
+	{"dec", OP_DEC, 0}, {"eor", OP_EOR, 0}, {"icall", OP_ICALL, 0},
+	{"ijmp", OP_IJMP, 0}, {"in", OP_IN, 0}, {"inc", OP_INC, 0},
+	{"jmp", OP_JMP, 0}, {"ld", OP_LD, 0}, {"ldd", OP_LDD, 0},
+	{"ldi", OP_LDI, 0}, {"lds", OP_LDS, 0}, {"lpm", OP_LPM, 0},
+	{"lsr", OP_LSR, 0}, {"mov", OP_MOV, 0}, {"movw", OP_MOVW, 0},
+	{"mul", OP_MUL, 0}, {"muls", OP_MULS, 0}, {"mulsu", OP_MULSU, 0},
+	{"neg", OP_NEG, 0}, {"nop", OP_NOP, 0}, {"or", OP_OR, 0},
+	{"ori", OP_ORI, 0}, {"out", OP_OUT, 0}, {"pop", OP_POP, 0},
+	{"push", OP_PUSH, 0}, {"rcall", OP_RCALL, 0}, {"ret", OP_RET, 0},
+	{"reti", OP_RETI, 0}, {"rjmp", OP_RJMP, 0}, {"ror", OP_ROR, 0},
+	{"sbc", OP_SBC, 0}, {"sbci", OP_SBCI, 0}, {"sbi", OP_SBI, 0},
+	{"sbic", OP_SBIC, 0}, {"sbis", OP_SBIS, 0}, {"sbiw", OP_SBIW, 0},
+	{"sbrc", OP_SBRC, 0}, {"sbrs", OP_SBRS, 0}, {"st", OP_ST, 0},
+	{"std", OP_STD, 0}, {"sts", OP_STS, 0}, {"sub", OP_SUB, 0},
+	{"subi", OP_SUBI, 0}, {"swap", OP_SWAP, 0},
+	{"brcs", OP_BRBS, SREG_C}, {"brlo", OP_BRBS, SREG_C},
+	{"brcc", OP_BRBC, SREG_C}, {"brsh", OP_BRBC, SREG_C},
+	{"breq", OP_BRBS, SREG_Z}, {"brne", OP_BRBC, SREG_Z},
+	{"brmi", OP_BRBS, SREG_N}, {"brpl", OP_BRBC, SREG_N},
+	{"brvs", OP_BRBS, SREG_V}, {"brvc", OP_BRBC, SREG_V},
+	{"brlt", OP_BRBS, SREG_S}, {"brge", OP_BRBC, SREG_S},
+	{"brhs", OP_BRBS, SREG_H}, {"brhc", OP_BRBC, SREG_H},
+	{"brts", OP_BRBS, SREG_T}, {"brtc", OP_BRBC, SREG_T},
+	{"brie", OP_BRBS, SREG_I}, {"brid", OP_BRBC, SREG_I},
+	{"sec", OP_BSET, SREG_C}, {"clc", OP_BCLR, SREG_C},
+	{"sez", OP_BSET, SREG_Z}, {"clz", OP_BCLR, SREG_Z},
+	{"sen", OP_BSET, SREG_N}, {"cln", OP_BCLR, SREG_N},
+	{"sev", OP_BSET, SREG_V}, {"clv", OP_BCLR, SREG_V},
+	{"ses", OP_BSET, SREG_S}, {"cls", OP_BCLR, SREG_S},
+	{"seh", OP_BSET, SREG_H}, {"clh", OP_BCLR, SREG_H},
+	{"set", OP_BSET, SREG_T}, {"clt", OP_BCLR, SREG_T},
+	{"sei", OP_BSET, SREG_I}, {"cli", OP_BCLR, SREG_I},
+};
+
+/**********************************************************************
+* Listing parser
+**********************************************************************/
+
+// Parse one operand into *reg (register number, or pointer base register
+// for X, Y and Z) and *value (constant, address, displacement or pointer
+// mode).  Branch targets are converted to addresses using pc, the
+// address of the next instruction.
+static bool parse_operand(const char * s, uint16_t pc, uint8_t * reg, int32_t * value)
+{
+	static const char pointers[] = "XYZ";
+	char * end;
+	const char * p;
+
+	while (*s == ' ')
+	{
+		++s;
+	}
+	*reg = 0;
+	*value = 0;
+	if ((s[0] == 'r') && (s[1] >= '0') && (s[1] <= '9'))
+	{
+		*reg = strtol(&s[1], &end, 10);
+		return *reg < 32;
+	}
+	if (s[0] == '.')
+	{
+		*value = pc + strtol(&s[1], &end, 10);
+		return true;
+	}
+	if ((s[0] == '-') && (s[1] != 0) && ((p = strchr(pointers, s[1])) != NULL))
+	{
+		*reg = 26 + (2 * (p - pointers));
+		*value = PTR_PRE_DEC;
+		return true;
+	}
+	if ((s[0] != 0) && ((p = strchr(pointers, s[0])) != NULL))
+	{
+		*reg = 26 + (2 * (p - pointers));
+		if (s[1] == '+')
+		{
+			// "Y+" is post increment; "Y+6" is a displacement
+			*value = (s[2] >= '0') && (s[2] <= '9') ? strtol(&s[2], &end, 0) : PTR_POST_INC;
+		}
+		return true;
+	}
+	*value = strtol(s, &end, 0);
+	return end != s;
+}
+
+// Decode the mnemonic and operands of an instruction at address addr
+static bool decode(AvrInsn_t * insn, uint16_t addr, const char * mnemonic, char * operands)
+{
+	uint8_t regs[2] = {0, 0};
+	int32_t values[2] = {0, 0};
+	uint8_t nOperands = 0;
+	uint16_t next = addr + insn->nBytes;
+	const struct Mnemonic_s * def = NULL;
+
+	for (uint16_t i = 0; i < sizeof(mnemonics) / sizeof(mnemonics[0]); ++i)
+	{
+		if (strcmp(mnemonics[i].name, mnemonic) == 0)
+		{
+			def = &mnemonics[i];
+			break;
+		}
+	}
+	if (def == NULL)
+	{
+		return false;
+	}
+
+	for (char * s = strtok(operands, ","); (s != NULL) && (nOperands < 2); s = strtok(NULL, ","))
+	{
+		if (!parse_operand(s, next, &regs[nOperands], &values[nOperands]))
+		{
+			return false;
+		}
+		++nOperands;
+	}
+
+	insn->op = def->op;
+	switch (def->op)
+	{
+	case OP_BRBC:
+	case OP_BRBS:
+	case OP_BCLR:
+	case OP_BSET:
+		insn->b = def->bit;
+		insn->k = values[0];
+		break;
+	case OP_ST:
+	case OP_STD:
+		// Pointer first, then the register stored
+		insn->a = regs[1];
+		insn->b = regs[0];
+		insn->k = values[0];
+		break;
+	case OP_STS:
+	case OP_OUT:
+		insn->a = regs[1];
+		insn->k = values[0];
+		break;
+	case OP_SBI:
+	case OP_CBI:
+	case OP_SBIC:
+	case OP_SBIS:
+		insn->k = values[0];
+		insn->b = values[1];
+		break;
+	case OP_SBRC:
+	case OP_SBRS:
+	case OP_BST:
+	case OP_BLD:
+		insn->a = regs[0];
+		insn->b = values[1];
+		break;
+	case OP_LPM:
+		// "lpm" alone loads r0
+		insn->a = (nOperands == 0) ? 0 : regs[0];
+		insn->k = (nOperands == 0) ? PTR_PLAIN : values[1];
+		break;
+	default:
+		// Register or constant, then register, constant or pointer
+		insn->a = regs[0];
+		insn->b = regs[1];
+		insn->k = (nOperands > 1) ? values[1] : values[0];
+		break;
+	}
+	return true;
+}
+
+// Add a symbol, or find the existing one with that name
+static int32_t add_symbol(AvrSim_t * sim, const char * name, uint16_t addr)
+{
+	int32_t i = avr_sim_symbol(sim, name);
+	if ((i < 0) && (sim->nSymbols < AVR_SIM_MAX_SYMBOLS))
+	{
+		snprintf(sim->symbols[sim->nSymbols].name, sizeof(sim->symbols[0].name), "%s", name);
+		sim->symbols[sim->nSymbols].addr = addr;
+		i = sim->nSymbols++;
+	}
+	return i;
+}
+
+/**********************************************************************
+* Load the instructions and symbols in an avr-objdump -d -S listing.
+* Source and other lines are skipped.  Returns FALSE if the file cannot
+* be read or an instruction is not recognized.
+**********************************************************************/
+bool avr_sim_load(AvrSim_t * sim, const char * path)
+{
+	char line[256];
+	bool ok = true;
+	FILE * f = fopen(path, "r");
+
+	if (f == NULL)
+	{
+		snprintf(sim->error, sizeof(sim->error), "cannot open %s", path);
+		return false;
+	}
+	while (ok && (fgets(line, sizeof(line), f) != NULL))
+	{
+		unsigned int addr;
+		char name[32];
+		char * fields[4] = {NULL, NULL, NULL, NULL};
+		uint8_t nFields = 0;
+
+		line[strcspn(line, "\r\n")] = 0;
+
+		// Symbol: "000010fe <uart_tx_uint16>:"
+		if ((sscanf(line, "%8x <%31[^>]>:", &addr, name) == 2) && (line[0] != ' '))
+		{
+			add_symbol(sim, name, addr);
+			continue;
+		}
+
+		// Instruction: "    10fe:\t1f 93       \tpush\tr17"
+		if ((line[0] != ' ') || (sscanf(line, " %x:", &addr) != 1) || (strchr(line, '\t') == NULL))
+		{
+			continue;
+		}
+		for (char * s = strchr(line, '\t'); (s != NULL) && (nFields < 4); s = strchr(s, '\t'))
+		{
+			*s++ = 0;
+			fields[nFields++] = s;
+		}
+		if ((nFields < 2) || (addr >= AVR_SIM_FLASH_NBYTES))
+		{
+			continue;
+		}
+
+		char * bytes = fields[0];
+		unsigned int byte;
+		int n;
+		uint8_t nBytes = 0;
+		while ((sscanf(bytes, "%2x%n", &byte, &n) == 1) && ((addr + nBytes) < AVR_SIM_FLASH_NBYTES))
+		{
+			sim->flash[addr + nBytes++] = byte;
+			bytes += n;
+		}
+		if (fields[1][0] == '.')
+		{
+			// Data such as ".word": bytes only
+			continue;
+		}
+
+		AvrInsn_t * insn = &sim->insns[addr / 2];
+		insn->nBytes = nBytes;
+		if (!decode(insn, addr, fields[1], (nFields > 2) ? fields[2] : ""))
+		{
+			snprintf(sim->error, sizeof(sim->error), "%s: cannot decode %s at 0x%04x", path, fields[1], addr);
+			ok = false;
+		}
+	}
+	fclose(f);
+	return ok;
+}
+
+// Index of the symbol, or -1 if it is not defined
+int32_t avr_sim_symbol(const AvrSim_t * sim, const char * name)
+{
+	for (uint16_t i = 0; i < sim->nSymbols; ++i)
+	{
+		if (strcmp(sim->symbols[i].name, name) == 0)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Run stub in place of the function name.  Returns FALSE if there is no
+// such symbol.
+bool avr_sim_stub(AvrSim_t * sim, const char * name, AvrStub_t stub)
+{
+	int32_t i = avr_sim_symbol(sim, name);
+	if (i < 0)
+	{
+		return false;
+	}
+	sim->stubs[i] = stub;
+	return true;
+}
+
+/**********************************************************************
+* Execution
+**********************************************************************/
+
+static bool get_flag(const AvrSim_t * sim, uint8_t bit)
+{
+	return (sim->data[AVR_SREG] >> bit) & 1;
+}
+
+static void set_flag(AvrSim_t * sim, uint8_t bit, bool value)
+{
+	sim->data[AVR_SREG] = (sim->data[AVR_SREG] & ~(1 << bit)) | (value << bit);
+}
+
+// Set N, Z and S from the result, with V as given
+static void set_nzvs(AvrSim_t * sim, uint8_t result, bool v)
+{
+	bool n = result >> 7;
+	set_flag(sim, SREG_N, n);
+	set_flag(sim, SREG_Z, result == 0);
+	set_flag(sim, SREG_V, v);
+	set_flag(sim, SREG_S, n ^ v);
+}
+
+static uint8_t add8(AvrSim_t * sim, uint8_t d, uint8_t r, bool carry)
+{
+	uint16_t sum = d + r + carry;
+	uint8_t result = sum;
+	set_flag(sim, SREG_H, ((d & 0x0F) + (r & 0x0F) + carry) > 0x0F);
+	set_flag(sim, SREG_C, sum > 0xFF);
+	set_nzvs(sim, result, ((d ^ result) & (r ^ result) & 0x80) != 0);
+	return result;
+}
+
+// Subtract; if keepZ, Z is only cleared, for the carry forms
+static uint8_t sub8(AvrSim_t * sim, uint8_t d, uint8_t r, bool carry, bool keepZ)
+{
+	uint8_t result = d - r - carry;
+	bool z = get_flag(sim, SREG_Z);
+	set_flag(sim, SREG_H, ((r & 0x0F) + carry) > (d & 0x0F));
+	set_flag(sim, SREG_C, (r + carry) > d);
+	set_nzvs(sim, result, ((d ^ r) & (d ^ result) & 0x80) != 0);
+	if (keepZ)
+	{
+		set_flag(sim, SREG_Z, z && (result == 0));
+	}
+	return result;
+}
+
+// Shift right flags: C is the bit shifted out
+static uint8_t shift_right(AvrSim_t * sim, uint8_t d, uint8_t top)
+{
+	uint8_t result = (d >> 1) | top;
+	bool c = d & 1;
+	set_flag(sim, SREG_C, c);
+	set_nzvs(sim, result, (result >> 7) ^ c);
+	return result;
+}
+
+static uint16_t get_sp(const AvrSim_t * sim)
+{
+	return sim->data[AVR_SPL] | (sim->data[AVR_SPH] << 8);
+}
+
+static void set_sp(AvrSim_t * sim, uint16_t sp)
+{
+	sim->data[AVR_SPL] = sp;
+	sim->data[AVR_SPH] = sp >> 8;
+}
+
+static void push(AvrSim_t * sim, uint8_t value)
+{
+	uint16_t sp = get_sp(sim);
+	sim->data[sp] = value;
+	set_sp(sim, sp - 1);
+}
+
+static uint8_t pop(AvrSim_t * sim)
+{
+	uint16_t sp = get_sp(sim) + 1;
+	set_sp(sim, sp);
+	return sim->data[sp];
+}
+
+// Read the data space, adding the extra cycle for mapped flash
+static uint8_t read_data(AvrSim_t * sim, uint16_t addr)
+{
+	if (addr >= AVR_SIM_MAPPED_FLASH)
+	{
+		++sim->cycles;
+		return sim->flash[(addr - AVR_SIM_MAPPED_FLASH) % AVR_SIM_FLASH_NBYTES];
+	}
+	return sim->data[addr];
+}
+
+static void write_data(AvrSim_t * sim, uint16_t addr, uint8_t value)
+{
+	// Writes to mapped flash are ignored, as on the hardware
+	if (addr < AVR_SIM_MAPPED_FLASH)
+	{
+		sim->data[addr] = value;
+	}
+}
+
+static uint16_t get_word(const AvrSim_t * sim, uint8_t reg)
+{
+	return sim->r[reg] | (sim->r[reg + 1] << 8);
+}
+
+static void set_word(AvrSim_t * sim, uint8_t reg, uint16_t value)
+{
+	sim->r[reg] = value;
+	sim->r[reg + 1] = value >> 8;
+}
+
+// Address for LD/ST through a pointer register, updating the pointer
+static uint16_t pointer_address(AvrSim_t * sim, uint8_t reg, int32_t mode)
+{
+	uint16_t ptr = get_word(sim, reg);
+	if (mode == PTR_POST_INC)
+	{
+		set_word(sim, reg, ptr + 1);
+	}
+	else if (mode == PTR_PRE_DEC)
+	{
+		set_word(sim, reg, --ptr);
+	}
+	return ptr;
+}
+
+// Skip the next instruction if skip is TRUE.  Costs one cycle per word
+// skipped.
+static uint16_t skip_next(AvrSim_t * sim, uint16_t next, bool skip)
+{
+	if (!skip)
+	{
+		return next;
+	}
+	uint8_t nBytes = sim->insns[next / 2].nBytes;
+	sim->cycles += nBytes / 2;
+	return next + nBytes;
+}
+
+// Transfer control to addr as a call (return address next) or a jump.
+// Returns the new program counter.  A call or jump to a stubbed function
+// runs the stub and returns as the function's RET would, at its 4
+// cycles.
+static uint16_t transfer(AvrSim_t * sim, uint16_t addr, uint16_t next, bool isCall)
+{
+	for (uint16_t i = 0; i < sim->nSymbols; ++i)
+	{
+		if ((sim->symbols[i].addr == addr) && (sim->stubs[i] != NULL))
+		{
+			sim->stubs[i](sim);
+			sim->cycles += 4;
+			if (isCall)
+			{
+				return next;
+			}
+			uint16_t word = pop(sim) << 8;
+			word |= pop(sim);
+			return word * 2;
+		}
+	}
+	if (isCall)
+	{
+		uint16_t word = next / 2;
+		push(sim, word);
+		push(sim, word >> 8);
+	}
+	return addr;
+}
+
+/**********************************************************************
+* Call the function at addr with the registers and data as set up by the
+* caller, and run it until it returns.  r1 is set to zero and the stack
+* to the top of SRAM, as the C runtime does.  Returns the number of
+* cycles from the first instruction to the end of the RET, or -1 if the
+* function runs for more than maxCycles or reaches an instruction that
+* is not in the listing; sim->error then says which.
+**********************************************************************/
+int32_t avr_sim_call(AvrSim_t * sim, uint16_t addr, uint32_t maxCycles)
+{
+	sim->r[1] = 0;
+	set_sp(sim, AVR_SIM_RAMEND);
+	push(sim, (uint8_t)AVR_SIM_RETURN_WORD);
+	push(sim, AVR_SIM_RETURN_WORD >> 8);
+	sim->pc = addr;
+	sim->cycles = 0;
+
+	while (sim->cycles <= maxCycles)
+	{
+		if (sim->pc == AVR_SIM_RETURN_ADDR)
+		{
+			return sim->cycles;
+		}
+
+		const AvrInsn_t * insn = &sim->insns[sim->pc / 2];
+		uint16_t next = sim->pc + insn->nBytes;
+		uint8_t * rd = &sim->r[insn->a];
+		uint8_t rr = sim->r[insn->b];
+		uint8_t k = insn->k;
+		uint16_t word;
+
+		++sim->cycles;
+		switch (insn->op)
+		{
+		case OP_NONE:
+			snprintf(sim->error, sizeof(sim->error), "no instruction at 0x%04x", sim->pc);
+			return -1;
+		case OP_ADC:
+			*rd = add8(sim, *rd, rr, get_flag(sim, SREG_C));
+			break;
+		case OP_ADD:
+			*rd = add8(sim, *rd, rr, false);
+			break;
+		case OP_SUB:
+			*rd = sub8(sim, *rd, rr, false, false);
+			break;
+		case OP_SUBI:
+			*rd = sub8(sim, *rd, k, false, false);
+			break;
+		case OP_SBC:
+			*rd = sub8(sim, *rd, rr, get_flag(sim, SREG_C), true);
+			break;
+		case OP_SBCI:
+			*rd = sub8(sim, *rd, k, get_flag(sim, SREG_C), true);
+			break;
+		case OP_CP:
+			sub8(sim, *rd, rr, false, false);
+			break;
+		case OP_CPI:
+			sub8(sim, *rd, k, false, false);
+			break;
+		case OP_CPC:
+			sub8(sim, *rd, rr, get_flag(sim, SREG_C), true);
+			break;
+		case OP_NEG:
+			*rd = sub8(sim, 0, *rd, false, false);
+			break;
+		case OP_ADIW:
+		case OP_SBIW:
+		{
+			uint16_t d = get_word(sim, insn->a);
+			uint16_t result = (insn->op == OP_ADIW) ? (d + insn->k) : (d - insn->k);
+			bool v = (insn->op == OP_ADIW) ? (!(d & 0x8000) && (result & 0x8000))
+				: ((d & 0x8000) && !(result & 0x8000));
+			set_word(sim, insn->a, result);
+			set_flag(sim, SREG_C, (insn->op == OP_ADIW) ? (result < d) : (insn->k > d));
+			set_flag(sim, SREG_N, result >> 15);
+			set_flag(sim, SREG_Z, result == 0);
+			set_flag(sim, SREG_V, v);
+			set_flag(sim, SREG_S, (result >> 15) ^ v);
+			++sim->cycles;
+			break;
+		}
+		case OP_AND:
+			*rd &= rr;
+			set_nzvs(sim, *rd, false);
+			break;
+		case OP_ANDI:
+			*rd &= k;
+			set_nzvs(sim, *rd, false);
+			break;
+		case OP_OR:
+			*rd |= rr;
+			set_nzvs(sim, *rd, false);
+			break;
+		case OP_ORI:
+			*rd |= k;
+			set_nzvs(sim, *rd, false);
+			break;
+		case OP_EOR:
+			*rd ^= rr;
+			set_nzvs(sim, *rd, false);
+			break;
+		case OP_COM:
+			*rd = ~*rd;
+			set_flag(sim, SREG_C, true);
+			set_nzvs(sim, *rd, false);
+			break;
+		case OP_INC:
+			++*rd;
+			set_nzvs(sim, *rd, *rd == 0x80);
+			break;
+		case OP_DEC:
+			--*rd;
+			set_nzvs(sim, *rd, *rd == 0x7F);
+			break;
+		case OP_LSR:
+			*rd = shift_right(sim, *rd, 0);
+			break;
+		case OP_ROR:
+			*rd = shift_right(sim, *rd, get_flag(sim, SREG_C) << 7);
+			break;
+		case OP_ASR:
+			*rd = shift_right(sim, *rd, *rd & 0x80);
+			break;
+		case OP_SWAP:
+			*rd = (*rd << 4) | (*rd >> 4);
+			break;
+		case OP_MUL:
+		case OP_MULS:
+		case OP_MULSU:
+		{
+			int32_t d = (insn->op == OP_MUL) ? *rd : (int8_t)*rd;
+			int32_t r = (insn->op == OP_MULS) ? (int8_t)rr : rr;
+			uint16_t product = d * r;
+			set_word(sim, 0, product);
+			set_flag(sim, SREG_C, product >> 15);
+			set_flag(sim, SREG_Z, product == 0);
+			++sim->cycles;
+			break;
+		}
+		case OP_MOV:
+			*rd = rr;
+			break;
+		case OP_MOVW:
+			set_word(sim, insn->a, get_word(sim, insn->b));
+			break;
+		case OP_LDI:
+			*rd = k;
+			break;
+		case OP_BSET:
+		case OP_BCLR:
+			set_flag(sim, insn->b, insn->op == OP_BSET);
+			break;
+		case OP_BST:
+			set_flag(sim, SREG_T, (*rd >> insn->b) & 1);
+			break;
+		case OP_BLD:
+			*rd = (*rd & ~(1 << insn->b)) | (get_flag(sim, SREG_T) << insn->b);
+			break;
+		case OP_IN:
+			*rd = sim->data[insn->k];
+			break;
+		case OP_OUT:
+			sim->data[insn->k] = *rd;
+			break;
+		case OP_SBI:
+		case OP_CBI:
+			sim->data[insn->k] = (sim->data[insn->k] & ~(1 << insn->b)) | ((insn->op == OP_SBI) << insn->b);
+			break;
+		case OP_LD:
+			*rd = read_data(sim, pointer_address(sim, insn->b, insn->k));
+			++sim->cycles;
+			break;
+		case OP_LDD:
+			*rd = read_data(sim, get_word(sim, insn->b) + insn->k);
+			++sim->cycles;
+			break;
+		case OP_LDS:
+			*rd = read_data(sim, insn->k);
+			sim->cycles += 2;
+			break;
+		case OP_LPM:
+			*rd = sim->flash[pointer_address(sim, 30, insn->k) % AVR_SIM_FLASH_NBYTES];
+			sim->cycles += 2;
+			break;
+		case OP_ST:
+			write_data(sim, pointer_address(sim, insn->b, insn->k), *rd);
+			break;
+		case OP_STD:
+			write_data(sim, get_word(sim, insn->b) + insn->k, *rd);
+			break;
+		case OP_STS:
+			write_data(sim, insn->k, *rd);
+			++sim->cycles;
+			break;
+		case OP_PUSH:
+			push(sim, *rd);
+			break;
+		case OP_POP:
+			*rd = pop(sim);
+			++sim->cycles;
+			break;
+		case OP_CPSE:
+			next = skip_next(sim, next, *rd == rr);
+			break;
+		case OP_SBRC:
+		case OP_SBRS:
+			next = skip_next(sim, next, ((*rd >> insn->b) & 1) == (insn->op == OP_SBRS));
+			break;
+		case OP_SBIC:
+		case OP_SBIS:
+			next = skip_next(sim, next, ((sim->data[insn->k] >> insn->b) & 1) == (insn->op == OP_SBIS));
+			break;
+		case OP_BRBS:
+		case OP_BRBC:
+			if (get_flag(sim, insn->b) == (insn->op == OP_BRBS))
+			{
+				++sim->cycles;
+				next = insn->k;
+			}
+			break;
+		case OP_RJMP:
+			++sim->cycles;
+			next = transfer(sim, insn->k, next, false);
+			break;
+		case OP_JMP:
+			sim->cycles += 2;
+			next = transfer(sim, insn->k, next, false);
+			break;
+		case OP_IJMP:
+			++sim->cycles;
+			next = transfer(sim, get_word(sim, 30) * 2, next, false);
+			break;
+		case OP_RCALL:
+			++sim->cycles;
+			next = transfer(sim, insn->k, next, true);
+			break;
+		case OP_CALL:
+			sim->cycles += 2;
+			next = transfer(sim, insn->k, next, true);
+			break;
+		case OP_ICALL:
+			++sim->cycles;
+			next = transfer(sim, get_word(sim, 30) * 2, next, true);
+			break;
+		case OP_RET:
+		case OP_RETI:
+			sim->cycles += 3;
+			word = pop(sim) << 8;
+			word |= pop(sim);
+			next = word * 2;
+			break;
+		case OP_NOP:
+		default:
+			break;
+		}
+		sim->pc = next;
+	}
+	snprintf(sim->error, sizeof(sim->error), "more than %u cycles", maxCycles);
+	return -1;
+}
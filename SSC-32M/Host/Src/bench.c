@@ -0,0 +1,320 @@
+/*
+ * bench.c
+ *
+ * Host benchmark of the servo controller hot paths.  Runs the firmware
+ * modules against the host hardware model and reports the cost of
+ * servo_pulse_update(), servo_calculations_update() and
+ * parse_commands_update() over realistic command streams.  Also checks
+ * that the pulse widths output by the edge ISR match the pulse array,
+ * so that an optimization that breaks the pulse train fails the run.
+ *
+ * This file holds the helpers shared by the benchmarks and checks, and
+ * main().  The benchmarks and checks for each firmware module are in
+ * bench_<module>.c.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <avr/io.h>
+
+#include "../../Include/globals.h"
+#include "../../Include/timer.h"
+#include "../../Include/uart.h"
+#include "../../Include/parse_commands.h"
+#include "../../Include/servo_pulse.h"
+#include "../../Include/servo_calculations.h"
+#include "../../Include/adc.h"
+#include "../../Include/servo_current.h"
+#include "../../Include/servo_control.h"
+#include "../Include/host_hw.h"
+#include "../Include/bench.h"
+
+// Cost of reading the clock twice, subtracted from each measurement
+static uint64_t clockOverheadNs;
+// Number of failed checks
+static uint16_t checkFailures;
+// Scratch buffer for transmitted bytes
+char txBuf[512];
+
+/**********************************************************************
+* Timing helpers
+**********************************************************************/
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void calibrate_clock(void)
+{
+	clockOverheadNs = UINT64_MAX;
+	for (uint16_t i = 0; i < 1000; ++i)
+	{
+		uint64_t start = now_ns();
+		uint64_t elapsed = now_ns() - start;
+		if (elapsed < clockOverheadNs)
+		{
+			clockOverheadNs = elapsed;
+		}
+	}
+}
+
+void stat_add(BenchStat_t * stat, uint64_t startNs)
+{
+	uint64_t elapsed = now_ns() - startNs;
+	elapsed = (elapsed > clockOverheadNs) ? (elapsed - clockOverheadNs) : 0;
+	++stat->calls;
+	stat->totalNs += elapsed;
+	if (elapsed > stat->worstNs)
+	{
+		stat->worstNs = elapsed;
+	}
+}
+
+void stat_print(const BenchStat_t * stat)
+{
+	printf("%-40s %8u %10.1f %10llu\n", stat->name, stat->calls,
+		stat->calls ? (double)stat->totalNs / stat->calls : 0.0,
+		(unsigned long long)stat->worstNs);
+}
+
+/**********************************************************************
+* Check helpers
+**********************************************************************/
+
+// Print the result line of a check, with the details given by format,
+// and count it if it failed
+void check_report(const char * name, bool failed, const char * format, ...)
+{
+	va_list args;
+
+	printf("check %-34s %s (", name, failed ? "FAIL" : "ok");
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+	printf(")\n");
+	checkFailures += failed;
+}
+
+// Step the pseudo-random sequence and return the new value
+uint32_t next_random(uint32_t * seed)
+{
+	*seed = (*seed * 1103515245UL) + 12345UL;
+	return *seed;
+}
+
+// CRC-8 (polynomial 0x07) of a binary frame, as in parse_commands.h.
+// Over a frame including its CRC byte, the result is 0.
+uint8_t crc8(const uint8_t * bytes, uint16_t nBytes)
+{
+	uint8_t crc = 0;
+	for (uint16_t i = 0; i < nBytes; ++i)
+	{
+		crc ^= bytes[i];
+		for (uint8_t bit = 0; bit < 8; ++bit)
+		{
+			crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1);
+		}
+	}
+	return crc;
+}
+
+/**********************************************************************
+* Firmware helpers
+**********************************************************************/
+
+// Reset the hardware model and run the firmware inits in the same
+// order as main().
+void firmware_init(void)
+{
+	host_hw_reset();
+	for (uint8_t channel = 0; channel < 16; ++channel)
+	{
+		host_adc_set_input(channel, 300 + (channel * 37));
+	}
+	uart_init();
+	adc_init();
+	servo_current_init();
+	servo_control_init();
+	parse_commands_init();
+	servo_calculations_init();
+	servo_pulse_init();
+	timer_init();
+}
+
+// One pass of the main loop, with one ADC conversion completed first
+void main_loop_pass(void)
+{
+	host_adc_complete();
+	uart_update();
+	servo_current_update();
+	parse_commands_update();
+	servo_calculations_update();
+	servo_pulse_update();
+}
+
+void main_loop_passes(uint8_t nPasses)
+{
+	for (uint8_t pass = 0; pass < nPasses; ++pass)
+	{
+		main_loop_pass();
+	}
+}
+
+// Deliver a command string to the firmware and parse it.  A command
+// longer than the RX queue is delivered in pieces, as from a sender held
+// back by flow control.
+void rx_command(const char * cmd)
+{
+	uint16_t nBytes = strlen(cmd);
+	while (nBytes > 0)
+	{
+		uint16_t pieceNBytes = (nBytes > 128) ? 128 : nBytes;
+		host_uart_rx(cmd, pieceNBytes);
+		parse_commands_update();
+		cmd += pieceNBytes;
+		nBytes -= pieceNBytes;
+	}
+}
+
+// Send a command string and run the main loop until it is consumed
+void send_command(const char * cmd)
+{
+	host_uart_rx(cmd, strlen(cmd));
+	main_loop_passes(4);
+	host_uart_tx_drain(txBuf, sizeof(txBuf));
+}
+
+// Send a command string, run the main loop until it is consumed, and
+// compare the bytes sent back with the expected reply
+bool reply_is(const char * cmd, const char * reply)
+{
+	host_uart_rx(cmd, strlen(cmd));
+	main_loop_passes(4);
+	tx_drain_string();
+	return strcmp(txBuf, reply) == 0;
+}
+
+// Drain the bytes sent into txBuf as a string.  Returns the number of
+// bytes.
+uint16_t tx_drain_string(void)
+{
+	uint16_t nBytes = host_uart_tx_drain(txBuf, sizeof(txBuf) - 1);
+	txBuf[nBytes] = 0;
+	return nBytes;
+}
+
+// Run frames until all servos reach their targets
+void run_until_settled(void)
+{
+	for (uint16_t frame = 0; frame < 2000; ++frame)
+	{
+		bool moving = false;
+		for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+		{
+			if (ServoPulseDefs[servoNum].currentPW_l16 != ((uint32_t)ServoPulseDefs[servoNum].targetPW << 16))
+			{
+				moving = true;
+			}
+		}
+		if (!moving)
+		{
+			break;
+		}
+		host_timer_run_frame(0);
+		main_loop_pass();
+	}
+}
+
+// Run frames with zero interrupt latency
+void run_frames(uint16_t nFrames)
+{
+	for (uint16_t frame = 0; frame < nFrames; ++frame)
+	{
+		host_timer_run_frame(0);
+		main_loop_pass();
+	}
+}
+
+// Put every servo at 1500us
+void center_servos(void)
+{
+	char cmd[BENCH_CMD_NBYTES];
+	char * p = cmd;
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		p += sprintf(p, "#%uP1500 ", servoNum);
+	}
+	sprintf(p, "\r");
+	send_command(cmd);
+}
+
+// Complete a scan of all ADC channels
+void adc_scan(void)
+{
+	for (uint8_t channel = 0; channel < NUM_ADC_CHANNELS; ++channel)
+	{
+		host_adc_complete();
+	}
+}
+
+// Position feedback voltage reported for a servo, from the ADC inputs
+// set by firmware_init()
+uint16_t position_millivolts(uint8_t servoNum)
+{
+	return (servoNum < NUM_POSITION_INPUTS) ? adc_to_millivolts(300 + (servoNum * 37)) : 0;
+}
+
+// Build a move command for every servo, with pseudo-random positions
+void make_group_move(char * cmd, uint32_t * seed, uint16_t moveTime)
+{
+	char * p = cmd;
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		uint16_t pw = 900 + ((next_random(seed) >> 16) % 1200);
+		p += sprintf(p, "#%uP%u ", servoNum, pw);
+	}
+	sprintf(p, "T%u\r", moveTime);
+}
+
+int main(void)
+{
+	calibrate_clock();
+	printf("%-40s %8s %10s %10s\n", "benchmark", "calls", "mean ns", "worst ns");
+	bench_servo_pulse();
+	bench_profiles();
+	bench_edge_isr();
+	bench_servo_calculations();
+	bench_move_math_check();
+	bench_interpolation();
+	bench_profile_check();
+	bench_queue_check();
+	bench_binary_check();
+	bench_baud_check();
+	bench_trie_check();
+	bench_dispatch_check();
+	bench_rx_flow_check();
+	bench_rx_headroom();
+	bench_parse_commands();
+	bench_format();
+	bench_adc_check();
+	bench_bulk_query_check();
+	bench_telemetry_check();
+	bench_current_check();
+	bench_control_check();
+	bench_frame_check();
+	bench_pulse_check();
+	if (checkFailures != 0)
+	{
+		printf("%u check failures\n", checkFailures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * bench_adc.c
+ *
+ * Check of the ADC scan and snapshot.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <avr/io.h>
+
+#include "../../Include/globals.h"
+#include "../../Include/adc.h"
+#include "../Include/host_hw.h"
+#include "../Include/bench.h"
+
+/**********************************************************************
+* ADC scan check.  The result ready ISR must scan all channels without
+* help from the main loop, then stop until the last edge of the next
+* frame starts the scan again.  A snapshot must only show complete
+* scans, with the sequence number counting them.
+**********************************************************************/
+void bench_adc_check(void)
+{
+	uint16_t results[NUM_ADC_CHANNELS];
+	uint16_t errors = 0;
+
+	firmware_init();
+	errors += (adc_snapshot(results) != 0) || (results[0] != 0);
+	adc_scan();
+	errors += (adc_snapshot(results) != 1);
+	for (uint8_t channel = 0; channel < NUM_ADC_CHANNELS; ++channel)
+	{
+		errors += (results[channel] != 300 + (channel * 37));
+	}
+	host_adc_complete();
+	errors += (ADC0_COMMAND != 0) || (ADC0_MUXPOS != 0) || (adc_snapshot(results) != 1);
+
+	// Step channel 3 and run a frame.  The new value must not show
+	// until the scan is complete, then move 1/2 of the way to the input.
+	host_adc_set_input(3, 800);
+	host_timer_run_frame(0);
+	errors += (ADC0_COMMAND != ADC_STCONV_bm);
+	for (uint8_t channel = 0; channel < 4; ++channel)
+	{
+		host_adc_complete();
+	}
+	errors += (adc_snapshot(results) != 1) || (results[3] != 411) || (adc_read_filtered(3) != 411);
+	for (uint8_t channel = 4; channel < NUM_ADC_CHANNELS; ++channel)
+	{
+		host_adc_complete();
+	}
+	uint16_t expect = ((411 * ADC_NUM_SAMPLES) + (800 * ADC_NUM_SAMPLES)) / 2 / ADC_NUM_SAMPLES;
+	errors += (adc_snapshot(results) != 2) || (results[3] != expect) || (adc_read_filtered(3) != expect);
+	errors += (results[2] != 374) || (results[12] != 744);
+
+	check_report("ADC scan and snapshot", (errors != 0), "%u errors", errors);
+}
@@ -0,0 +1,656 @@
+/*
+ * bench_parse_commands.c
+ *
+ * Checks and benchmarks of the command parser: binary frames, command
+ * dispatch, parse cost, bulk queries and telemetry.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <avr/io.h>
+
+#include "../../Include/globals.h"
+#include "../../Include/parse_commands.h"
+#include "../../Include/servo_calculations.h"
+#include "../../Include/adc.h"
+#include "../Include/host_hw.h"
+#include "../Include/bench.h"
+
+// Build a binary move frame (see parse_commands.h).  Returns the frame
+// length in bytes.
+static uint8_t make_binary_move(uint8_t * frame, const bool * commanded, const uint16_t * pw,
+	const uint16_t * speed, uint16_t moveTime, uint8_t flags)
+{
+	uint8_t * p = &frame[3];
+	uint8_t * mask = &frame[6];
+	*p++ = flags;
+	*p++ = moveTime & 0xFF;
+	*p++ = moveTime >> 8;
+	memset(mask, 0, BIN_MASK_NBYTES);
+	p += BIN_MASK_NBYTES;
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		if (commanded[servoNum])
+		{
+			mask[servoNum / 8] |= 1 << (servoNum % 8);
+			*p++ = pw[servoNum] & 0xFF;
+			*p++ = pw[servoNum] >> 8;
+		}
+	}
+	for (uint8_t servoNum = 0; (flags & BIN_MOVE_SPEED) && (servoNum < NUM_SERVOS); ++servoNum)
+	{
+		if (commanded[servoNum])
+		{
+			*p++ = speed[servoNum] & 0xFF;
+			*p++ = speed[servoNum] >> 8;
+		}
+	}
+	frame[0] = BIN_FRAME_SYNC;
+	frame[1] = p - &frame[3];
+	frame[2] = BIN_OP_MOVE;
+	*p = crc8(&frame[1], p - &frame[1]);
+	++p;
+	return p - frame;
+}
+
+// Build the same 12 servo move as make_group_move() as a binary frame
+static uint8_t make_binary_group_move(uint8_t * frame, uint32_t * seed, uint16_t moveTime)
+{
+	bool commanded[NUM_SERVOS];
+	uint16_t pw[NUM_SERVOS];
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		next_random(seed);
+		commanded[servoNum] = true;
+		pw[servoNum] = 900 + ((*seed >> 16) % 1200);
+	}
+	return make_binary_move(frame, commanded, pw, NULL, moveTime, 0);
+}
+
+/**********************************************************************
+* Binary frame check.  Random move commands are sent as ASCII lines and
+* as binary frames, and must give the same command.  Frames with a bad
+* CRC or length must be dropped and counted, and must not stop the
+* ASCII command after them.
+**********************************************************************/
+static void clear_staged_command(void)
+{
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		ServoCmdArray[servoNum].isCommanded = false;
+		ServoCmdArray[servoNum].targetSpeed = 65535;
+		ServoCmdArray[servoNum].targetPW = 0;
+	}
+	ServoCmdMoveTime = 0;
+	ServoCmdSequenced = false;
+	ServoCmdWaiting = false;
+}
+
+void bench_binary_check(void)
+{
+	char cmd[BENCH_CMD_NBYTES];
+	uint8_t frame[8 + BIN_MAX_PAYLOAD_NBYTES];
+	uint32_t seed = 11;
+	uint16_t mismatches = 0;
+	uint16_t errors = 0;
+
+	firmware_init();
+	for (uint16_t moveNum = 0; moveNum < 1000; ++moveNum)
+	{
+		bool commanded[NUM_SERVOS];
+		uint16_t pw[NUM_SERVOS];
+		uint16_t speed[NUM_SERVOS];
+		uint8_t flags = moveNum & (BIN_MOVE_SEQ | BIN_MOVE_SPEED);
+		char * p = cmd;
+		for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+		{
+			next_random(&seed);
+			commanded[servoNum] = (seed >> 28) != 0;
+			pw[servoNum] = ((seed >> 24) == 0) ? 0 : (MINIMUM_PW + ((seed >> 8) % (MAXIMUM_PW - MINIMUM_PW + 1)));
+			speed[servoNum] = seed >> 12;
+			if (!commanded[servoNum])
+				continue;
+			p += (pw[servoNum] == 0) ? sprintf(p, "#%uL", servoNum) : sprintf(p, "#%uP%u", servoNum, pw[servoNum]);
+			if (flags & BIN_MOVE_SPEED)
+			{
+				p += sprintf(p, "S%u", speed[servoNum]);
+			}
+		}
+		uint16_t moveTime = seed >> 16;
+		sprintf(p, "T%u%s\r", moveTime, (flags & BIN_MOVE_SEQ) ? "SEQ" : "");
+
+		rx_command(cmd);
+		ServoCmd_t asciiCmd[NUM_SERVOS];
+		memcpy(asciiCmd, ServoCmdArray, sizeof(asciiCmd));
+		ServoCmdMoveTime_t asciiTime = ServoCmdMoveTime;
+		bool asciiSeq = ServoCmdSequenced;
+		clear_staged_command();
+
+		uint8_t len = make_binary_move(frame, commanded, pw, speed, moveTime, flags);
+		host_uart_rx((const char *)frame, len);
+		parse_commands_update();
+		if (!ServoCmdWaiting || (memcmp(asciiCmd, ServoCmdArray, sizeof(asciiCmd)) != 0)
+			|| (asciiTime != ServoCmdMoveTime) || (asciiSeq != ServoCmdSequenced))
+		{
+			++mismatches;
+		}
+		clear_staged_command();
+	}
+
+	// Corrupt frames followed by an ASCII command
+	uint16_t prevErrors = BinaryFrameErrorCount;
+	bool commanded[NUM_SERVOS] = {true};
+	uint16_t pw[NUM_SERVOS] = {1234};
+	uint8_t len = make_binary_move(frame, commanded, pw, NULL, 0, 0);
+	frame[len - 1] ^= 0x01;		// Bad CRC
+	host_uart_rx((const char *)frame, len);
+	frame[len - 1] ^= 0x01;
+	frame[1] -= 2;				// Good CRC, but too short for the mask
+	frame[len - 3] = crc8(&frame[1], len - 4);
+	host_uart_rx((const char *)frame, len - 2);
+	host_uart_rx("#1P1600\r", 8);
+	parse_commands_update();
+	if (!ServoCmdWaiting || ServoCmdArray[0].isCommanded || (ServoCmdArray[1].targetPW != 1600)
+		|| (BinaryFrameErrorCount != prevErrors + 2))
+	{
+		++errors;
+	}
+	clear_staged_command();
+
+	check_report("binary frames vs ASCII", (mismatches || errors), "%u mismatches, %u errors",
+		mismatches, errors);
+}
+
+/**********************************************************************
+* Command trie check.  The trie in parse_commands.c is generated here
+* from the command table, and must match it.  If it does not, the new
+* trie is printed, to be pasted over parseTrie[].
+**********************************************************************/
+#define TRIE_MAX_NODES (PARSE_TRIE_NONE - 1)
+static TrieNode_t trieNodes[TRIE_MAX_NODES];
+static char triePrefixes[TRIE_MAX_NODES][8];
+static uint8_t trieNNodes;
+static const char * trieCommands[PARSE_TRIE_NONE];
+
+// Trie symbol of a command character, as trieSymbol() in parse_commands.c
+static uint8_t trie_symbol(char ch)
+{
+	if (ch == '#')
+	{
+		return 0;
+	}
+	return ((ch >= 'A') && (ch <= 'Z')) ? (ch - 'A' + 1) : PARSE_TRIE_NONE;
+}
+
+// Build the trie below a node from the commands lo to hi - 1, which all
+// start with the node's prefix of depth characters.  The table is
+// sorted, so the commands sharing a longer prefix are consecutive, and
+// the command equal to the prefix (if any) is first.  Returns false if a
+// command has a character that cannot be typed, or the trie is too big.
+static bool trie_build(uint8_t node, uint8_t depth, uint8_t lo, uint8_t hi)
+{
+	TrieNode_t * trieNode = &trieNodes[node];
+	memset(trieNode->symbols, 0, sizeof(trieNode->symbols));
+	trieNode->cmdIdx = PARSE_TRIE_NONE;
+	if ((lo < hi) && (trieCommands[lo][depth] == 0))
+	{
+		trieNode->cmdIdx = lo++;
+	}
+
+	// Allocate the children together, one for each distinct next
+	// character
+	trieNode->firstChild = trieNNodes;
+	for (uint8_t i = lo; i < hi; ++i)
+	{
+		uint8_t symbol = trie_symbol(trieCommands[i][depth]);
+		if ((symbol == PARSE_TRIE_NONE) || (depth >= (sizeof(triePrefixes[0]) - 1)))
+		{
+			return false;
+		}
+		uint8_t bit = 1 << (symbol & 7);
+		if (trieNode->symbols[symbol >> 3] & bit)
+		{
+			continue;
+		}
+		if (trieNNodes >= TRIE_MAX_NODES)
+		{
+			return false;
+		}
+		trieNode->symbols[symbol >> 3] |= bit;
+		snprintf(triePrefixes[trieNNodes], sizeof(triePrefixes[0]), "%.*s", depth + 1, trieCommands[i]);
+		++trieNNodes;
+	}
+
+	// A leaf's first child is never read; leave it 0
+	if (trieNode->firstChild == trieNNodes)
+	{
+		trieNode->firstChild = 0;
+	}
+
+	// Build each child from the commands starting with its character
+	uint8_t child = trieNode->firstChild;
+	while (lo < hi)
+	{
+		uint8_t end = lo + 1;
+		while ((end < hi) && (trieCommands[end][depth] == trieCommands[lo][depth]))
+		{
+			++end;
+		}
+		if (!trie_build(child, depth + 1, lo, end))
+		{
+			return false;
+		}
+		++child;
+		lo = end;
+	}
+	return true;
+}
+
+void bench_trie_check(void)
+{
+	uint8_t nCommands = 0;
+	uint8_t nNodes;
+	const TrieNode_t * trie = parse_commands_trie(&nNodes);
+	bool ok = true;
+
+	// The table must be sorted, so the commands sharing a prefix are
+	// consecutive
+	while ((nCommands < PARSE_TRIE_NONE) && ((trieCommands[nCommands] = parse_commands_string(nCommands)) != NULL))
+	{
+		if ((nCommands > 0) && (strcmp(trieCommands[nCommands - 1], trieCommands[nCommands]) >= 0))
+		{
+			ok = false;
+		}
+		++nCommands;
+	}
+	trieNNodes = 1;
+	triePrefixes[0][0] = 0;
+	ok = ok && trie_build(0, 0, 0, nCommands);
+	if (!ok)
+	{
+		check_report("command trie", true, "command table not sorted, bad character or too big");
+		return;
+	}
+
+	bool match = (nNodes == trieNNodes) && (memcmp(trie, trieNodes, nNodes * sizeof(TrieNode_t)) == 0);
+	if (!match)
+	{
+		printf("parseTrie[] in parse_commands.c does not match ParseTable.  Replace it with:\n");
+		for (uint8_t i = 0; i < trieNNodes; ++i)
+		{
+			const TrieNode_t * trieNode = &trieNodes[i];
+			char cmdIdx[16] = "PARSE_TRIE_NONE";
+			if (trieNode->cmdIdx != PARSE_TRIE_NONE)
+			{
+				snprintf(cmdIdx, sizeof(cmdIdx), "%u", trieNode->cmdIdx);
+			}
+			printf("\t{{0x%02X, 0x%02X, 0x%02X, 0x%02X}, %u, %s},\t// %s\n", trieNode->symbols[0],
+				trieNode->symbols[1], trieNode->symbols[2], trieNode->symbols[3], trieNode->firstChild,
+				cmdIdx, (i == 0) ? "Root" : triePrefixes[i]);
+		}
+	}
+	check_report("command trie", !match, "%u commands, %u nodes, %u bytes of flash", nCommands,
+		trieNNodes, (unsigned int)(trieNNodes * sizeof(TrieNode_t)));
+}
+
+/**********************************************************************
+* Command dispatch check.  Every command must be recognized in upper or
+* lower case, and prefixes or extensions of commands must not be.
+**********************************************************************/
+void bench_dispatch_check(void)
+{
+	static const char * const lines[][2] =
+	{
+		{"ver\r", "V0.1 ALPHA INTCLK\r"},
+		{"VE\r VERR\r SE\r QQ\r #0QPX\r", ""},
+		{"#0Q\r", "*0Q1\r"},
+		{"#0P1500 #1P1500\r #0P1000 #1p1200 t1000\r #0q #1Q\r", "*0Q4\r*1Q4\r"},
+		{"QF\r #0H #1h #0Q #1Q\r", "*QF8\r*0Q6\r*1Q6\r"},
+		{"#12QJ\r", "*12QJ0 0 0 0 0 0 0 0 0 0\r"},
+		{"CJ QB\r", "*QB0 0 0\r"},
+		{"#0PP1200 #0Q\r", "*0Q6\r"},
+	};
+	uint16_t errors = 0;
+
+	firmware_init();
+	for (uint8_t i = 0; i < sizeof(lines) / sizeof(lines[0]); ++i)
+	{
+		host_uart_rx(lines[i][0], strlen(lines[i][0]));
+		main_loop_passes(8);
+		tx_drain_string();
+		if (strcmp(txBuf, lines[i][1]) != 0)
+		{
+			++errors;
+		}
+	}
+
+	check_report("command dispatch", (errors != 0), "%u errors", errors);
+}
+
+/**********************************************************************
+* The previous ASCII tokenizer, for comparison: characters are copied
+* into a token, and alpha tokens are looked up by a linear strcmp()
+* search of the command table.  Numbers are converted with atoi().
+* Only looks up the commands; does not call the handlers.
+**********************************************************************/
+static const char * prevCommands[80] = {"#", "AA", "AD", "AS", "CB", "CJ", "H", "L", "P", "Q",
+	"QB", "QC", "QF", "QJ", "QP", "QV", "S", "SEQ", "T", "VER"};
+static const char * prevCommandsLarge[80];
+static volatile uint16_t prevSink;
+
+static void prev_parse(const char * line, uint16_t len, const char * const * commands, uint8_t nCommands)
+{
+	uint8_t prevCharType = 0;
+	uint8_t tokenIdx = 0;
+	char token[7];
+
+	for (uint16_t i = 0; i < len; ++i)
+	{
+		uint8_t ch = line[i];
+		uint8_t charType = isspace(ch) ? 0 : (isdigit(ch) ? 1 : 2);
+		if (charType == 2)
+		{
+			ch = toupper(ch);
+		}
+		if (charType != prevCharType)
+		{
+			token[tokenIdx] = 0;
+			if (prevCharType == 2)
+			{
+				for (uint8_t cmd = 0; cmd < nCommands; ++cmd)
+				{
+					if (strcmp(commands[cmd], token) == 0)
+					{
+						prevSink = cmd;
+						break;
+					}
+				}
+			}
+			else if (prevCharType == 1)
+			{
+				prevSink = atoi(token);
+			}
+			tokenIdx = 0;
+			prevCharType = charType;
+		}
+		if ((charType != 0) && (tokenIdx < 6))
+		{
+			token[tokenIdx++] = ch;
+		}
+	}
+}
+
+/**********************************************************************
+* parse_commands_update() benchmark.  Each call parses one complete
+* command line already waiting in the RX queue.  The previous tokenizer
+* is measured on the same moves, with the current table and with a
+* table 4 times the size, with the current commands spread through it.
+**********************************************************************/
+void bench_parse_commands(void)
+{
+	BenchStat_t move = {"parse_commands_update (all servo move)", 0, 0, 0};
+	BenchStat_t query = {"parse_commands_update (QP query)", 0, 0, 0};
+	BenchStat_t binary = {"parse_commands_update (binary move)", 0, 0, 0};
+	BenchStat_t prev = {"previous tokenizer (all servo move)", 0, 0, 0};
+	BenchStat_t prevLarge = {"previous tokenizer, 80 commands", 0, 0, 0};
+	char cmd[BENCH_CMD_NBYTES];
+	uint8_t frame[8 + BIN_MAX_PAYLOAD_NBYTES];
+	uint32_t seed = 3;
+	uint64_t moveBytes = 0;
+	uint64_t binaryBytes = 0;
+
+	firmware_init();
+	for (uint32_t i = 0; i < BENCH_COMMANDS; ++i)
+	{
+		make_group_move(cmd, &seed, 1000);
+		uint16_t len = strlen(cmd);
+		moveBytes += len;
+		host_uart_rx(cmd, len);
+		uint64_t start = now_ns();
+		parse_commands_update();
+		stat_add(&move, start);
+		servo_calculations_update();
+
+		sprintf(cmd, "#%luQP\r", (unsigned long)(i % NUM_SERVOS));
+		host_uart_rx(cmd, strlen(cmd));
+		start = now_ns();
+		parse_commands_update();
+		stat_add(&query, start);
+		servo_calculations_update();
+		host_uart_tx_drain(txBuf, sizeof(txBuf));
+	}
+	for (uint8_t cmd = 0; cmd < 80; ++cmd)
+	{
+		// The current commands spread through 60 new ones
+		static char names[60][4];
+		if ((cmd % 4) == 3)
+		{
+			prevCommandsLarge[cmd] = prevCommands[cmd / 4];
+			continue;
+		}
+		sprintf(names[cmd - (cmd / 4)], "%c%cX", 'A' + (cmd % 26), 'A' + (cmd / 26));
+		prevCommandsLarge[cmd] = names[cmd - (cmd / 4)];
+	}
+	seed = 3;
+	for (uint32_t i = 0; i < BENCH_COMMANDS; ++i)
+	{
+		make_group_move(cmd, &seed, 1000);
+		uint16_t len = strlen(cmd);
+		uint64_t start = now_ns();
+		prev_parse(cmd, len, prevCommands, 20);
+		stat_add(&prev, start);
+		start = now_ns();
+		prev_parse(cmd, len, prevCommandsLarge, 80);
+		stat_add(&prevLarge, start);
+	}
+	seed = 3;
+	for (uint32_t i = 0; i < BENCH_COMMANDS; ++i)
+	{
+		uint8_t len = make_binary_group_move(frame, &seed, 1000);
+		binaryBytes += len;
+		host_uart_rx((const char *)frame, len);
+		uint64_t start = now_ns();
+		parse_commands_update();
+		stat_add(&binary, start);
+		servo_calculations_update();
+	}
+
+	stat_print(&move);
+	stat_print(&query);
+	stat_print(&binary);
+	stat_print(&prev);
+	stat_print(&prevLarge);
+	printf("%-40s %8.1f bytes/command, %.1f ns/byte\n", "  ASCII move", (double)moveBytes / move.calls,
+		(double)move.totalNs / moveBytes);
+	printf("%-40s %8.1f MB/s current, %.1f MB/s previous, %.1f MB/s previous with 80 commands\n",
+		"  ASCII parse rate", moveBytes * 1000.0 / move.totalNs, moveBytes * 1000.0 / prev.totalNs,
+		moveBytes * 1000.0 / prevLarge.totalNs);
+	printf("%-40s %8.1f bytes/command, %.1f ns/byte\n", "  binary move", (double)binaryBytes / binary.calls,
+		(double)binary.totalNs / binaryBytes);
+}
+
+/**********************************************************************
+* Bulk position query check.  "QPR", "QSR" and the binary query must
+* return the same voltages and status as "QP" and "Q" for each servo.
+* Also compares the serial traffic with polling each servo.
+**********************************************************************/
+void bench_bulk_query_check(void)
+{
+	char cmd[32];
+	char expect[256];
+	char * p;
+	uint16_t errors = 0;
+	uint32_t pollBytes = 0;
+	uint8_t lastServo = NUM_SERVOS - 1;
+
+	firmware_init();
+	adc_scan();
+	send_command("#4P1500 #5P1500\r");
+
+	// Polling each servo
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		sprintf(cmd, "#%uQP\r", servoNum);
+		sprintf(expect, "*%uQP%u\r", servoNum, position_millivolts(servoNum));
+		errors += !reply_is(cmd, expect);
+		pollBytes += strlen(cmd) + strlen(expect);
+	}
+
+	// ASCII range queries
+	p = expect + sprintf(expect, "*0QPR");
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		p += sprintf(p, (servoNum == 0) ? "%u" : " %u", position_millivolts(servoNum));
+	}
+	sprintf(p, "\r");
+	sprintf(cmd, "#0QPR%u\r", lastServo);
+	errors += !reply_is(cmd, expect);
+	uint32_t rangeBytes = strlen(cmd) + strlen(expect);
+	sprintf(expect, "*4QSR6,%u 6,%u 1,%u\r", position_millivolts(4), position_millivolts(5), position_millivolts(6));
+	errors += !reply_is("#4QSR6\r", expect);
+	sprintf(cmd, "#%uQPR99\r", lastServo);
+	sprintf(expect, "*%uQPR%u\r", lastServo, position_millivolts(lastServo));
+	errors += !reply_is(cmd, expect);
+	errors += !reply_is("#5QPR4\r QPR11\r", "");
+
+	// Binary query for servos 0, 5 and the last servo with status.  The
+	// mask bits above the last servo are set, and must be ignored.  The
+	// reply is a frame with the same opcode.
+	const uint8_t servos[3] = {0, 5, lastServo};
+	uint8_t frame[5 + BIN_MASK_NBYTES] = {BIN_FRAME_SYNC, 1 + BIN_MASK_NBYTES, BIN_OP_QUERY, BIN_QUERY_STATUS};
+	uint8_t * mask = &frame[4];
+	for (uint8_t i = 0; i < 3; ++i)
+	{
+		mask[servos[i] >> 3] |= 1 << (servos[i] & 7);
+	}
+	mask[BIN_MASK_NBYTES - 1] |= (uint8_t)~BIN_MASK_LAST_gm;
+	frame[4 + BIN_MASK_NBYTES] = crc8(&frame[1], 3 + BIN_MASK_NBYTES);
+	host_uart_rx((const char *)frame, sizeof(frame));
+	main_loop_pass();
+	uint16_t nBytes = host_uart_tx_drain(txBuf, sizeof(txBuf));
+	const uint8_t * reply = (const uint8_t *)txBuf;
+	errors += (nBytes != 4 + 1 + BIN_MASK_NBYTES + 9) || (reply[0] != BIN_FRAME_SYNC) || (reply[1] != nBytes - 4)
+		|| (reply[2] != BIN_OP_QUERY) || (reply[3] != BIN_QUERY_STATUS);
+	for (uint8_t i = 0; i < BIN_MASK_NBYTES; ++i)
+	{
+		errors += (reply[4 + i] != ((i == BIN_MASK_NBYTES - 1) ? (mask[i] & BIN_MASK_LAST_gm) : mask[i]));
+	}
+	for (uint8_t i = 0; (i < 3) && (nBytes >= 4 + 1 + BIN_MASK_NBYTES + 9); ++i)
+	{
+		const uint8_t * servo = &reply[4 + BIN_MASK_NBYTES + (3 * i)];
+		errors += ((servo[0] | (servo[1] << 8)) != position_millivolts(servos[i]));
+		errors += (servo[2] != ((servos[i] == 5) ? 6 : 1));
+	}
+	errors += (crc8(&reply[1], nBytes - 1) != 0);
+
+	check_report("bulk position query", (errors != 0), "%u errors", errors);
+	printf("  %u servo positions: %u bytes polling with QP, %u with QPR, %u with the binary query\n",
+		NUM_SERVOS, pollBytes, rangeBytes, 7 + 4 + 1 + BIN_MASK_NBYTES + (2 * NUM_SERVOS));
+}
+
+/**********************************************************************
+* Telemetry check.  "TLM<n>" must send a frame every n servo frames,
+* with the selected feedback voltages, and must not send one unless it
+* leaves room in the TX queue for command replies.
+**********************************************************************/
+void bench_telemetry_check(void)
+{
+	char expect[256];
+	char status[NUM_SERVOS + 1];
+	char * p;
+	uint16_t errors = 0;
+	uint8_t lastServo = NUM_SERVOS - 1;
+
+	firmware_init();
+	adc_scan();
+	send_command("#4P1500\r");
+	// Servo 4 is holding, the others are limp
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		status[servoNum] = (servoNum == 4) ? '6' : '1';
+	}
+	status[NUM_SERVOS] = 0;
+
+	// The first frame is sent right away
+	uint16_t loop = (uint16_t)LoopCount;
+	p = expect + sprintf(expect, "*TLM%u %ld %u %s", loop, (long)MillisRemainingInCommand,
+		adc_to_battery_millivolts(744), status);
+	for (uint8_t servoNum = 0; servoNum < NUM_POSITION_INPUTS; ++servoNum)
+	{
+		p += sprintf(p, " %u", position_millivolts(servoNum));
+	}
+	sprintf(p, "\r");
+	errors += !reply_is("TLM2\r", expect);
+
+	// One frame every 2 servo frames, with the selected servos
+	errors += !reply_is("TLC5\r", "");
+	uint16_t nFrames = 0;
+	for (uint8_t frame = 0; frame < 20; ++frame)
+	{
+		host_timer_run_frame(0);
+		main_loop_pass();
+		main_loop_pass();
+		uint16_t nBytes = tx_drain_string();
+		nFrames += (nBytes != 0);
+		if (frame == 1)
+		{
+			sprintf(expect, "*TLM%u %ld %u %s %u %u\r", (uint16_t)(loop + 2), (long)MillisRemainingInCommand,
+				adc_to_battery_millivolts(744), status, position_millivolts(0), position_millivolts(2));
+			errors += (strcmp(txBuf, expect) != 0);
+		}
+	}
+	errors += (nFrames != 10);
+
+	// "#<first>TLC" selects servos from first and keeps the others.  The
+	// servos with no position input cannot be selected.
+	sprintf(expect, "#%uTLC1\r", lastServo);
+	errors += !reply_is(expect, "");
+	sprintf(expect, "#%uTLC1\r", NUM_POSITION_INPUTS - 1);
+	errors += !reply_is(expect, "");
+	sprintf(expect, " %s %u %u %u\r", status, position_millivolts(0), position_millivolts(2),
+		position_millivolts(NUM_POSITION_INPUTS - 1));
+	nFrames = 0;
+	for (uint8_t frame = 0; frame < 2; ++frame)
+	{
+		host_timer_run_frame(0);
+		main_loop_pass();
+		main_loop_pass();
+		if (tx_drain_string() != 0)
+		{
+			++nFrames;
+			p = strstr(txBuf, expect);
+			errors += !p || (strlen(p) != strlen(expect));
+		}
+	}
+	errors += (nFrames != 1);
+
+	// With replies waiting to be sent, frames are held back
+	for (uint8_t i = 0; i < 9; ++i)
+	{
+		host_uart_rx("VER\r", 4);
+		main_loop_pass();
+	}
+	for (uint8_t frame = 0; frame < 4; ++frame)
+	{
+		host_timer_run_frame(0);
+		main_loop_pass();
+	}
+	errors += (host_uart_tx_drain(txBuf, sizeof(txBuf)) != 9 * strlen((const char *)VERSION));
+	main_loop_pass();
+	errors += (host_uart_tx_drain(txBuf, sizeof(txBuf)) == 0);
+
+	// Off
+	errors += !reply_is("TLM0\r", "");
+	for (uint8_t frame = 0; frame < 4; ++frame)
+	{
+		host_timer_run_frame(0);
+		main_loop_pass();
+	}
+	errors += (host_uart_tx_drain(txBuf, sizeof(txBuf)) != 0);
+
+	check_report("telemetry stream", (errors != 0), "%u errors", errors);
+}
@@ -0,0 +1,392 @@
+/*
+ * bench_servo_calculations.c
+ *
+ * Checks and benchmarks of servo_calculations_update(): move math,
+ * motion profiles and the command queue.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+
+#include "../../Include/globals.h"
+#include "../../Include/parse_commands.h"
+#include "../../Include/servo_pulse.h"
+#include "../../Include/servo_calculations.h"
+#include "../Include/host_hw.h"
+#include "../Include/bench.h"
+
+/**********************************************************************
+* servo_calculations_update() benchmark: one full-body move per call.
+**********************************************************************/
+void bench_servo_calculations(void)
+{
+	BenchStat_t timed = {"servo_calculations_update (all servos, T)", 0, 0, 0};
+	BenchStat_t speed = {"servo_calculations_update (all servos, S)", 0, 0, 0};
+	char cmd[BENCH_CMD_NBYTES];
+	uint32_t seed = 2;
+
+	firmware_init();
+	for (uint32_t i = 0; i < BENCH_COMMANDS; ++i)
+	{
+		make_group_move(cmd, &seed, 500 + (i % 1000));
+		rx_command(cmd);
+		uint64_t start = now_ns();
+		servo_calculations_update();
+		stat_add(&timed, start);
+		// Advance a few frames so the servos are part way through the move
+		for (uint8_t frame = 0; frame < 5; ++frame)
+		{
+			host_timer_run_frame(0);
+			servo_pulse_update();
+		}
+	}
+
+	for (uint32_t i = 0; i < BENCH_COMMANDS; ++i)
+	{
+		char * p = cmd;
+		for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+		{
+			next_random(&seed);
+			p += sprintf(p, "#%uP%uS%u", servoNum, 900 + (unsigned)((seed >> 16) % 1200),
+				200 + (unsigned)((seed >> 8) % 3000));
+		}
+		strcpy(p, "\r");
+		rx_command(cmd);
+		uint64_t start = now_ns();
+		servo_calculations_update();
+		stat_add(&speed, start);
+		for (uint8_t frame = 0; frame < 5; ++frame)
+		{
+			host_timer_run_frame(0);
+			servo_pulse_update();
+		}
+	}
+
+	stat_print(&timed);
+	stat_print(&speed);
+}
+
+/**********************************************************************
+* Move calculation check.  servo_calculations_update() finds the move
+* time by cross multiplying and divides by the move time with a
+* reciprocal.  Random commands (timed and speed limited, from part way
+* through earlier moves) are checked against the exact division.  Every
+* moving servo takes the move time in whole frames, rounded up.
+**********************************************************************/
+void bench_move_math_check(void)
+{
+	char cmd[BENCH_CMD_NBYTES];
+	uint32_t seed = 6;
+	uint32_t servosChecked = 0;
+	uint32_t mismatches = 0;
+
+	firmware_init();
+	center_servos();
+	for (uint16_t moveNum = 0; moveNum < 2000; ++moveNum)
+	{
+		char * p = cmd;
+		for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+		{
+			next_random(&seed);
+			if ((seed >> 28) == 0)
+			{
+				continue;	// Not part of this command
+			}
+			uint16_t pw = MINIMUM_PW + ((seed >> 8) % (MAXIMUM_PW - MINIMUM_PW + 1));
+			p += sprintf(p, "#%uP%u", servoNum, pw);
+			if (moveNum & 1)
+			{
+				next_random(&seed);
+				p += sprintf(p, "S%u", 1 + ((seed >> 16) % ((moveNum & 2) ? 50 : 20000)));
+			}
+		}
+		next_random(&seed);
+		uint16_t moveTime = (moveNum & 4) ? ((seed >> 16) % 50) : ((seed >> 8) % 65536);
+		sprintf(p, "T%u\r", moveTime);
+		rx_command(cmd);
+
+		// Exact move time and deltas from the commands waiting
+		uint32_t exactTime = ServoCmdMoveTime;
+		for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+		{
+			if (!ServoCmdArray[servoNum].isCommanded)
+				continue;
+			int32_t distance = (int32_t)ServoCmdArray[servoNum].targetPW - (int32_t)(ServoPulseDefs[servoNum].currentPW_l16 >> 16);
+			uint16_t speed = ServoCmdArray[servoNum].targetSpeed ? ServoCmdArray[servoNum].targetSpeed : 1;
+			uint32_t servoTime = (1000UL * (uint32_t)labs(distance)) / speed;
+			if (servoTime > 0xFFFF)
+				servoTime = 0xFFFF;
+			if (servoTime > exactTime)
+				exactTime = servoTime;
+		}
+		int32_t exactDelta[NUM_SERVOS];
+		uint16_t exactFrames[NUM_SERVOS];
+		for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+		{
+			int64_t distance_L16 = ((int64_t)ServoCmdArray[servoNum].targetPW << 16) - ServoPulseDefs[servoNum].currentPW_l16;
+			int64_t step_L16 = SERVO_PULSE_PERIOD_MS * (distance_L16 / (exactTime ? exactTime : 1));
+			exactDelta[servoNum] = (int32_t)step_L16;
+			uint32_t frameTime = exactTime ? exactTime : 1;
+			exactFrames[servoNum] = distance_L16 ? ((frameTime + SERVO_PULSE_PERIOD_MS - 1) / SERVO_PULSE_PERIOD_MS) : 0;
+		}
+		bool commanded[NUM_SERVOS];
+		for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+		{
+			commanded[servoNum] = ServoCmdArray[servoNum].isCommanded;
+		}
+
+		servo_calculations_update();
+		for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+		{
+			if (!commanded[servoNum])
+				continue;
+			++servosChecked;
+			if ((ServoPulseDefs[servoNum].deltaPW_l16 != exactDelta[servoNum])
+				|| (ServoPulseDefs[servoNum].framesRemaining != exactFrames[servoNum])
+				|| (MillisRemainingInCommand != (int32_t)exactTime))
+			{
+				++mismatches;
+			}
+		}
+
+		// Stop part way through the move
+		next_random(&seed);
+		for (uint8_t frame = (seed >> 16) % 8; frame > 0; --frame)
+		{
+			host_timer_run_frame(0);
+			servo_pulse_update();
+		}
+	}
+
+	check_report("move math vs exact division", (mismatches != 0), "%lu servo moves, %lu mismatches",
+		(unsigned long)servosChecked, (unsigned long)mismatches);
+}
+
+/**********************************************************************
+* Motion profile check.  The first third of the servos move at constant
+* velocity, the second third with a trapezoid and the rest with an
+* S-curve, with different acceleration limits.  For random moves, every moving servo must reach its target on
+* the same frame, never move away from the target, and never change
+* velocity by more than its limit, including the last frame.
+**********************************************************************/
+void bench_profile_check(void)
+{
+	static const uint16_t accel[4] = {500, 2000, 8000, 30000};
+	static const uint16_t decel[4] = {800, 2000, 5000, 30000};
+	char cmd[BENCH_CMD_NBYTES];
+	uint32_t seed = 7;
+	uint16_t errors = 0;
+	double maxAccelRatio = 0;
+	uint32_t maxSpread = 0;
+
+	firmware_init();
+	center_servos();
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		uint8_t profile = (servoNum * 3) / NUM_SERVOS;
+		if (profile != 0)
+		{
+			sprintf(cmd, "#%uAA%u #%uAD%u #%uAS%u\r", servoNum, accel[servoNum % 4], servoNum,
+				decel[servoNum % 4], servoNum, profile - 1);
+			send_command(cmd);
+		}
+	}
+
+	for (uint16_t moveNum = 0; moveNum < 200; ++moveNum)
+	{
+		uint32_t prevPW[NUM_SERVOS];
+		int64_t prevVel[NUM_SERVOS];
+		int32_t finishFrame[NUM_SERVOS];
+		bool moving[NUM_SERVOS];
+		char * p = cmd;
+		for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+		{
+			next_random(&seed);
+			p += sprintf(p, "#%uP%u", servoNum, 600 + ((seed >> 16) % 1800));
+		}
+		next_random(&seed);
+		sprintf(p, "T%u\r", (moveNum & 1) ? (100 + ((seed >> 16) % 3000)) : 0);
+		rx_command(cmd);
+		servo_calculations_update();
+		for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+		{
+			prevPW[servoNum] = ServoPulseDefs[servoNum].currentPW_l16;
+			prevVel[servoNum] = 0;
+			finishFrame[servoNum] = -1;
+			moving[servoNum] = (ServoPulseDefs[servoNum].framesRemaining != 0);
+		}
+
+		for (int32_t frame = 1; frame < 5000; ++frame)
+		{
+			bool anyMoving = false;
+			host_timer_run_frame(0);
+			servo_pulse_update();
+			for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+			{
+				if (!moving[servoNum] || (finishFrame[servoNum] >= 0))
+					continue;
+				PulseDef_t * pulseDef = &ServoPulseDefs[servoNum];
+				int64_t target = (int64_t)pulseDef->targetPW << 16;
+				int64_t vel = (int64_t)pulseDef->currentPW_l16 - prevPW[servoNum];
+				int64_t toTargetBefore = target - prevPW[servoNum];
+				int64_t toTargetAfter = target - pulseDef->currentPW_l16;
+				if (((toTargetBefore > 0) && ((vel < 0) || (toTargetAfter < 0)))
+					|| ((toTargetBefore < 0) && ((vel > 0) || (toTargetAfter > 0))))
+				{
+					printf("  servo %u moved away from its target\n", servoNum);
+					++errors;
+				}
+				if (((servoNum * 3) / NUM_SERVOS) != 0)
+				{
+					uint16_t limit = (accel[servoNum % 4] > decel[servoNum % 4]) ? accel[servoNum % 4] : decel[servoNum % 4];
+					double limit_L16 = (double)limit * ACCEL_UNIT_US_PER_S2 * 65536.0
+						* SERVO_PULSE_PERIOD_MS * SERVO_PULSE_PERIOD_MS / 1000000.0;
+					double ratio = (double)llabs(vel - prevVel[servoNum]) / limit_L16;
+					if (ratio > maxAccelRatio)
+						maxAccelRatio = ratio;
+				}
+				prevVel[servoNum] = vel;
+				prevPW[servoNum] = pulseDef->currentPW_l16;
+				if (pulseDef->framesRemaining == 0)
+				{
+					finishFrame[servoNum] = frame;
+					if (toTargetAfter != 0)
+					{
+						printf("  servo %u stopped short of its target\n", servoNum);
+						++errors;
+					}
+				}
+				else
+				{
+					anyMoving = true;
+				}
+			}
+			if (!anyMoving)
+				break;
+		}
+
+		int32_t first = 0x7FFFFFFF;
+		int32_t last = 0;
+		for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+		{
+			if (!moving[servoNum])
+				continue;
+			if (finishFrame[servoNum] < first)
+				first = finishFrame[servoNum];
+			if (finishFrame[servoNum] > last)
+				last = finishFrame[servoNum];
+		}
+		if ((last >= first) && ((uint32_t)(last - first) > maxSpread))
+			maxSpread = last - first;
+	}
+	if (maxSpread != 0)
+	{
+		printf("  servos finished up to %lu frames apart\n", (unsigned long)maxSpread);
+		++errors;
+	}
+	if (maxAccelRatio > 1.0)
+	{
+		++errors;
+	}
+	check_report("motion profiles", (errors != 0), "finish spread %lu frames, peak accel %.2f x limit",
+		(unsigned long)maxSpread, maxAccelRatio);
+}
+
+/**********************************************************************
+* Command queue check.  Streams several sequenced moves at once, then
+* runs frames.  Each move must start on the frame after the previous
+* one ends, so the servo moves on every frame and reaches each target
+* on schedule.  "QF" must report the free slots, and a command without
+* "SEQ" must start right away and discard the queued moves.  If the
+* main loop misses a frame, a sequenced move must still wait for the
+* move before it to reach its target.
+**********************************************************************/
+void bench_queue_check(void)
+{
+	static const uint16_t targets[] = {1200, 1000, 1400, 1300};
+	static const uint16_t times[] = {200, 200, 200, 100};
+	char cmd[BENCH_CMD_NBYTES];
+	char * p = cmd;
+	uint16_t errors = 0;
+	uint16_t frame = 0;
+
+	firmware_init();
+	send_command("#0P1500 #1P1500\r");
+	for (uint8_t moveNum = 0; moveNum < 4; ++moveNum)
+	{
+		p += sprintf(p, "#0P%uT%uSEQ\r", targets[moveNum], times[moveNum]);
+	}
+	strcpy(p, "QF\r");
+	host_uart_rx(cmd, strlen(cmd));
+	main_loop_passes(6);
+	// The first move has started, so 3 are queued
+	tx_drain_string();
+	if (strcmp(txBuf, "*QF5\r") != 0)
+	{
+		++errors;
+	}
+
+	for (uint8_t moveNum = 0; moveNum < 4; ++moveNum)
+	{
+		uint16_t moveFrames = (times[moveNum] + SERVO_PULSE_PERIOD_MS - 1) / SERVO_PULSE_PERIOD_MS;
+		for (uint16_t moveFrame = 0; moveFrame < moveFrames; ++moveFrame)
+		{
+			uint32_t prevPW = ServoPulseDefs[0].currentPW_l16;
+			host_timer_run_frame(0);
+			main_loop_pass();
+			++frame;
+			if (ServoPulseDefs[0].currentPW_l16 == prevPW)
+			{
+				++errors;	// Idle frame between moves
+			}
+		}
+		if (ServoPulseDefs[0].currentPW_l16 != ((uint32_t)targets[moveNum] << 16))
+		{
+			++errors;	// Target not reached on schedule
+		}
+	}
+
+	// A command without "SEQ" cuts short the move in progress and
+	// discards the queued moves
+	send_command("#0P2000T1000SEQ\r#0P2000T1000SEQ\r");
+	send_command("#1P1000T0\r");
+	// At the default speed, the 500us move takes 8ms
+	run_frames((8 + SERVO_PULSE_PERIOD_MS - 1) / SERVO_PULSE_PERIOD_MS);
+	if ((ServoPulseDefs[1].currentPW_l16 != (1000UL << 16)) || (ServoCmdQueueCount != 0))
+	{
+		++errors;
+	}
+
+	// The main loop misses a frame during the first move
+	send_command("#2P1500\r");
+	send_command("#2P1200T200SEQ\r#2P1400T200SEQ\r");
+	bool reached = false;
+	for (uint8_t moveFrame = 0; moveFrame < 2 * ((200 + SERVO_PULSE_PERIOD_MS - 1) / SERVO_PULSE_PERIOD_MS) + 1; ++moveFrame)
+	{
+		host_timer_run_frame(0);
+		if (moveFrame == 2)
+		{
+			host_timer_run_frame(0);
+		}
+		main_loop_pass();
+		if (ServoPulseDefs[2].targetPW == 1200)
+		{
+			reached = (ServoPulseDefs[2].currentPW_l16 == (1200UL << 16));
+		}
+		else if (!reached)
+		{
+			++errors;	// Started before the first move was done
+			break;
+		}
+	}
+	if (ServoPulseDefs[2].currentPW_l16 != (1400UL << 16))
+	{
+		++errors;
+	}
+
+	check_report("sequenced moves back-to-back", (errors != 0), "%u frames, %u errors", frame, errors);
+}
@@ -0,0 +1,108 @@
+/*
+ * bench_servo_control.c
+ *
+ * Check of the closed-loop servo position control.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <avr/io.h>
+
+#include "../../Include/globals.h"
+#include "../../Include/adc.h"
+#include "../Include/host_hw.h"
+#include "../Include/bench.h"
+
+/**********************************************************************
+* Closed-loop control check.  The modelled servo follows the pulse
+* width output with a lag, and stops short of it by the load.  After
+* calibration with no load, closed-loop control must bring the measured
+* position to the commanded pulse width under load, without a large
+* overshoot.  With control off, the trim must go back to 0.
+**********************************************************************/
+#define CONTROL_SERVO 5
+#define CONTROL_LOAD_US 60
+
+// Servo position in microseconds, and the load on the servo
+static int32_t controlPos;
+static int32_t controlLoad;
+
+// Run a frame, move the modelled servo, and scan its position
+static void control_frame(void)
+{
+	host_timer_run_frame(0);
+	int32_t pw = measure_pulse(CONTROL_SERVO);
+	if (pw >= 0)
+	{
+		controlPos += (pw - controlLoad - controlPos) / 2;
+	}
+	host_adc_set_input(CONTROL_SERVO, 100 + (((controlPos - MINIMUM_PW) * 2) / 5));
+	for (uint8_t pass = 0; pass <= NUM_ADC_CHANNELS; ++pass)
+	{
+		main_loop_pass();
+	}
+}
+
+static void control_frames(uint16_t nFrames)
+{
+	for (uint16_t frame = 0; frame < nFrames; ++frame)
+	{
+		control_frame();
+	}
+}
+
+void bench_control_check(void)
+{
+	char cmd[24];
+	uint16_t errors = 0;
+	int32_t maxPos = 0;
+	uint16_t settleFrames = 0;
+
+	firmware_init();
+	controlPos = 1000;
+	controlLoad = 0;
+	sprintf(cmd, "#%uP1000\r", CONTROL_SERVO);
+	send_command(cmd);
+	control_frames(30);
+	sprintf(cmd, "#%uCPL1000\r", CONTROL_SERVO);
+	send_command(cmd);
+	sprintf(cmd, "#%uP2000\r", CONTROL_SERVO);
+	send_command(cmd);
+	control_frames(30);
+	sprintf(cmd, "#%uCPH2000\r", CONTROL_SERVO);
+	send_command(cmd);
+	errors += (ServoControlDefs[CONTROL_SERVO].slope_q12 == 0);
+
+	// Open loop, the servo stops short by the load
+	controlLoad = CONTROL_LOAD_US;
+	sprintf(cmd, "#%uP1500\r", CONTROL_SERVO);
+	send_command(cmd);
+	control_frames(30);
+	errors += (labs(controlPos - (1500 - CONTROL_LOAD_US)) > 3) || (ServoControlDefs[CONTROL_SERVO].trim != 0);
+
+	// Closed loop
+	sprintf(cmd, "#%uCL1\r", CONTROL_SERVO);
+	send_command(cmd);
+	for (uint16_t frame = 1; frame <= 100; ++frame)
+	{
+		control_frame();
+		maxPos = (controlPos > maxPos) ? controlPos : maxPos;
+		if (labs(controlPos - 1500) > 3)
+		{
+			settleFrames = frame;
+		}
+	}
+	errors += (settleFrames > 50) || (maxPos > 1500 + (CONTROL_LOAD_US / 2));
+	errors += (labs(ServoControlDefs[CONTROL_SERVO].trim - CONTROL_LOAD_US) > 5);
+
+	// Control off, the pulse width output goes back to the profile
+	sprintf(cmd, "#%uCL0\r", CONTROL_SERVO);
+	send_command(cmd);
+	control_frames(3);
+	errors += (ServoControlDefs[CONTROL_SERVO].trim != 0) || (measure_pulse(CONTROL_SERVO) != 1500);
+
+	check_report("closed-loop control", (errors != 0), "%u errors, settled in %u frames, peak %ld us",
+		errors, settleFrames, (long)maxPos);
+}
@@ -0,0 +1,112 @@
+/*
+ * bench_servo_current.c
+ *
+ * Check of the servo current sense pipeline.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <avr/io.h>
+
+#include "../../Include/globals.h"
+#include "../../Include/servo_current.h"
+#include "../Include/host_hw.h"
+#include "../Include/bench.h"
+
+/**********************************************************************
+* Current sense check.  With the device answering one request per main
+* loop pass, no more than CURRENT_MAX_IN_FLIGHT requests may be waiting,
+* all servos must be read within the frame, and "QC" must answer from
+* the latest readings.  Replies that come after the next sweep has
+* started must not stall it, be stored, or count against the requests
+* of the new sweep.
+**********************************************************************/
+void bench_current_check(void)
+{
+	char cmd[16];
+	char expect[24];
+	uint16_t before[NUM_SERVOS];
+	uint16_t errors = 0;
+	uint8_t maxWaiting = 0;
+	uint8_t waiting = 0;
+	uint16_t passes = 0;
+	// Current step between servos, keeping every current in the 14 bits
+	// of a reply
+	uint16_t step = 15000 / NUM_SERVOS;
+
+	firmware_init();
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		host_current_set(servoNum, 100 + (servoNum * step));
+	}
+	for (passes = 0; passes < 40; ++passes)
+	{
+		main_loop_pass();
+		waiting += host_current_device(0);
+		maxWaiting = (waiting > maxWaiting) ? waiting : maxWaiting;
+		waiting -= (waiting != 0);
+		host_current_device(1);
+		if (servo_current_read(NUM_SERVOS - 1) != 0)
+		{
+			break;
+		}
+	}
+	errors += (maxWaiting != CURRENT_MAX_IN_FLIGHT);
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		sprintf(cmd, "#%uQC\r", servoNum);
+		sprintf(expect, "*%uQC%u\r", servoNum, 100 + (servoNum * step));
+		errors += !reply_is(cmd, expect);
+	}
+
+	// Leave the last requests of a sweep unanswered into the next sweep.
+	// Their late replies must not be stored, nor let more requests of
+	// the new sweep be sent.
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		host_current_set(servoNum, 2000 + servoNum);
+	}
+	for (uint8_t frame = 0; frame < CURRENT_SWEEP_FRAMES; ++frame)
+	{
+		host_timer_run_frame(0);
+	}
+	for (uint8_t pass = 0; pass < NUM_SERVOS / 2; ++pass)
+	{
+		main_loop_pass();
+		host_current_device(1);
+	}
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		host_current_set(servoNum, 3000 + servoNum);
+	}
+	for (uint8_t frame = 0; frame < CURRENT_SWEEP_FRAMES; ++frame)
+	{
+		host_timer_run_frame(0);
+	}
+	main_loop_pass();
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		before[servoNum] = servo_current_read(servoNum);
+	}
+	errors += (before[NUM_SERVOS - 1] != 100 + ((NUM_SERVOS - 1) * step));
+	for (uint8_t pass = 0; pass < 2 * NUM_SERVOS; ++pass)
+	{
+		main_loop_pass();
+		host_current_device(0);
+		errors += (host_current_waiting() > CURRENT_MAX_IN_FLIGHT);
+		host_current_device(1);
+		for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+		{
+			uint16_t milliAmps = servo_current_read(servoNum);
+			errors += (milliAmps != before[servoNum]) && (milliAmps != 3000 + servoNum);
+		}
+	}
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		errors += (servo_current_read(servoNum) != 3000 + servoNum);
+	}
+
+	check_report("current sense pipeline", (errors != 0), "%u errors, all servos read in %u passes",
+		errors, passes + 1);
+}
@@ -0,0 +1,577 @@
+/*
+ * bench_servo_pulse.c
+ *
+ * Pulse checks and benchmarks of servo_pulse_update() and the edge
+ * ISR: pulse widths and start times, frame layout, motion profile and
+ * interpolation cost.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "../../Include/globals.h"
+#include "../../Include/parse_commands.h"
+#include "../../Include/servo_pulse.h"
+#include "../../Include/servo_calculations.h"
+#include "../../Include/adc.h"
+#include "../Include/host_hw.h"
+#include "../Include/bench.h"
+
+/**********************************************************************
+* Pulse check.  Runs one frame with zero interrupt latency and measures
+* the high time of every servo pin.  Each must equal the pulse width
+* in the pulse array, and servos with a pulse width of 0 must stay low.
+**********************************************************************/
+static uint8_t port_value(const HostEdgeLog_t * log, volatile uint8_t * outsetRegAddr)
+{
+	if (outsetRegAddr == &PORTA_OUTSET) return log->portA;
+	if (outsetRegAddr == &PORTB_OUTSET) return log->portB;
+	if (outsetRegAddr == &PORTE_OUTSET) return log->portE;
+	if (outsetRegAddr == &PORTF_OUTSET) return log->portF;
+	return log->portC;
+}
+
+#if HW_PULSE_OFFLOAD
+// True if a servo has hardware pulses
+static bool is_hw_pulse(uint8_t servoNum)
+{
+	return (servoNum == HwPulseServos[0]) || (servoNum == HwPulseServos[1]);
+}
+#endif
+
+// High time of a servo pin in the last frame run, or -1 if the pin
+// did not pulse
+int32_t measure_pulse(uint8_t servoNum)
+{
+	const PinDef_t * pin = &ServoPinDefs[servoNum];
+	int32_t riseTime = -1;
+	int32_t fallTime = -1;
+	bool prevHigh = false;
+
+#if HW_PULSE_OFFLOAD
+	// The offloaded servos are driven by the TCA0 waveform outputs, which
+	// go high at BOTTOM and low at the compare match
+	if (is_hw_pulse(servoNum))
+	{
+		uint8_t enable = (servoNum == HwPulseServos[0]) ? TCA_SINGLE_CMP1EN_bm : TCA_SINGLE_CMP2EN_bm;
+		uint16_t compare = (servoNum == HwPulseServos[0]) ? TCA0_SINGLE_CMP1 : TCA0_SINGLE_CMP2;
+
+		if (!(TCA0_SINGLE_CTRLB & enable) || (compare == 0) || (compare > TCA0_SINGLE_PER))
+		{
+			return -1;
+		}
+		return compare;
+	}
+#endif
+
+	for (uint8_t i = 0; i < HostFrameLogCount; ++i)
+	{
+		bool high = (port_value(&HostFrameLog[i], pin->outsetRegAddr) & pin->bitMap) != 0;
+		if (high && !prevHigh)
+		{
+			riseTime = HostFrameLog[i].time;
+		}
+		else if (!high && prevHigh)
+		{
+			fallTime = HostFrameLog[i].time;
+		}
+		prevHigh = high;
+	}
+	if ((riseTime < 0) || (fallTime < 0))
+	{
+		return -1;
+	}
+	return fallTime - riseTime;
+}
+
+// Start time of a servo pulse in the last frame run, or -1 if the pin
+// did not pulse.  The hardware pulses start at BOTTOM.
+static int32_t measure_rise(uint8_t servoNum)
+{
+	const PinDef_t * pin = &ServoPinDefs[servoNum];
+	bool prevHigh = false;
+
+	if (measure_pulse(servoNum) < 0)
+	{
+		return -1;
+	}
+#if HW_PULSE_OFFLOAD
+	if (is_hw_pulse(servoNum))
+	{
+		return 0;
+	}
+#endif
+	for (uint8_t i = 0; i < HostFrameLogCount; ++i)
+	{
+		bool high = (port_value(&HostFrameLog[i], pin->outsetRegAddr) & pin->bitMap) != 0;
+		if (high && !prevHigh)
+		{
+			return HostFrameLog[i].time;
+		}
+		prevHigh = high;
+	}
+	return -1;
+}
+
+void check_pulses(const char * name)
+{
+	uint16_t errors = 0;
+
+	// Run frames until an edge array built from the settled pulse array
+	// is active (the next frame is built while one is output), then
+	// measure the next frame.
+	for (uint8_t frame = 0; frame < 2; ++frame)
+	{
+		host_timer_run_frame(0);
+		main_loop_pass();
+	}
+	host_timer_run_frame(0);
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		uint16_t expected = ServoPulseDefs[servoNum].currentPW_l16 >> 16;
+		int32_t pulse = measure_pulse(servoNum);
+
+		if (expected < MINIMUM_PW)
+		{
+			if (pulse >= 0)
+			{
+				printf("  %s: servo %u should be off but pulsed\n", name, servoNum);
+				++errors;
+			}
+		}
+		else if (pulse != expected)
+		{
+			printf("  %s: servo %u pulse %ld us, expected %u us\n", name, servoNum,
+				(long)pulse, expected);
+			++errors;
+		}
+	}
+	check_report(name, (errors != 0), "%u edge interrupts", HostFrameLogCount);
+}
+
+void bench_pulse_check(void)
+{
+	firmware_init();
+	host_timer_run_frame(0);
+	main_loop_pass();
+
+	center_servos();
+	run_until_settled();
+	check_pulses("all servos equal");
+
+	send_command("#4P1700\r");
+	run_until_settled();
+	check_pulses("one servo moved");
+
+	send_command("#0P600 #1P2400 #2P1000 #3P1001 #4P1002 #5P2500 #6P500 #7P1750 "
+		"#8P1234 #9P1234 #10P2100 #11P901\r");
+	run_until_settled();
+	check_pulses("mixed positions");
+
+	send_command("#1L #4L #9L #10L #0P1800 #2P1800 #3P1200 T200\r");
+	run_until_settled();
+	check_pulses("limp servos");
+}
+
+/**********************************************************************
+* servo_pulse_update() benchmarks.  The ISR runs one full frame between
+* calls so that each call can build the next frame.  Only the groups
+* that changed are rebuilt, so the number of groups rebuilt per frame
+* is reported as well.
+**********************************************************************/
+void bench_servo_pulse(void)
+{
+	BenchStat_t idle = {"servo_pulse_update (holding)", 0, 0, 0};
+	BenchStat_t moving = {"servo_pulse_update (moving)", 0, 0, 0};
+	BenchStat_t single = {"servo_pulse_update (one servo moving)", 0, 0, 0};
+	char cmd[BENCH_CMD_NBYTES];
+	uint32_t seed = 1;
+	uint64_t idleGroups = 0;	// Groups rebuilt, counted per call since the counter wraps
+	uint64_t movingGroups = 0;
+	uint64_t singleGroups = 0;
+
+	firmware_init();
+	make_group_move(cmd, &seed, 0);
+	send_command(cmd);
+	run_until_settled();
+	host_timer_run_frame(0);
+	main_loop_pass();
+	for (uint32_t frame = 0; frame < BENCH_FRAMES; ++frame)
+	{
+		host_timer_run_frame(0);
+		uint16_t groups = GroupRebuildCount;
+		uint64_t start = now_ns();
+		servo_pulse_update();
+		stat_add(&idle, start);
+		idleGroups += (uint16_t)(GroupRebuildCount - groups);
+	}
+
+	for (uint32_t frame = 0; frame < BENCH_FRAMES; ++frame)
+	{
+		// A new full-body move every second (50 frames)
+		if ((frame % 50) == 0)
+		{
+			make_group_move(cmd, &seed, 1000);
+			rx_command(cmd);
+			servo_calculations_update();
+		}
+		host_timer_run_frame(0);
+		uint16_t groups = GroupRebuildCount;
+		uint64_t start = now_ns();
+		servo_pulse_update();
+		stat_add(&moving, start);
+		movingGroups += (uint16_t)(GroupRebuildCount - groups);
+	}
+
+	for (uint32_t frame = 0; frame < BENCH_FRAMES; ++frame)
+	{
+		// One servo sweeps back and forth every second
+		if ((frame % 50) == 0)
+		{
+			strcpy(cmd, ((frame / 50) & 1) ? "#5P1000 T1000\r" : "#5P2000 T1000\r");
+			rx_command(cmd);
+			servo_calculations_update();
+		}
+		host_timer_run_frame(0);
+		uint16_t groups = GroupRebuildCount;
+		uint64_t start = now_ns();
+		servo_pulse_update();
+		stat_add(&single, start);
+		singleGroups += (uint16_t)(GroupRebuildCount - groups);
+	}
+
+	stat_print(&idle);
+	stat_print(&moving);
+	stat_print(&single);
+	printf("%-40s %8.2f holding, %.2f moving, %.2f one moving (of %u)\n", "  groups rebuilt per frame",
+		(double)idleGroups / idle.calls, (double)movingGroups / moving.calls,
+		(double)singleGroups / single.calls, NUM_SERVO_GROUPS);
+}
+
+/**********************************************************************
+* Motion profile cost.  The same full-body moves as the moving
+* servo_pulse_update() benchmark, with every servo at constant velocity,
+* on a trapezoid, and on an S-curve.
+**********************************************************************/
+void bench_profiles(void)
+{
+	static const char * const names[3] = {"servo_pulse_update (moving, linear)",
+		"servo_pulse_update (moving, trapezoid)", "servo_pulse_update (moving, S-curve)"};
+	char cmd[BENCH_CMD_NBYTES];
+
+	for (uint8_t shape = 0; shape < 3; ++shape)
+	{
+		BenchStat_t stat = {names[shape], 0, 0, 0};
+		uint32_t seed = 1;
+
+		firmware_init();
+		make_group_move(cmd, &seed, 0);
+		send_command(cmd);
+		for (uint8_t servoNum = 0; (shape != 0) && (servoNum < NUM_SERVOS); ++servoNum)
+		{
+			sprintf(cmd, "#%uAA3000 #%uAD3000 #%uAS%u\r", servoNum, servoNum, servoNum, shape - 1);
+			send_command(cmd);
+		}
+		for (uint32_t frame = 0; frame < BENCH_FRAMES; ++frame)
+		{
+			if ((frame % 50) == 0)
+			{
+				make_group_move(cmd, &seed, 1000);
+				rx_command(cmd);
+				servo_calculations_update();
+			}
+			host_timer_run_frame(0);
+			uint64_t start = now_ns();
+			servo_pulse_update();
+			stat_add(&stat, start);
+		}
+		stat_print(&stat);
+	}
+}
+
+/**********************************************************************
+* TCA0_CMP0 edge ISR benchmark, per edge.  Also runs frames with a
+* simulated interrupt latency and reports the edge timing statistics
+* returned by the QJ command.
+**********************************************************************/
+void bench_edge_isr(void)
+{
+	BenchStat_t isr = {"TCA0_CMP0_vect (per edge)", 0, 0, 0};
+	char cmd[BENCH_CMD_NBYTES];
+	uint32_t seed = 4;
+
+	firmware_init();
+	make_group_move(cmd, &seed, 0);
+	send_command(cmd);
+	for (uint32_t frame = 0; frame < BENCH_FRAMES; ++frame)
+	{
+		do
+		{
+			TCA0_SINGLE_CNT = TCA0_SINGLE_CMP0;
+			uint64_t start = now_ns();
+			TCA0_CMP0_vect();
+			stat_add(&isr, start);
+			host_port_sync();
+		} while (TCA0_SINGLE_CMP0 != 0);
+		servo_pulse_update();
+	}
+	stat_print(&isr);
+
+	// Simulated latency of 3us on every edge, then 8us on every edge
+	send_command("CJ\r");
+	for (uint8_t frame = 0; frame < 50; ++frame)
+	{
+		host_timer_run_frame((frame < 25) ? 3 : 8);
+		servo_pulse_update();
+	}
+	host_uart_rx("QJ\r#0QJ\r", 8);
+	for (uint8_t i = 0; i < 4; ++i)
+	{
+		parse_commands_update();
+		servo_calculations_update();
+	}
+	uint16_t nBytes = tx_drain_string();
+	for (uint16_t i = 0; i < nBytes; ++i)
+	{
+		if (txBuf[i] == '\r') txBuf[i] = ' ';
+	}
+	printf("  edge timing after 25 frames at 3us and 25 at 8us: %s\n", txBuf);
+}
+
+/**********************************************************************
+* Interpolation check and benchmark.  The firmware counts down the
+* frames remaining in each move.  The previous per-frame update added
+* the delta every frame and clipped to the target with 32 bit compares;
+* a copy of it is kept here as the reference, which also sets the pulse
+* width to the target when the move time is up.  Random moves (timed,
+* speed limited, and interrupted part way) are run through both, and
+* every pulse width must match on every frame.  Both per-frame updates
+* are also timed for 12 moving servos.
+**********************************************************************/
+struct RefPulse_s
+{
+	uint16_t targetPW;
+	uint32_t currentPW_l16;
+	int32_t deltaPW_l16;
+	uint16_t framesLeft;	// Frames until the move time is up
+};
+typedef struct RefPulse_s RefPulse_t;
+
+// Previous per-frame update.  The add is done in 64 bits: in 32 bits, a
+// delta larger than the distance (move time under one frame) could wrap
+// the pulse width past 0 before the clip, which the count down fixes.
+static void ref_advance(RefPulse_t * pulses)
+{
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		RefPulse_t *pulseDef = &pulses[servoNum];
+		int64_t next = (int64_t)pulseDef->currentPW_l16 + pulseDef->deltaPW_l16;
+		pulseDef->currentPW_l16 = (uint32_t)next;
+		if ((pulseDef->framesLeft != 0) && (--pulseDef->framesLeft == 0))
+		{
+			pulseDef->currentPW_l16 = (uint32_t)(pulseDef->targetPW) << 16;
+			pulseDef->deltaPW_l16 = 0;
+		}
+		if (((pulseDef->deltaPW_l16 > 0) && (next > ((int64_t)(pulseDef->targetPW) << 16)))
+		|| ((pulseDef->deltaPW_l16 < 0) && (next < ((int64_t)(pulseDef->targetPW) << 16))))
+		{
+			pulseDef->currentPW_l16 = (uint32_t)(pulseDef->targetPW) << 16;
+			pulseDef->deltaPW_l16 = 0;
+		}
+	}
+}
+
+// Previous per-frame update as it was, for timing
+static void prev_advance(RefPulse_t * pulses)
+{
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		RefPulse_t *pulseDef = &pulses[servoNum];
+		pulseDef->currentPW_l16 += pulseDef->deltaPW_l16;
+		if (((pulseDef->deltaPW_l16 > 0) && (pulseDef->currentPW_l16 > ((uint32_t)(pulseDef->targetPW) << 16)))
+		|| ((pulseDef->deltaPW_l16 < 0) && (pulseDef->currentPW_l16 < ((uint32_t)(pulseDef->targetPW) << 16))))
+		{
+			pulseDef->currentPW_l16 = (uint32_t)(pulseDef->targetPW) << 16;
+			pulseDef->deltaPW_l16 = 0;
+		}
+	}
+}
+
+// Same steps as advancePulses() in servo_pulse.c, for timing
+static void countdown_advance(PulseDef_t * pulses)
+{
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		PulseDef_t *pulseDef = &pulses[servoNum];
+		if (pulseDef->framesRemaining == 0)
+		{
+			continue;
+		}
+		if (--pulseDef->framesRemaining == 0)
+		{
+			pulseDef->currentPW_l16 = (uint32_t)(pulseDef->targetPW) << 16;
+			pulseDef->deltaPW_l16 = 0;
+		}
+		else
+		{
+			pulseDef->currentPW_l16 += pulseDef->deltaPW_l16;
+		}
+	}
+}
+
+void bench_interpolation(void)
+{
+	BenchStat_t previous = {"interpolation, 32 bit clip (previous)", 0, 0, 0};
+	BenchStat_t countdown = {"interpolation, frame count down", 0, 0, 0};
+	RefPulse_t refPulses[NUM_SERVOS];
+	RefPulse_t timeRef[NUM_SERVOS];
+	PulseDef_t timeCountdown[NUM_SERVOS];
+	char cmd[BENCH_CMD_NBYTES];
+	uint32_t seed = 5;
+	uint32_t mismatches = 0;
+	uint32_t framesChecked = 0;
+
+	firmware_init();
+	for (uint16_t moveNum = 0; moveNum < 400; ++moveNum)
+	{
+		// Random move: timed, speed limited, or both
+		char * p = cmd;
+		for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+		{
+			next_random(&seed);
+			uint16_t pw = MINIMUM_PW + ((seed >> 16) % (MAXIMUM_PW - MINIMUM_PW + 1));
+			p += sprintf(p, "#%uP%u", servoNum, pw);
+			if (moveNum & 1)
+			{
+				p += sprintf(p, "S%u", 50 + ((seed >> 8) % 3000));
+			}
+		}
+		next_random(&seed);
+		sprintf(p, (moveNum & 2) ? "T%u\r" : "\r", 20 + ((seed >> 16) % 3000));
+		rx_command(cmd);
+		servo_calculations_update();
+		for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+		{
+			refPulses[servoNum].targetPW = ServoPulseDefs[servoNum].targetPW;
+			refPulses[servoNum].currentPW_l16 = ServoPulseDefs[servoNum].currentPW_l16;
+			refPulses[servoNum].deltaPW_l16 = ServoPulseDefs[servoNum].deltaPW_l16;
+			refPulses[servoNum].framesLeft = (MillisRemainingInCommand + SERVO_PULSE_PERIOD_MS - 1) / SERVO_PULSE_PERIOD_MS;
+			timeRef[servoNum] = refPulses[servoNum];
+			timeCountdown[servoNum] = ServoPulseDefs[servoNum];
+		}
+
+		// Run to the end of the move, or interrupt it part way
+		next_random(&seed);
+		uint16_t nFrames = (moveNum & 4) ? (1 + ((seed >> 16) % 40)) : 200;
+		for (uint16_t frame = 0; frame < nFrames; ++frame)
+		{
+			host_timer_run_frame(0);
+			servo_pulse_update();
+			ref_advance(refPulses);
+			++framesChecked;
+			for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+			{
+				if (ServoPulseDefs[servoNum].currentPW_l16 != refPulses[servoNum].currentPW_l16)
+				{
+					++mismatches;
+				}
+			}
+
+			uint64_t start = now_ns();
+			prev_advance(timeRef);
+			stat_add(&previous, start);
+			start = now_ns();
+			countdown_advance(timeCountdown);
+			stat_add(&countdown, start);
+		}
+	}
+
+	stat_print(&previous);
+	stat_print(&countdown);
+	check_report("interpolation vs 32 bit clip", (mismatches != 0), "%lu frames, %lu pulse width mismatches",
+		(unsigned long)framesChecked, (unsigned long)mismatches);
+}
+
+/**********************************************************************
+* Frame period check.  The timer period must match SERVO_PULSE_PERIOD_MS.
+* With every servo at the longest pulse, the pulses must be right, and
+* the last edge and the ADC scan after it must fit in the frame.  Each
+* pulse must start in its group's slot, except the hardware pulses
+* (HW_PULSE_OFFLOAD), which start at the start of the frame on the TCA0
+* outputs for their pins.  A timed move must take its move time in frames of this period.
+**********************************************************************/
+void bench_frame_check(void)
+{
+	char cmd[BENCH_CMD_NBYTES];
+	char * p = cmd;
+	uint16_t errors = 0;
+
+	firmware_init();
+	errors += (TCA0_SINGLE_PER != SERVO_PULSE_PERIOD_US - 1);
+	host_timer_run_frame(0);
+	main_loop_pass();
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		p += sprintf(p, "#%uP%u ", servoNum, MAXIMUM_PW);
+	}
+	sprintf(p, "\r");
+	send_command(cmd);
+	run_until_settled();
+	check_pulses("longest pulses in the frame");
+	host_timer_run_frame(0);
+	uint16_t lastEdge = HostFrameLog[HostFrameLogCount - 1].time;
+	errors += (lastEdge > ADC_SCAN_START_MAX_US) || ((lastEdge + ADC_SCAN_US) > SERVO_PULSE_PERIOD_US);
+	uint8_t startTogether = 0;
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		int32_t rise = measure_rise(servoNum);
+		int32_t slotStart = (servoNum / SERVOS_PER_GROUP) * SERVO_GROUP_SLOT_US;
+#if HW_PULSE_OFFLOAD
+		if (is_hw_pulse(servoNum))
+		{
+			slotStart = 0;
+		}
+#endif
+		errors += (rise < slotStart) || (rise >= slotStart + (SERVOS_PER_GROUP * RISING_EDGE_SPACING));
+		startTogether += (rise >= 0) && (rise < SERVO_GROUP_SLOT_US);
+	}
+#if HW_PULSE_OFFLOAD
+	// The TCA0 outputs are routed to PORTB, where WOn is PBn.  Each
+	// output is enabled if the pin table has a servo on its pin.
+	errors += (startTogether > SERVOS_PER_GROUP + NUM_HW_PULSES);
+	errors += (PORTMUX_TCAROUTEA != PORTMUX_TCA0_PORTB_gc);
+	for (uint8_t hwNum = 0; hwNum < NUM_HW_PULSES; ++hwNum)
+	{
+		uint8_t servoNum = HwPulseServos[hwNum];
+		bool enabled = (TCA0_SINGLE_CTRLB & (TCA_SINGLE_CMP1EN_bm << hwNum)) != 0;
+		errors += (enabled != (servoNum != HW_PULSE_SERVO_NONE));
+		if (servoNum != HW_PULSE_SERVO_NONE)
+		{
+			errors += (ServoPinDefs[servoNum].outsetRegAddr != &PORTB_OUTSET)
+				|| (ServoPinDefs[servoNum].bitMap != _BV(hwNum + 1));
+		}
+	}
+#else
+	errors += (startTogether > SERVOS_PER_GROUP);
+#endif
+
+	// Timed move.  The first step is taken while the command is sent.
+	uint16_t moveFrames = (300 + SERVO_PULSE_PERIOD_MS - 1) / SERVO_PULSE_PERIOD_MS;
+	uint16_t frames = 0;
+	send_command("#0P1000 T300\r");
+	while ((ServoPulseDefs[0].currentPW_l16 != (1000UL << 16)) && (frames < 1000))
+	{
+		host_timer_run_frame(0);
+		main_loop_pass();
+		++frames;
+	}
+	errors += (frames + 1 < moveFrames) || (frames > moveFrames) || (MillisRemainingInCommand > SERVO_PULSE_PERIOD_MS);
+
+	check_report("frame period layout", (errors != 0),
+		"%u errors, %u ms frame, %u groups, %u ADC samples, %u pulses start together",
+		errors, SERVO_PULSE_PERIOD_MS, NUM_SERVO_GROUPS, ADC_NUM_SAMPLES, startTogether);
+}
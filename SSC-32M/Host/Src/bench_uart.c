@@ -0,0 +1,370 @@
+/*
+ * bench_uart.c
+ *
+ * Checks of the command UART: baud rate changes, RX overflow and flow
+ * control, RX headroom under the edge ISR, and number formatting.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <avr/io.h>
+
+#include "../../Include/globals.h"
+#include "../../Include/uart.h"
+#include "../../Include/adc.h"
+#include "../Include/host_hw.h"
+#include "../Include/avr_sim.h"
+#include "../Include/bench.h"
+
+// Time on the target for one edge ISR (see timer.c) and one RX ISR, in
+// microseconds at 8 MHz
+#define EDGE_ISR_US 10
+#define RX_ISR_US 4
+
+/**********************************************************************
+* Baud rate change check.  "CB" must reply at the old rate, then switch
+* to the new BAUD register value and mode.  With no command at the new
+* rate, the old rate must come back after UART_BAUD_CONFIRM_FRAMES
+* frames; with a command, the new rate must stay.  A command sent right
+* after "CB", still queued at the switch, came at the old rate and must
+* not confirm it.  Rates that cannot be set must be refused.
+**********************************************************************/
+static bool baud_is(uint16_t baudReg, uint8_t rxMode)
+{
+	return (USART0_BAUD == baudReg) && ((USART0_CTRLB & (0x03 << 1)) == rxMode);
+}
+
+void bench_baud_check(void)
+{
+	uint16_t errors = 0;
+
+	firmware_init();
+	errors += !baud_is(278, USART_RXMODE_NORMAL_gc);
+	errors += !baud_is(UART_BAUD_REG(UART_BAUD_DEFAULT), USART_RXMODE_NORMAL_gc);
+
+	// 1M baud needs CLK2X.  Not confirmed, so back to 115200.
+	host_uart_rx("CB10000\r", 8);
+	main_loop_pass();
+	tx_drain_string();
+	errors += (strcmp(txBuf, "*CB10000\r") != 0);
+	errors += !baud_is(278, USART_RXMODE_NORMAL_gc);	// Not until the reply is sent
+	main_loop_pass();
+	errors += !baud_is(64, USART_RXMODE_CLK2X_gc);
+	run_frames(UART_BAUD_CONFIRM_FRAMES - 1);
+	errors += !baud_is(64, USART_RXMODE_CLK2X_gc);
+	run_frames(2);
+	errors += !baud_is(278, USART_RXMODE_NORMAL_gc);
+
+	// A query queued behind "CB" does not confirm the new rate
+	host_uart_rx("CB5000\rVER\r", 11);
+	main_loop_pass();
+	host_uart_tx_drain(txBuf, sizeof(txBuf));
+	main_loop_pass();
+	errors += !baud_is(64, USART_RXMODE_NORMAL_gc);
+	run_frames(2 * UART_BAUD_CONFIRM_FRAMES);
+	host_uart_tx_drain(txBuf, sizeof(txBuf));
+	errors += !baud_is(278, USART_RXMODE_NORMAL_gc);
+
+	// 500k baud in normal mode, confirmed by a query
+	send_command("CB5000\r");
+	main_loop_pass();		// Switch to the new rate
+	send_command("VER\r");
+	run_frames(2 * UART_BAUD_CONFIRM_FRAMES);
+	errors += !baud_is(64, USART_RXMODE_NORMAL_gc);
+
+	// 250k baud from 500k, then 2M baud is too fast for the clock.
+	// Confirming 250k makes it the rate to go back to.
+	send_command("CB2500\r");
+	main_loop_pass();
+	send_command("CB20000\r");
+	errors += (strncmp(txBuf, "*CB0\r", 5) != 0);
+	run_frames(2 * UART_BAUD_CONFIRM_FRAMES);
+	errors += !baud_is(128, USART_RXMODE_NORMAL_gc);
+
+	check_report("baud rate change and fallback", (errors != 0), "%u errors", errors);
+}
+
+/**********************************************************************
+* RX headroom at high baud rates.  The level 1 edge ISR delays the level
+* 0 RX ISR.  For random 12 servo frames, finds the longest time the edge
+* ISRs keep the CPU busy, counting gaps too short for the RX ISR to run
+* as busy.  Also tries a move that would put the falling edges in each
+* group 1 us apart if the pulses in the group were not sorted.  The USART holds 2 received bytes, so the RX ISR must run
+* within 2 character times (20 bits) or a byte is lost.  The default
+* rate must have headroom; the highest rate that has it is reported.
+**********************************************************************/
+void bench_rx_headroom(void)
+{
+	static const uint32_t bauds[] = {115200, 250000, 500000, 1000000};
+	char cmd[BENCH_CMD_NBYTES];
+	uint32_t seed = 5;
+	uint16_t worstBusy = 0;
+
+	firmware_init();
+	for (uint16_t moveNum = 0; moveNum < 500; ++moveNum)
+	{
+		make_group_move(cmd, &seed, 0);
+		if (moveNum == 0)
+		{
+			// Falling edges 1 us apart if started in servo order
+			char * p = cmd;
+			for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+			{
+				uint8_t k = servoNum % SERVOS_PER_GROUP;
+				p += sprintf(p, "#%uP%u ", servoNum, 1500 - (k * RISING_EDGE_SPACING) + k);
+			}
+			sprintf(p, "T0\r");
+		}
+		send_command(cmd);
+		host_timer_run_frame(0);
+		main_loop_pass();
+		host_timer_run_frame(0);
+		uint16_t start = HostFrameLog[0].time;
+		uint16_t end = start + EDGE_ISR_US;
+		for (uint8_t i = 1; i < HostFrameLogCount; ++i)
+		{
+			uint16_t time = HostFrameLog[i].time;
+			if (time < end + RX_ISR_US)
+			{
+				end = ((time > end) ? time : end) + EDGE_ISR_US;
+			}
+			else
+			{
+				start = time;
+				end = time + EDGE_ISR_US;
+			}
+			if ((uint16_t)(end - start) > worstBusy)
+			{
+				worstBusy = end - start;
+			}
+		}
+	}
+
+	uint32_t maxBaud = 0;
+	printf("  RX headroom, edge ISRs busy for up to %u us:", worstBusy);
+	for (uint8_t i = 0; i < sizeof(bauds) / sizeof(bauds[0]); ++i)
+	{
+		int32_t headroom = (int32_t)(20000000UL / bauds[i]) - worstBusy - RX_ISR_US;
+		printf(" %lu:%ldus", (unsigned long)bauds[i], (long)headroom);
+		if (headroom >= 0)
+		{
+			maxBaud = bauds[i];
+		}
+	}
+	printf("\n");
+	check_report("RX ISR keeps up with edge ISR", (maxBaud < UART_BAUD_DEFAULT),
+		"highest safe rate %lu", (unsigned long)maxBaud);
+}
+
+/**********************************************************************
+* RX overflow and flow control check.  Bytes that do not fit in the RX
+* queue, and bytes lost in the USART, must be counted and reported by
+* "QU".  With flow control on, the RTS pin must go high or XOFF must be
+* sent at the high water mark, and RTS must go low or XON must be sent
+* once the queue has been read down to the low water mark.  Replies that
+* do not fit in the TX queue must be dropped whole and counted.
+**********************************************************************/
+void bench_rx_flow_check(void)
+{
+	char spaces[300];
+	uint16_t errors = 0;
+
+	memset(spaces, ' ', sizeof(spaces));
+	firmware_init();
+
+	// 300 bytes into a 254 byte queue, then a byte lost in the USART
+	host_uart_rx(spaces, sizeof(spaces));
+	main_loop_pass();
+	USART0_RXDATAH = USART_BUFOVF_bm;
+	host_uart_rx("V", 1);
+	USART0_RXDATAH = 0;
+	errors += !reply_is("ER\r", "V0.1 ALPHA INTCLK\r");
+	errors += !reply_is("QU\r", "*QU46 1 0 254 0\r");
+	errors += !reply_is("CJ QU\r", "*QU0 0 0 0 0\r");
+
+	// RTS flow control.  The RTS pin must be free: not a servo pin, nor
+	// the UART0 or battery monitor pins on port A.
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		errors += (ServoPinDefs[servoNum].outsetRegAddr == &UART_RTS_OUTSET)
+			&& ((ServoPinDefs[servoNum].bitMap & UART_RTS_bm) != 0);
+	}
+	errors += ((UART_RTS_bm & (_BV(2) | _BV(4) | _BV(5))) != 0);
+	errors += !reply_is("CF1\r", "*CF1\r");
+	host_port_sync();
+	errors += ((PORTA_OUT & _BV(3)) != 0) || ((PORTA_DIRSET & _BV(3)) == 0);
+	host_uart_rx(spaces, UART_RX_HIGH_WATER - 1);
+	host_port_sync();
+	errors += ((PORTA_OUT & _BV(3)) != 0);
+	host_uart_rx(spaces, 1);
+	host_port_sync();
+	errors += ((PORTA_OUT & _BV(3)) == 0);
+	main_loop_pass();
+	host_port_sync();
+	errors += ((PORTA_OUT & _BV(3)) != 0);
+
+	// XON/XOFF flow control
+	errors += !reply_is("CF2\r", "*CF2\r");
+	host_uart_rx(spaces, UART_RX_HIGH_WATER);
+	errors += (host_uart_tx_drain(txBuf, sizeof(txBuf)) != 1) || (txBuf[0] != UART_XOFF);
+	main_loop_pass();
+	errors += (host_uart_tx_drain(txBuf, sizeof(txBuf)) != 1) || (txBuf[0] != UART_XON);
+	errors += !reply_is("CF3\r", "*CF255\r");
+	errors += !reply_is("CF0 QU\r", "*CF0\r*QU0 0 0 192 0\r");
+
+	// Replies that do not fit in the TX queue are dropped whole.  14
+	// version strings fit in the 254 byte queue.
+	for (uint8_t i = 0; i < 20; ++i)
+	{
+		host_uart_rx("VER\r", 4);
+	}
+	main_loop_passes(40);
+	uint16_t nBytes = host_uart_tx_drain(txBuf, sizeof(txBuf) - 1);
+	errors += (nBytes != 14 * strlen((const char *)VERSION));
+	for (uint16_t i = 0; i < nBytes; i += strlen((const char *)VERSION))
+	{
+		errors += (strncmp(&txBuf[i], (const char *)VERSION, strlen((const char *)VERSION)) != 0);
+	}
+	errors += !reply_is("QU\r", "*QU0 0 0 192 6\r");
+
+	check_report("RX overflow and flow control", (errors != 0), "%u errors", errors);
+}
+
+/**********************************************************************
+* AVR cycles of the number formatters.  The listings in Lss/ are run on
+* the AVR simulator for every 16 bit value; the digits must match
+* printf(), and the cycles per formatted value are reported over all
+* values and over 0-3300, the range of the millivolt and pulse width
+* telemetry.  The cycles are from the call to the return, including the
+* calls that output the digits but not the queue writes they do.
+**********************************************************************/
+static AvrSim_t avrSim;
+static char avrDigits[8];
+static uint8_t avrNDigits;
+
+// uart_tx_put(): one digit in r24
+static void avr_put_stub(AvrSim_t * sim)
+{
+	if (avrNDigits < (sizeof(avrDigits) - 1))
+	{
+		avrDigits[avrNDigits++] = sim->r[24];
+	}
+}
+
+// uart_tx_string(): pointer to the digits in r25:r24
+static void avr_string_stub(AvrSim_t * sim)
+{
+	uint16_t addr = sim->r[24] | (sim->r[25] << 8);
+	while ((avrNDigits < (sizeof(avrDigits) - 1)) && (sim->data[addr] != 0))
+	{
+		avrDigits[avrNDigits++] = sim->data[addr++];
+	}
+}
+
+static void avr_format_check(const char * name, const char * file, const char * function,
+	const char * stubName, AvrStub_t stub)
+{
+	uint32_t errors = 0;
+	uint32_t worst = 0;
+	uint64_t total = 0;
+	uint64_t telemetryTotal = 0;
+	char expect[8];
+
+	memset(&avrSim, 0, sizeof(avrSim));
+	bool ok = avr_sim_load(&avrSim, file) && avr_sim_stub(&avrSim, stubName, stub);
+	int32_t symbol = avr_sim_symbol(&avrSim, function);
+	for (uint32_t num = 0; ok && (symbol >= 0) && (num <= UINT16_MAX); ++num)
+	{
+		avrNDigits = 0;
+		avrSim.r[24] = num;
+		avrSim.r[25] = num >> 8;
+		int32_t cycles = avr_sim_call(&avrSim, avrSim.symbols[symbol].addr, 10000);
+		if (cycles < 0)
+		{
+			ok = false;
+			break;
+		}
+		avrDigits[avrNDigits] = 0;
+		sprintf(expect, "%lu", (unsigned long)num);
+		errors += (strcmp(avrDigits, expect) != 0);
+		total += cycles;
+		telemetryTotal += (num <= 3300) ? cycles : 0;
+		worst = (cycles > (int32_t)worst) ? cycles : worst;
+	}
+	if (!ok || (symbol < 0))
+	{
+		check_report(name, true, "%s", (symbol < 0) ? "no function" : avrSim.error);
+		return;
+	}
+	check_report(name, (errors != 0), "%u errors, cycles per value %.1f, 0-3300 %.1f, worst %u",
+		errors, (double)total / 65536, (double)telemetryTotal / 3301, worst);
+}
+
+/**********************************************************************
+* Number formatting check and benchmark.  Every 16 bit value must be
+* formatted as printf() does, and the ADC to millivolt conversions must
+* match the previous 32 bit multiplies for every 10 bit ADC result.  The
+* host times are shown for reference; the AVR cycles decide, as the
+* host has a divide instruction and the AVR does not.
+**********************************************************************/
+void bench_format(void)
+{
+	BenchStat_t current = {"uart_tx_put_uint16 (per value)", 0, 0, 0};
+	BenchStat_t convert = {"adc_to_millivolts + battery", 0, 0, 0};
+	BenchStat_t prevConvert = {"previous 32 bit mV conversions", 0, 0, 0};
+	uint16_t errors = 0;
+	char expect[8];
+
+	firmware_init();
+	for (uint32_t num = 0; num <= UINT16_MAX; ++num)
+	{
+		uart_tx_begin(UART_TX_UINT16_NBYTES);
+		uart_tx_put_uint16(num);
+		uart_tx_end();
+		tx_drain_string();
+		sprintf(expect, "%lu", (unsigned long)num);
+		errors += (strcmp(txBuf, expect) != 0);
+	}
+	for (uint16_t adcResult = 0; adcResult < 1024; ++adcResult)
+	{
+		errors += (adc_to_millivolts(adcResult) != (uint32_t)adcResult * 211200UL / 65536UL);
+		errors += (adc_to_battery_millivolts(adcResult) != (uint32_t)adcResult * 808896UL / 65536UL);
+	}
+	check_report("number formatting", (errors != 0), "%u errors", errors);
+	avr_format_check("AVR % 10 formatter (avr-gcc)", BENCH_LSS_DIR "/format_div10.lss",
+		"uart_tx_uint16", "uart_tx_string", avr_string_stub);
+	avr_format_check("AVR subtract formatter (hand asm)", BENCH_LSS_DIR "/format_sub.lss",
+		"uart_tx_put_uint16", "uart_tx_put", avr_put_stub);
+
+	// Telemetry-like values: millivolts and pulse widths, 40 per drain
+	uint32_t seed = 5;
+	for (uint32_t i = 0; i < BENCH_COMMANDS * 40; ++i)
+	{
+		next_random(&seed);
+		uint16_t num = (seed >> 16) % 3301;
+		uart_tx_begin(UART_TX_UINT16_NBYTES);
+		uint64_t start = now_ns();
+		uart_tx_put_uint16(num);
+		stat_add(&current, start);
+		uart_tx_end();
+		if ((i % 20) == 19)
+		{
+			host_uart_tx_drain(txBuf, sizeof(txBuf));
+		}
+
+		volatile uint32_t sink;
+		uint16_t adcResult = (seed >> 16) & 0x3FF;
+		start = now_ns();
+		sink = adc_to_millivolts(adcResult) + adc_to_battery_millivolts(adcResult);
+		stat_add(&convert, start);
+		start = now_ns();
+		sink = ((uint32_t)adcResult * 211200UL / 65536UL) + ((uint32_t)adcResult * 808896UL / 65536UL);
+		stat_add(&prevConvert, start);
+		(void)sink;
+	}
+	stat_print(&current);
+	stat_print(&convert);
+	stat_print(&prevConvert);
+}
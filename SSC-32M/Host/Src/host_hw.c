@@ -0,0 +1,268 @@
+/*
+ * host_hw.c
+ *
+ * Host model of the ATmega4809 peripherals used by the servo controller.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "../Include/host_hw.h"
+#include "../../Include/servo_current.h"
+
+// Register storage
+#define HOST_REG8(name) volatile uint8_t name;
+#define HOST_REG16(name) volatile uint16_t name;
+#include <avr/host_regs.h>
+#undef HOST_REG8
+#undef HOST_REG16
+
+// Log of the edges output during the last call to host_timer_run_frame()
+HostEdgeLog_t HostFrameLog[HOST_MAX_FRAME_EDGES];
+uint8_t HostFrameLogCount;
+
+// Modeled ADC input values, indexed by MUXPOS
+static uint16_t adcInputs[16];
+
+// Modeled current sense device: current in milliamps for each servo
+// number, and requests received but not yet answered, oldest first,
+// with the current measured when each was received
+#define HOST_CURRENT_NSERVOS (CURRENT_SERVO_gm + 1)
+#define HOST_CURRENT_MAX_PENDING 32
+static uint16_t currentInputs[HOST_CURRENT_NSERVOS];
+static uint8_t currentPending[HOST_CURRENT_MAX_PENDING];
+static uint16_t currentPendingMilliAmps[HOST_CURRENT_MAX_PENDING];
+static uint8_t currentNPending;
+
+/**********************************************************************
+* Return all modeled registers to zero, as after a reset.
+**********************************************************************/
+void host_hw_reset(void)
+{
+#define HOST_REG8(name) name = 0;
+#define HOST_REG16(name) name = 0;
+#include <avr/host_regs.h>
+#undef HOST_REG8
+#undef HOST_REG16
+	TCA0_SINGLE_CMP1BUF = HOST_TCA_BUF_EMPTY;
+	TCA0_SINGLE_CMP2BUF = HOST_TCA_BUF_EMPTY;
+	HostFrameLogCount = 0;
+	currentNPending = 0;
+}
+
+/**********************************************************************
+* Apply any writes to the OUTSET/OUTCLR/OUTTGL registers to the OUT
+* registers, then clear them ready for the next write.
+**********************************************************************/
+static void port_sync_one(volatile uint8_t * out, volatile uint8_t * outset,
+	volatile uint8_t * outclr, volatile uint8_t * outtgl)
+{
+	*out = ((*out | *outset) & ~*outclr) ^ *outtgl;
+	*outset = 0;
+	*outclr = 0;
+	*outtgl = 0;
+}
+
+void host_port_sync(void)
+{
+	port_sync_one(&PORTA_OUT, &PORTA_OUTSET, &PORTA_OUTCLR, &PORTA_OUTTGL);
+	port_sync_one(&PORTB_OUT, &PORTB_OUTSET, &PORTB_OUTCLR, &PORTB_OUTTGL);
+	port_sync_one(&PORTC_OUT, &PORTC_OUTSET, &PORTC_OUTCLR, &PORTC_OUTTGL);
+	port_sync_one(&PORTE_OUT, &PORTE_OUTSET, &PORTE_OUTCLR, &PORTE_OUTTGL);
+	port_sync_one(&PORTF_OUT, &PORTF_OUTSET, &PORTF_OUTCLR, &PORTF_OUTTGL);
+}
+
+/**********************************************************************
+* Deliver bytes to the firmware as if they had been received by USART0.
+* The RX ISR runs once per byte, as long as it is enabled.
+**********************************************************************/
+void host_uart_rx(const char * bytes, uint16_t nBytes)
+{
+	for (uint16_t i = 0; i < nBytes; ++i)
+	{
+		USART0_RXDATAL = (uint8_t)bytes[i];
+		USART0_STATUS |= USART_RXCIF_bm;
+		if (USART0_CTRLA & USART_RXCIE_bm)
+		{
+			USART0_RXC_vect();
+		}
+	}
+}
+
+/**********************************************************************
+* Run the TX ISR until it disables itself, collecting the transmitted
+* bytes.  Returns the number of bytes transmitted.  Bytes beyond
+* maxBytes are transmitted but not stored.
+**********************************************************************/
+uint16_t host_uart_tx_drain(char * buf, uint16_t maxBytes)
+{
+	uint16_t nBytes = 0;
+
+	while (USART0_CTRLA & USART_DREIE_bm)
+	{
+		USART0_DRE_vect();
+		if ((USART0_CTRLA & USART_DREIE_bm) == 0)
+		{
+			// The ISR found the queue empty and disabled itself
+			break;
+		}
+		if ((buf != NULL) && (nBytes < maxBytes))
+		{
+			buf[nBytes] = USART0_TXDATAL;
+		}
+		++nBytes;
+	}
+	// The last byte has been shifted out
+	USART0_STATUS |= USART_TXCIF_bm;
+	return nBytes;
+}
+
+/**********************************************************************
+* Set the voltage (as an ADC reading) seen on an ADC input.
+**********************************************************************/
+void host_adc_set_input(uint8_t channel, uint16_t value)
+{
+	adcInputs[channel & 0x0F] = value;
+}
+
+/**********************************************************************
+* Complete the ADC conversion in progress, if any.  The result is the
+* input value accumulated over the number of samples set in CTRLB.  The
+* result ready ISR runs if it is enabled.
+**********************************************************************/
+void host_adc_complete(void)
+{
+	if (ADC0_COMMAND & ADC_STCONV_bm)
+	{
+		ADC0_RES = adcInputs[ADC0_MUXPOS & 0x0F] << (ADC0_CTRLB & ADC_SAMPNUM_gm);
+		ADC0_COMMAND = 0;
+		ADC0_INTFLAGS |= ADC_RESRDY_bm;
+		if (ADC0_INTCTRL & ADC_RESRDY_bm)
+		{
+			ADC0_RESRDY_vect();
+		}
+	}
+}
+
+/**********************************************************************
+* Set the current (in milliamps) that the current sense device reports
+* for a servo.
+**********************************************************************/
+void host_current_set(uint8_t servoNum, uint16_t milliAmps)
+{
+	currentInputs[servoNum & CURRENT_SERVO_gm] = milliAmps;
+}
+
+/**********************************************************************
+* Run the current sense device on USART1 (see servo_current.h).  First
+* the USART1 TX ISR runs until it disables itself, and the device takes
+* the requests sent, measuring the current for each.  Then the device answers up to maxReplies of the
+* requests waiting, oldest first, with the USART1 RX ISR taking each
+* reply byte.  Returns the number of requests taken by this call.
+**********************************************************************/
+uint8_t host_current_device(uint8_t maxReplies)
+{
+	uint8_t nRequests = 0;
+
+	while (USART1_CTRLA & USART_DREIE_bm)
+	{
+		USART1_DRE_vect();
+		if ((USART1_CTRLA & USART_DREIE_bm) == 0)
+		{
+			// The ISR found the queue empty and disabled itself
+			break;
+		}
+		if (currentNPending < HOST_CURRENT_MAX_PENDING)
+		{
+			uint8_t request = USART1_TXDATAL;
+			currentPending[currentNPending] = request;
+			currentPendingMilliAmps[currentNPending] = currentInputs[request & CURRENT_SERVO_gm];
+			++currentNPending;
+		}
+		++nRequests;
+	}
+
+	while ((maxReplies != 0) && (currentNPending != 0))
+	{
+		uint8_t request = currentPending[0];
+		uint16_t milliAmps = currentPendingMilliAmps[0];
+		--currentNPending;
+		memmove(&currentPending[0], &currentPending[1], currentNPending);
+		memmove(&currentPendingMilliAmps[0], &currentPendingMilliAmps[1],
+			currentNPending * sizeof(currentPendingMilliAmps[0]));
+		--maxReplies;
+		uint8_t reply[3] = {request, milliAmps & 0x7F, (milliAmps >> 7) & 0x7F};
+		for (uint8_t i = 0; i < 3; ++i)
+		{
+			USART1_RXDATAL = reply[i];
+			if (USART1_CTRLA & USART_RXCIE_bm)
+			{
+				USART1_RXC_vect();
+			}
+		}
+	}
+	return nRequests;
+}
+
+/**********************************************************************
+* Return the number of requests waiting at the current sense device
+* that have the same sweep bit as the newest one.
+**********************************************************************/
+uint8_t host_current_waiting(void)
+{
+	uint8_t nWaiting = 0;
+
+	for (uint8_t i = 0; i < currentNPending; ++i)
+	{
+		nWaiting += ((currentPending[i] ^ currentPending[currentNPending - 1]) & CURRENT_SWEEP_bm) == 0;
+	}
+	return nWaiting;
+}
+
+/**********************************************************************
+* Run the TCA0 compare ISR for every edge of one servo frame.  Each
+* interrupt is taken at the programmed compare value plus 'latency'
+* timer ticks.  The compare buffers are copied to CMP1 and CMP2 at the
+* start of the frame, as the hardware does at the update (BOTTOM).  The
+* frame ends when the ISR programs the compare register back to 0 for
+* the first edge of the next frame.
+* Returns the number of interrupts taken.
+**********************************************************************/
+uint8_t host_timer_run_frame(uint16_t latency)
+{
+	// Update at the start of the frame: copy the compare buffers that
+	// have been written since the last update
+	if (TCA0_SINGLE_CMP1BUF != HOST_TCA_BUF_EMPTY)
+	{
+		TCA0_SINGLE_CMP1 = TCA0_SINGLE_CMP1BUF;
+		TCA0_SINGLE_CMP1BUF = HOST_TCA_BUF_EMPTY;
+	}
+	if (TCA0_SINGLE_CMP2BUF != HOST_TCA_BUF_EMPTY)
+	{
+		TCA0_SINGLE_CMP2 = TCA0_SINGLE_CMP2BUF;
+		TCA0_SINGLE_CMP2BUF = HOST_TCA_BUF_EMPTY;
+	}
+	HostFrameLogCount = 0;
+	do
+	{
+		uint16_t time = TCA0_SINGLE_CMP0;
+		TCA0_SINGLE_CNT = time + latency;
+		TCA0_SINGLE_INTFLAGS |= TCA_SINGLE_CMP0_bm;
+		TCA0_CMP0_vect();
+		host_port_sync();
+		if (HostFrameLogCount < HOST_MAX_FRAME_EDGES)
+		{
+			HostFrameLog[HostFrameLogCount].time = time;
+			HostFrameLog[HostFrameLogCount].portA = PORTA_OUT;
+			HostFrameLog[HostFrameLogCount].portB = PORTB_OUT;
+			HostFrameLog[HostFrameLogCount].portC = PORTC_OUT;
+			HostFrameLog[HostFrameLogCount].portE = PORTE_OUT;
+			HostFrameLog[HostFrameLogCount].portF = PORTF_OUT;
+		}
+		++HostFrameLogCount;
+	} while ((TCA0_SINGLE_CMP0 != 0) && (HostFrameLogCount < HOST_MAX_FRAME_EDGES));
+	return HostFrameLogCount;
+}
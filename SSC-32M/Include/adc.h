@@ -16,9 +16,48 @@
 
 #include "globals.h"
 
+// 12 servo feedback channels, plus battery voltage
+#define NUM_ADC_CHANNELS 13
+
+// Time for one sample at the 1 MHz ADC clock, in microseconds
+#define ADC_SAMPLE_US 15
+
+// Latest time of the last edge of a frame, when the edge ISR starts the
+// scan.  The scan must be complete before the next frame.
+#define ADC_SCAN_START_MAX_US (((NUM_SERVO_GROUPS - 1) * SERVO_GROUP_SLOT_US) + \
+	(SERVOS_PER_GROUP * RISING_EDGE_SPACING) + MAXIMUM_PW)
+
+// Number of samples accumulated by the ADC for each conversion, and the
+// CTRLB setting for it.  As many as fit in the quiet time after the last
+// edge: 16 with a 20ms frame, fewer with a short frame.
+#define ADC_QUIET_US (SERVO_PULSE_PERIOD_US - ADC_SCAN_START_MAX_US)
+#if (ADC_QUIET_US >= (16 * NUM_ADC_CHANNELS * ADC_SAMPLE_US))
+#define ADC_NUM_SAMPLES 16
+#define ADC_SAMPNUM_gc ADC_SAMPNUM_ACC16_gc
+#elif (ADC_QUIET_US >= (8 * NUM_ADC_CHANNELS * ADC_SAMPLE_US))
+#define ADC_NUM_SAMPLES 8
+#define ADC_SAMPNUM_gc ADC_SAMPNUM_ACC8_gc
+#elif (ADC_QUIET_US >= (4 * NUM_ADC_CHANNELS * ADC_SAMPLE_US))
+#define ADC_NUM_SAMPLES 4
+#define ADC_SAMPNUM_gc ADC_SAMPNUM_ACC4_gc
+#elif (ADC_QUIET_US >= (2 * NUM_ADC_CHANNELS * ADC_SAMPLE_US))
+#define ADC_NUM_SAMPLES 2
+#define ADC_SAMPNUM_gc ADC_SAMPNUM_ACC2_gc
+#else
+#define ADC_NUM_SAMPLES 1
+#define ADC_SAMPNUM_gc ADC_SAMPNUM_ACC1_gc
+#endif
+
+// Time for a scan of all channels, in microseconds
+#define ADC_SCAN_US (NUM_ADC_CHANNELS * ADC_NUM_SAMPLES * ADC_SAMPLE_US)
+#if ((ADC_SCAN_START_MAX_US + ADC_SCAN_US) > SERVO_PULSE_PERIOD_US)
+#error "ADC scan does not fit after the last edge of the frame"
+#endif
+
 void adc_init(void);
-void adc_update(void);
-uint16_t adc_read_immediate(uint8_t channel);
 uint16_t adc_read_filtered(uint8_t channel);
+uint16_t adc_snapshot(uint16_t * results);
+uint16_t adc_to_millivolts(uint16_t adcResult);
+uint16_t adc_to_battery_millivolts(uint16_t adcResult);
 
 #endif // SERVO_FDBK_H
\ No newline at end of file
@@ -19,6 +19,18 @@
 * - SERVO9 pulse = PC1
 * - SERVO10 pulse = PC2
 * - SERVO11 pulse = PC3
+* - SERVO12 pulse = PC6 (16 and 24 servos)
+* - SERVO13 pulse = PC7 (16 and 24 servos)
+* - SERVO14 pulse = PA0 (16 and 24 servos)
+* - SERVO15 pulse = PA1 (16 and 24 servos)
+* - SERVO16 pulse = PF0 (24 servos)
+* - SERVO17 pulse = PF1 (24 servos)
+* - SERVO18 pulse = PF3 (24 servos)
+* - SERVO19 pulse = PF4 (24 servos)
+* - SERVO20 pulse = PE0 (24 servos, in place of SERVO8 position)
+* - SERVO21 pulse = PE1 (24 servos, in place of SERVO9 position)
+* - SERVO22 pulse = PE2 (24 servos, in place of SERVO10 position)
+* - SERVO23 pulse = PE3 (24 servos, in place of SERVO11 position)
 *
 * - SERVO0 position = PD0
 * - SERVO1 position = PD1
@@ -35,12 +47,15 @@
 *
 * - Servo Command RX = PA5 (UART0 Alternate)
 * - Servo Command TX = PA4 (UART0 Alternate)
+* - Servo Command RTS = PA3 (output, active low, RTS flow control only)
 *
 * - Servo Current RX = PC5 (UART1 Alternate)
 * - Servo Current TX = PC4 (UART1 Alternate)
 *
 * - Battery Voltage Enable = PA2
 * - Battery Voltage Input = PF2
+*
+* - LED = PF5 (unit test)
 **********************************************************************/
 
 #ifndef GLOBALS_H
@@ -52,21 +67,157 @@
 // Version
 #define VERSION (uint8_t *)"V0.1 ALPHA INTCLK\r"
 
+// Compiler memory barrier.  Ensures that writes to shared data are not
+// moved after a write to a volatile flag that hands the data to an ISR.
+#define MEMORY_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+
+// Main clock frequency in Hz.  Set in main().  The peripherals run from
+// the main clock with no prescaler.
+#ifndef F_CPU
+#define F_CPU 8000000UL
+#endif
+
 // Flag indicating unit test
 #define UNIT_TEST 0
 
-// Number of servos supported
+// Number of servos supported: 8, 12, 16 or 24, the pin layouts in
+// ServoPinDefs.  May be set on the compiler command line.
+#ifndef NUM_SERVOS
 #define NUM_SERVOS 12
+#endif
+#if ((NUM_SERVOS != 8) && (NUM_SERVOS != 12) && (NUM_SERVOS != 16) && (NUM_SERVOS != 24))
+#error "ServoPinDefs has pin layouts for 8, 12, 16 or 24 servos"
+#endif
+
+// Number of servos with a position input.  Servo N is on ADC channel N.
+// With 24 servos, the SERVO8-11 position pins drive servos 20-23, so
+// only servos 0-7 have position feedback.  The other servos read 0 mV
+// and have no closed-loop control.
+#if (NUM_SERVOS == 24)
+#define NUM_POSITION_INPUTS 8
+#else
+#define NUM_POSITION_INPUTS ((NUM_SERVOS < 12) ? NUM_SERVOS : 12)
+#endif
 
 // Minimum and maximum pulse widths in microseconds
 #define MINIMUM_PW 500
 #define MAXIMUM_PW 2500
 
-// Number of microseconds between rising edges in a group
+// Flag enabling the edge timing statistics in the edge ISR, read with
+// the "QJ" command.  On by default, so that the jitter can be read on
+// production units.  The statistics need the C edge ISR.  May be cleared
+// on the compiler command line, which leaves out "QJ" and the statistics
+// storage.
+#ifndef EDGE_TIMING_STATS
+#define EDGE_TIMING_STATS 1
+#endif
+
+// Flag selecting the hand-written assembly edge ISR in timer.c instead
+// of the C one.  The assembly ISR has not been assembled and measured
+// on the part yet, so it is off by default, and RISING_EDGE_SPACING is
+// sized for the C ISR.  May be set on the compiler command line.  The
+// edge timing statistics are only collected by the C edge ISR.
+#ifndef EDGE_ISR_ASM
+#define EDGE_ISR_ASM 0
+#endif
+#if (EDGE_ISR_ASM && EDGE_TIMING_STATS)
+#error "The edge timing statistics need the C edge ISR (EDGE_ISR_ASM 0)"
+#endif
+
+// Flag giving the host bench access to the command table and trie, so
+// that it can check the trie in parse_commands.c against the table.
+// Set by the host build.
+#ifndef PARSE_TRIE_CHECK
+#define PARSE_TRIE_CHECK 0
+#endif
+
+// Number of microseconds between rising edges in a group.  This is at
+// least twice the edge ISR time, which is about 10us for the C ISR with
+// the statistics.  The assembly ISR is hand-counted at about 6.5us; the
+// spacing is not reduced for it until that is measured on the part.
 #define RISING_EDGE_SPACING 20
 
-// Period of servo pulses in milliseconds
+// Period of servo pulses in milliseconds.  20 (50 Hz) suits analog
+// servos.  Digital servos accept shorter periods, e.g. 5 (200 Hz), 4
+// (250 Hz) or 3 (333 Hz).  May be set on the compiler command line.
+// The timer period, group layout, ADC scan and move times all follow.
+#ifndef SERVO_PULSE_PERIOD_MS
 #define SERVO_PULSE_PERIOD_MS 20
+#endif
+#define SERVO_PULSE_PERIOD_US (SERVO_PULSE_PERIOD_MS * 1000UL)
+
+// Servo grouping.  The servos are split into NUM_SERVO_GROUPS groups of
+// SERVOS_PER_GROUP consecutive servos (the last group may be smaller).
+// The pulses in a group start together, RISING_EDGE_SPACING apart, in a
+// time slot of SERVO_GROUP_SLOT_US microseconds.  There are as many
+// groups as slots fit in the frame, up to 4: with a 20ms frame, 8, 12,
+// 16 and 24 servos give groups of 2, 3, 4 and 6.  With a frame shorter
+// than 6ms, all the servos are in one group.
+#define SERVO_GROUP_SLOT_US 3000
+#if (SERVO_PULSE_PERIOD_US >= (4 * SERVO_GROUP_SLOT_US))
+#define NUM_SERVO_GROUPS 4
+#elif (SERVO_PULSE_PERIOD_US >= (3 * SERVO_GROUP_SLOT_US))
+#define NUM_SERVO_GROUPS 3
+#elif (SERVO_PULSE_PERIOD_US >= (2 * SERVO_GROUP_SLOT_US))
+#define NUM_SERVO_GROUPS 2
+#else
+#define NUM_SERVO_GROUPS 1
+#endif
+#define SERVOS_PER_GROUP ((NUM_SERVOS + NUM_SERVO_GROUPS - 1) / NUM_SERVO_GROUPS)
+
+// Servos on the same port whose pulse widths differ by no more than this
+// many microseconds share one falling edge.  0 = only equal pulse widths
+// are merged, so no pulse width is changed.  Must be less than
+// RISING_EDGE_SPACING.
+#define EDGE_COALESCE_TOLERANCE 0
+
+// Check that the group layout works.  Each slot must hold the rising
+// edges for a full group plus the longest pulse, with RISING_EDGE_SPACING
+// before the next group, and all slots must fit in the frame.  The frame
+// period must also fit in the 16 bit timer at 1 tick per microsecond.
+#if ((SERVOS_PER_GROUP * RISING_EDGE_SPACING) + MAXIMUM_PW > SERVO_GROUP_SLOT_US)
+#error "SERVO_GROUP_SLOT_US is too short for SERVOS_PER_GROUP"
+#endif
+#if ((NUM_SERVO_GROUPS * SERVO_GROUP_SLOT_US) > (SERVO_PULSE_PERIOD_MS * 1000UL))
+#error "Servo groups do not fit in SERVO_PULSE_PERIOD_MS"
+#endif
+#if (SERVO_PULSE_PERIOD_US > 65536UL)
+#error "SERVO_PULSE_PERIOD_MS is too long for the timer"
+#endif
+#if (EDGE_COALESCE_TOLERANCE >= RISING_EDGE_SPACING)
+#error "EDGE_COALESCE_TOLERANCE must be less than RISING_EDGE_SPACING"
+#endif
+
+// Flag enabling hardware pulses for the servos on TCA0 compare output
+// pins.  With the TCA0 outputs routed to PORTB, WOn is PBn, so the
+// servos on PB1 (WO1) and PB2 (WO2) are found in ServoPinDefs at init
+// (HwPulseServos).  TCA0 runs in single slope PWM mode, so these pins go
+// high at the start of the frame (BOTTOM) and low at the compare match,
+// with no interrupt.  They are left out of the edge arrays.
+//
+// Off by default.  The pulses start with group 0, not in their own
+// group's slot, since single slope PWM always starts at BOTTOM.  With
+// more than one group, their pulses overlap group 0's, so up to
+// SERVOS_PER_GROUP + NUM_HW_PULSES servos start together at the start of
+// the frame, which adds to the peak supply current.  The frame period
+// check in the host bench checks this layout.
+#ifndef HW_PULSE_OFFLOAD
+#define HW_PULSE_OFFLOAD 0
+#endif
+#define NUM_HW_PULSES 2
+// Value in HwPulseServos for a TCA0 output with no servo on its pin
+#define HW_PULSE_SERVO_NONE 0xFF
+
+// Number of bins in the edge lateness histogram, and the width of each
+// bin as a shift count (bin = lateness in us >> EDGE_LATE_BIN_SHIFT).
+// The last bin collects all larger values.
+#define EDGE_LATE_NBINS 8
+#define EDGE_LATE_BIN_SHIFT 1
+
+// Edge lateness in microseconds at or above which an edge is counted as
+// stacked, i.e. delayed by the previous edge ISR or another interrupt
+// rather than by the normal interrupt entry time.
+#define EDGE_STACKED_US 6
 
 // Pin definition typedef
 struct PinDef_s
@@ -85,17 +236,119 @@ struct EdgeDef_s
 	uint8_t bitMap;		// Bit map with '1' bit for the pin
 	uint16_t nextEdge;	// Timer value for the next edge on the pin
 };
+// The assembly edge ISR reads the edges as packed 5 byte records in this
+// field order: regAddr low, regAddr high, bitMap, nextEdge low, nextEdge
+// high.  Do not reorder the fields.
 typedef struct EdgeDef_s EdgeDef_t;
 
+// Edge timing statistics typedef.  Lateness is the number of timer ticks
+// (microseconds) between the compare match and entry to the edge ISR.
+struct EdgeTiming_s
+{
+	uint16_t minLate;		// Minimum lateness seen
+	uint16_t maxLate;		// Maximum lateness seen
+	uint16_t lateHist[EDGE_LATE_NBINS];	// Histogram of lateness
+};
+typedef struct EdgeTiming_s EdgeTiming_t;
+
+// Motion profile phases.  A move with acceleration runs through the
+// phases in order, skipping phases with no frames.  The S-curve uses two
+// phases for each ramp (acceleration rising, then falling); the
+// trapezoid uses one.  PROFILE_NONE is constant velocity.
+#define PROFILE_NONE 0
+#define PROFILE_START 1
+#define PROFILE_ACCEL_1 2
+#define PROFILE_ACCEL_2 3
+#define PROFILE_CRUISE 4
+#define PROFILE_DECEL_1 5
+#define PROFILE_DECEL_2 6
+
+// Maximum passes to fit the ramps to the cruise velocity (see setProfile)
+#define PROFILE_PLAN_PASSES 4
+
 // Pulse array typedef
 struct PulseDef_s
 {
 	uint16_t targetPW;			// The desired pulse width in timer ticks
 	uint32_t currentPW_l16;		// The current pulse width, left shifted 16 bits
 	int32_t deltaPW_l16;		// The delta pulse width, left shifted 16 bits
+	uint16_t framesRemaining;	// Frames until the target is reached, 0 = not moving
+	// Motion profile, used if phase is not PROFILE_NONE
+	uint8_t phase;				// Current phase (PROFILE_xxx)
+	bool sCurve;				// S-curve if true, trapezoid if false
+	uint16_t phaseFrames;		// Frames remaining in the current phase
+	int32_t accel_l16;			// Change in deltaPW_l16 per frame
+	int32_t jerk_l16;			// Change in accel_l16 per frame
+	// Fractions of currentPW_l16, deltaPW_l16, accel_l16 and jerk_l16 in
+	// units of 1 / phaseDiv, so the profile is followed exactly (see
+	// servo_pulse.c).  Always less than phaseDiv.
+	uint32_t phaseDiv;
+	uint32_t currentFrac;
+	uint32_t deltaFrac;
+	uint32_t accelFrac;
+	uint32_t jerkFrac;
+	int32_t cruisePW_l16;		// Planned deltaPW_l16 between the ramps
+	uint16_t accelFrames;		// Frames in each acceleration phase
+	uint16_t cruiseFrames;		// Frames in the cruise phase
+	uint16_t decelFrames;		// Frames in each deceleration phase
 };
 typedef struct PulseDef_s PulseDef_t;
 
+// Units of the AA and AD acceleration commands, in microseconds/second^2
+#define ACCEL_UNIT_US_PER_S2 10
+// One acceleration unit as a change in deltaPW_l16 per frame, times
+// 2^ACCEL_L16_SHIFT.  The unit is 0.66 * SERVO_PULSE_PERIOD_MS^2, so the
+// shift is as large as the frame period allows while any 16 bit
+// acceleration times the scale still fits in 32 bits.  Short frames need
+// the extra bits: at 3ms, a shift of 4 would lose 0.4% of each unit.
+#if (SERVO_PULSE_PERIOD_MS <= 5)
+#define ACCEL_L16_SHIFT 10
+#elif (SERVO_PULSE_PERIOD_MS <= 11)
+#define ACCEL_L16_SHIFT 8
+#elif (SERVO_PULSE_PERIOD_MS <= 22)
+#define ACCEL_L16_SHIFT 6
+#else
+#define ACCEL_L16_SHIFT 4
+#endif
+#define ACCEL_L16_PER_UNIT_SCALED (((ACCEL_UNIT_US_PER_S2 * 65536ULL \
+	* SERVO_PULSE_PERIOD_MS * SERVO_PULSE_PERIOD_MS) << ACCEL_L16_SHIFT) / 1000000UL)
+#if (ACCEL_L16_PER_UNIT_SCALED > 65536UL)
+#error "ACCEL_L16_SHIFT is too large for SERVO_PULSE_PERIOD_MS"
+#endif
+
+// Servo acceleration typedef.  Set by the AA, AD and AS commands, and
+// kept for later moves.  An acceleration of 0 means no limit.
+struct ServoAccel_s
+{
+	uint16_t accel;				// Acceleration at the start of a move, ACCEL_UNIT_US_PER_S2
+	uint16_t decel;				// Deceleration at the end of a move, ACCEL_UNIT_US_PER_S2
+	bool sCurve;				// S-curve if true, trapezoid if false
+};
+typedef struct ServoAccel_s ServoAccel_t;
+
+// Closed-loop gains are Q8 (256 = gain of 1), and the slope of the
+// calibrated feedback is microseconds per ADC count in Q12
+#define CONTROL_GAIN_SHIFT 8
+#define CONTROL_SLOPE_SHIFT 12
+
+// Closed-loop position control typedef.  The gains and calibration are
+// set by the KP, KI, KD, CL, CPL and CPH commands, and the loop state
+// is updated every frame by servo_control_update().
+struct ServoControl_s
+{
+	bool enabled;				// TRUE if closed-loop control is on
+	uint16_t kp;				// Proportional gain, Q8
+	uint16_t ki;				// Integral gain per frame, Q8
+	uint16_t kd;				// Derivative gain per frame, Q8
+	uint16_t calPW[2];			// Pulse widths of the low and high calibration points
+	uint16_t calAdc[2];			// Feedback ADC results at the calibration points
+	int32_t slope_q12;			// Microseconds per ADC count, 0 = not calibrated
+	int16_t integral;			// Sum of the position errors in microseconds
+	int16_t prevError;			// Position error in the previous frame
+	int16_t trim;				// Added to the pulse width output, in microseconds
+};
+typedef struct ServoControl_s ServoControl_t;
+
 // Servo Command typedef
 struct ServoCmd_s
 {
@@ -106,23 +359,87 @@ struct ServoCmd_s
 typedef struct ServoCmd_s ServoCmd_t;
 typedef uint16_t ServoCmdMoveTime_t;		// The commanded (min) move time in milliseconds
 
+// Number of parsed commands that can wait in the command queue.  The
+// host can send moves ahead of time, up to this many, and use the "QF"
+// command to see how many slots are free.
+#define CMD_QUEUE_DEPTH 8
+
+// Command queue entry typedef.  Holds one complete command line.
+struct ServoCmdEntry_s
+{
+	ServoCmd_t servos[NUM_SERVOS];	// Command for each servo
+	ServoCmdMoveTime_t moveTime;	// The commanded (min) move time in milliseconds
+	bool sequenced;				// TRUE to start when the previous move is done, FALSE to start now
+};
+typedef struct ServoCmdEntry_s ServoCmdEntry_t;
+
 // Pin definition array for servo output pins
 extern const PinDef_t ServoPinDefs[NUM_SERVOS];
 
-// Edge array for servo output pulses.  Defines the rising and falling edges for each pulse.
-extern EdgeDef_t ServoPulseEdges[2 * NUM_SERVOS];
-// Index of current edge in array
-extern uint8_t EdgeIndex;
+// Double buffered edge arrays for servo output pulses.  Define the rising and falling
+// edges for each pulse.
+extern EdgeDef_t ServoPulseEdges[2][2 * NUM_SERVOS];
+// Edge array being output by the ISR, and edge array waiting to be switched
+// in at the end of the frame (EDGE_BUFFER_NONE if none)
+#define EDGE_BUFFER_NONE 0xFF
+extern volatile uint8_t EdgeBufferActive;
+extern volatile uint8_t EdgeBufferPending;
+// Servos on the TCA0 WO1 and WO2 pins, or HW_PULSE_SERVO_NONE
+extern uint8_t HwPulseServos[NUM_HW_PULSES];
+// TCA0 compare values for the offloaded servos, one set for each edge array
+extern uint16_t HwPulseCompare[2][NUM_HW_PULSES];
+// Count of frames output by the ISR (wraps)
+extern volatile uint8_t FrameCount;
+
+#if (EDGE_TIMING_STATS)
+// Edge timing statistics, indexed by edge number in the frame
+extern EdgeTiming_t EdgeTiming[2 * NUM_SERVOS];
+// Count of edges stacked behind another interrupt, and of edges
+// programmed after their time had already passed
+extern uint16_t EdgeStackedCount;
+extern uint16_t EdgeMissedCount;
+#endif
+
+// Frame build statistics: frames output, frames rebuilt and handed to
+// the ISR, and groups rebuilt
+extern uint16_t FrameTotalCount;
+extern uint16_t FrameBuildCount;
+extern uint16_t GroupRebuildCount;
 
 // Pulse array
 extern PulseDef_t ServoPulseDefs[NUM_SERVOS];
 
+// Acceleration settings
+extern ServoAccel_t ServoAccelDefs[NUM_SERVOS];
+
+// Closed-loop control settings and state
+extern ServoControl_t ServoControlDefs[NUM_SERVOS];
+
 // Command array, move time, and flag indicating command is waiting to be processed
 extern ServoCmd_t ServoCmdArray[NUM_SERVOS];
 extern ServoCmdMoveTime_t ServoCmdMoveTime;
 extern bool ServoCmdWaiting;
+// Flag indicating the command being parsed waits for the previous move
+extern bool ServoCmdSequenced;
+
+// Command queue (FIFO), index of the oldest entry, and number of entries
+extern ServoCmdEntry_t ServoCmdQueue[CMD_QUEUE_DEPTH];
+extern uint8_t ServoCmdQueueHead;
+extern uint8_t ServoCmdQueueCount;
+
+// Serial RX statistics: bytes dropped because the RX queue was full,
+// bytes lost in the USART because the RX ISR was late, and the most
+// bytes seen waiting in the RX queue
+extern uint16_t UartRxOverflowCount;
+extern uint16_t UartRxHwOverflowCount;
+extern uint8_t UartRxMaxFill;
+// Count of replies dropped because the TX queue was full
+extern uint16_t UartTxDropCount;
+
+// Count of binary command frames dropped for a bad length, CRC or opcode
+extern uint16_t BinaryFrameErrorCount;
 
-// Counter of 20ms loops
+// Counter of frames (servo pulse periods)
 extern uint64_t LoopCount;
 
 // Number of milliseconds remaining in the current command
@@ -8,7 +8,67 @@
 #ifndef SERVO_COMMANDS_H
 #define SERVO_COMMANDS_H
 
+/**********************************************************************
+* Binary command frames.  These may be sent between ASCII command
+* lines, and are decoded without tokenizing.  A frame is:
+*	BIN_FRAME_SYNC, length, opcode, payload[length], CRC
+* The length counts the payload bytes only.  The CRC is CRC-8 (polynomial
+* 0x07, initial value 0) over the length, opcode and payload.  Frames
+* with a bad CRC or length are dropped.  Multi-byte fields are little
+* endian.
+*
+* BIN_OP_MOVE payload, equivalent to one ASCII move command line:
+*	flags			BIN_MOVE_xxx bits
+*	move time		uint16_t, milliseconds ("T")
+*	servo mask		BIN_MASK_NBYTES, bit N set if servo N is commanded
+*	pulse widths	uint16_t for each commanded servo, in servo order,
+*					microseconds ("P"), or 0 for limp ("L")
+*	speeds			uint16_t for each commanded servo, in us/sec ("S"),
+*					only if BIN_MOVE_SPEED is set
+*
+* BIN_OP_QUERY payload, to read the feedback of a set of servos at once
+* (see "QPR" and "QSR"):
+*	flags			BIN_QUERY_xxx bits
+*	servo mask		BIN_MASK_NBYTES, bit N set to read servo N
+* The reply is a frame with the same opcode and payload:
+*	flags			as in the query
+*	servo mask		as in the query, without bits above the last servo
+*	feedback		for each servo in the mask, in servo order:
+*					uint16_t voltage in millivolts ("QP"), then
+*					uint8_t status ("Q"), only if BIN_QUERY_STATUS is set
+* The reply may hold any byte value, including XON and XOFF, so the
+* binary query should not be used with XON/XOFF flow control.
+**********************************************************************/
+#define BIN_FRAME_SYNC 0xA5
+#define BIN_OP_MOVE 0x01
+#define BIN_MOVE_SEQ 0x01			// Start when the previous move is done ("SEQ")
+#define BIN_MOVE_SPEED 0x02			// Speeds follow the pulse widths
+#define BIN_OP_QUERY 0x02
+#define BIN_QUERY_STATUS 0x01		// Status follows each voltage
+#define BIN_MASK_NBYTES ((NUM_SERVOS + 7) / 8)
+#define BIN_MASK_LAST_gm ((uint8_t)(0xFF >> ((8 * BIN_MASK_NBYTES) - NUM_SERVOS)))
+#define BIN_MAX_PAYLOAD_NBYTES (3 + BIN_MASK_NBYTES + (4 * NUM_SERVOS))
+
+// Command trie node.  The children of a node are consecutive in the
+// trie, in symbol order, starting at firstChild.  Bit N of symbols is
+// set if there is a child for symbol N ('#' = 0, 'A' to 'Z' = 1 to 26),
+// so the child for a symbol is found by counting the lower set bits.
+struct TrieNode_s
+{
+	uint8_t symbols[4];		// Bit map of child symbols
+	uint8_t firstChild;		// Index of the first child
+	uint8_t cmdIdx;			// Command table index of the command ending here, or PARSE_TRIE_NONE
+};
+typedef struct TrieNode_s TrieNode_t;
+
+// Trie node or command index meaning none
+#define PARSE_TRIE_NONE 0xFF
+
 void parse_commands_init(void);
 void parse_commands_update(void);
+#if (PARSE_TRIE_CHECK)
+const char * parse_commands_string(uint8_t cmdIdx);
+const TrieNode_t * parse_commands_trie(uint8_t * nNodes);
+#endif
 
 #endif //SERVO_COMMANDS_H
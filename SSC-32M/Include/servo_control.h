@@ -0,0 +1,39 @@
+/*
+ * servo_control.h
+ *
+ * Closed-loop position control for the DeskPet servo controller.
+ */ 
+
+
+#ifndef SERVO_CONTROL_H
+#define SERVO_CONTROL_H
+
+#include <stdint.h>
+
+#include "globals.h"
+
+// Calibration points, for servo_control_calibrate()
+#define CONTROL_CAL_LOW 0
+#define CONTROL_CAL_HIGH 1
+
+// Smallest difference in ADC results between the calibration points
+#define CONTROL_CAL_MIN_ADC 16
+
+// Default gains, Q8.  servo_control_update() uses the ADC scan of the
+// previous frame, and its trim is output in the frame being built, so
+// the loop reacts to a position error one frame late.  Gains that are
+// stable at one frame period may oscillate at a longer period.
+#define CONTROL_KP_DEFAULT 64
+#define CONTROL_KI_DEFAULT 32
+#define CONTROL_KD_DEFAULT 0
+
+// Largest trim added to a pulse width, in microseconds, and largest
+// sum of the position errors
+#define CONTROL_TRIM_MAX 250
+#define CONTROL_INTEGRAL_MAX 8000
+
+void servo_control_init(void);
+void servo_control_update(void);
+void servo_control_calibrate(uint8_t servoNum, uint8_t point, uint16_t pw);
+
+#endif //SERVO_CONTROL_H
@@ -9,4 +9,46 @@
 #ifndef SERVO_CURRENT_H
 #define SERVO_CURRENT_H
 
+#include <stdint.h>
+
+#include "globals.h"
+
+/**********************************************************************
+* Current sense link, on UART1 (alternate pins PC4/PC5).
+*
+* The controller sends a 1 byte request for one servo:
+*	CURRENT_REQUEST | sweep bit | servo number
+* The current sense device replies with 3 bytes, the first of which
+* repeats the request:
+*	CURRENT_REQUEST | sweep bit | servo number, current bits 0-6,
+*	current bits 7-13
+* The current is in milliamps.  Only the first byte of a reply has the
+* top bit set, so the controller finds the start of the next reply
+* after a lost or corrupted byte.  Replies may come in any order.  The
+* sweep bit changes with each sweep, so that late replies to a sweep
+* that was abandoned are told apart from replies to the current sweep.
+**********************************************************************/
+#define CURRENT_BAUD 115200UL
+#define CURRENT_REQUEST 0x80
+#define CURRENT_SWEEP_bm 0x40
+#define CURRENT_SERVO_gm 0x3F
+#define CURRENT_DATA_gm 0x7F
+
+#if (NUM_SERVOS > CURRENT_SERVO_gm + 1)
+#error "Servo numbers do not fit in a current sense request"
+#endif
+
+// Number of requests sent ahead of the replies
+#define CURRENT_MAX_IN_FLIGHT 4
+
+// Time for a sweep of all servos, and the number of frames between the
+// starts of sweeps.  A sweep is started every frame, or every few
+// frames if the frame is shorter than a sweep.
+#define CURRENT_SWEEP_US 4000
+#define CURRENT_SWEEP_FRAMES ((CURRENT_SWEEP_US + SERVO_PULSE_PERIOD_US - 1) / SERVO_PULSE_PERIOD_US)
+
+void servo_current_init(void);
+void servo_current_update(void);
+uint16_t servo_current_read(uint8_t servoNum);
+
 #endif //SERVO_CURRENT_H
@@ -8,7 +8,11 @@
 #ifndef SERVO_PULSE_H
 #define SERVO_PULSE_H
 
+#include <stdint.h>
+
 void servo_pulse_init(void);
 void servo_pulse_update(void);
+void servo_pulse_changed(uint8_t servoNum);
+void servo_pulse_stats_clear(void);
 
 #endif //SERVO_PULSE_H
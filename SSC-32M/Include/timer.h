@@ -9,5 +9,8 @@
 #define TIMER_H
 
 void timer_init(void);
+#if (EDGE_TIMING_STATS)
+void timer_stats_clear(void);
+#endif
 
 #endif //TIMER_H
@@ -9,12 +9,65 @@
 #ifndef UART_H
 #define UART_H
 
+// Baud rate after reset, and the time (in ms and frames) the host has to
+// send a recognized command at a new baud rate before the old rate is
+// restored
+#define UART_BAUD_DEFAULT 115200UL
+#define UART_BAUD_CONFIRM_MS 1000
+#define UART_BAUD_CONFIRM_FRAMES (UART_BAUD_CONFIRM_MS / SERVO_PULSE_PERIOD_MS)
+
+// USART BAUD register value for a baud rate, in normal and double speed
+// (CLK2X) mode, rounded to nearest.  The register must be at least 64.
+#define UART_BAUD_REG(baud) (((4UL * F_CPU) + ((baud) / 2)) / (baud))
+#define UART_BAUD_REG_2X(baud) (((8UL * F_CPU) + ((baud) / 2)) / (baud))
+
+// Highest baud rate in normal mode, and in double speed mode
+#define UART_BAUD_MAX_NORMAL ((4UL * F_CPU) / 64)
+#define UART_BAUD_MAX_2X ((8UL * F_CPU) / 64)
+
+#if (UART_BAUD_DEFAULT > UART_BAUD_MAX_NORMAL)
+#error "UART_BAUD_DEFAULT is too high for F_CPU"
+#endif
+
+// Flow control modes, set by the "CF" command.  When the RX queue fills
+// to UART_RX_HIGH_WATER bytes, the host is told to stop sending, by
+// driving the RTS pin high or by sending XOFF.  When it empties to
+// UART_RX_LOW_WATER bytes, RTS is driven low or XON is sent.
+#define UART_FLOW_NONE 0
+#define UART_FLOW_RTS 1
+#define UART_FLOW_XONXOFF 2
+#define UART_RX_HIGH_WATER 192
+#define UART_RX_LOW_WATER 64
+#define UART_XON 0x11
+#define UART_XOFF 0x13
+
+// RTS output pin, PA3, active low (low = ready to receive).  Only driven
+// in UART_FLOW_RTS mode.  See the I/O map in globals.h.
+#define UART_RTS_DIRSET PORTA_DIRSET
+#define UART_RTS_OUTSET PORTA_OUTSET
+#define UART_RTS_OUTCLR PORTA_OUTCLR
+#define UART_RTS_bm _BV(3)
+
+// Most bytes written by uart_tx_put_uint16()
+#define UART_TX_UINT16_NBYTES 5
+
 void uart_init(void);
 void uart_update(void);
 bool uart_rx_get_char(uint8_t * rxByte);
 void uart_tx_put_char(uint8_t txByte);
 void uart_tx_string(uint8_t * s);
 void uart_tx_uint16(uint16_t num);
+uint8_t uart_tx_free(void);
+bool uart_tx_begin(uint8_t maxBytes);
+void uart_tx_put(uint8_t txByte);
+void uart_tx_put_uint16(uint16_t num);
+void uart_tx_end(void);
+void uart_tx_write(const uint8_t * buf, uint8_t nBytes);
+bool uart_baud_request(uint32_t baud);
+void uart_baud_confirm(void);
+bool uart_rx_new_rate(void);
+bool uart_flow_control(uint8_t mode);
+void uart_stats_clear(void);
 
 #if (UNIT_TEST)
 void uart_rx_stuff(char * cmd_string);
@@ -5,6 +5,7 @@
  * Author : Mike Dvorsky
  */ 
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
@@ -13,14 +14,88 @@
 #include "../Include/globals.h"
 #include "../Include/adc.h"
 
-// 12 servo feedback channels, plus battery voltage
-#define NUM_ADC_CHANNELS 13
+/**********************************************************************
+* The channels are scanned once per servo frame, in the quiet part of
+* the frame after the last edge.  The servo pulses are all output in the
+* group slots at the start of the frame, so by then every servo's pulse
+* has ended and no edge comes until the next frame.  This keeps the
+* pulse edges and the current steps that follow them out of the samples.
+* The edge ISR starts the scan at the last edge of the frame.  Then the
+* ADC result ready ISR stores the result of each channel and starts the
+* conversion of the next, and stops after the last channel.  The ISR
+* priority is low (level 0), so it never delays the edge ISR.
+*
+* Each conversion accumulates ADC_NUM_SAMPLES samples in hardware.  At
+* the 1 MHz ADC clock, one sample takes about ADC_SAMPLE_US, so with a
+* 20ms frame (16 samples) one channel takes about 240us and a scan of
+* all channels (ADC_SCAN_US) about 3.1ms.  A shorter frame leaves less
+* quiet time, so adc.h selects fewer samples, and checks that the scan
+* fits after the last edge.
+*
+* The filtered results are kept at the accumulated scale (ADC_NUM_SAMPLES
+* times a 10 bit result) and double buffered.  The ISR filters each new result
+* against the last complete scan into the other buffer, and at the end
+* of the scan switches buffers and increments the scan sequence number.
+* Readers copy from the complete buffer, and copy again if the sequence
+* number changed meanwhile, so all channels come from the same scan.
+**********************************************************************/
 
-// Array of conversion results
-static uint16_t filteredResults[NUM_ADC_CHANNELS];
-// Pointer to the channel being converted
+// Filtered results, two buffers at the accumulated scale
+static uint16_t filteredResults[2][NUM_ADC_CHANNELS];
+// Index of the buffer holding the last complete scan
+static volatile uint8_t filteredIdx;
+// Number of complete scans, incremented after switching buffers
+static volatile uint16_t scanSeq;
+// Channel being converted
 static uint8_t adcChannel;
 
+//*********************************************************************
+// ADC result ready ISR.  Store and filter the result, then start the
+// conversion of the next channel.
+//*********************************************************************
+ISR(ADC0_RESRDY_vect)
+{
+	// Reading the result clears the interrupt flag
+	uint16_t adcResult = ADC0_RES;
+	uint8_t channel = adcChannel;
+	uint8_t idx = filteredIdx;
+
+	// Filter the result and store in the buffer not being read.  The
+	// samples are taken away from the pulse edges, so a light filter
+	// is enough.  Use filter equation
+	//   newFiltered = 0.5 * prevFiltered + 0.5 * latestConversion
+	//               = (prevFiltered + latestConversion) / 2
+	// The first scan has nothing to filter against, so store the
+	// result as is.
+	if (scanSeq == 0)
+	{
+		filteredResults[idx ^ 1][channel] = adcResult;
+	}
+	else
+	{
+		filteredResults[idx ^ 1][channel] = (filteredResults[idx][channel] + adcResult) / 2;
+	}
+
+	// Increment channel number.  At the end of the scan, switch
+	// buffers and select the first channel, ready for the edge ISR to
+	// start the next scan.
+	++channel;
+	if (channel >= NUM_ADC_CHANNELS)
+	{
+		channel = 0;
+		filteredIdx = idx ^ 1;
+		++scanSeq;
+	}
+	adcChannel = channel;
+	ADC0_MUXPOS = channel;
+
+	// Start next conversion, unless the scan is complete
+	if (channel != 0)
+	{
+		ADC0_COMMAND = ADC_STCONV_bm;
+	}
+}
+
 void adc_init(void)
 {
 	// Disable the input buffer, disable pullup, disable
@@ -41,8 +116,8 @@ void adc_init(void)
 	PORTF_PIN3CTRL = PORT_ISC_INPUT_DISABLE_gc;	// ADC13
 	PORTF_PIN4CTRL = PORT_ISC_INPUT_DISABLE_gc;	// ADC14
 	PORTF_PIN5CTRL = PORT_ISC_INPUT_DISABLE_gc;	// ADC15
-	// Accumulate 1 sample
-	ADC0_CTRLB = ADC_SAMPNUM_ACC1_gc;
+	// Accumulate ADC_NUM_SAMPLES samples per conversion
+	ADC0_CTRLB = ADC_SAMPNUM_gc;
 	// Use reduced size sampling cap, VDD reference, and 1 MHz ADC clock
 	ADC0_CTRLC = ADC_SAMPCAP_bm | ADC_REFSEL_VDDREF_gc | ADC_PRESC_DIV8_gc;
 	// Delay 32 clocks before first sample after powerup
@@ -55,75 +130,80 @@ void adc_init(void)
 	ADC0_CALIB = ADC_DUTYCYC_DUTY25_gc;
 	// Enable ADC
 	ADC0_CTRLA = ADC_ENABLE_bm;
-	// Clear result ready flag if set
+	// Clear result ready flag if set, and interrupt when a result is
+	// ready
 	ADC0_INTFLAGS = ADC_RESRDY_bm;
-	
-	// Loop through all channels, taking the first reading
-	for (adcChannel = 0; adcChannel < NUM_ADC_CHANNELS; ++adcChannel)
-	{
-		filteredResults[adcChannel] = adc_read_immediate(adcChannel);
-	}
-	// Start first conversion for periodic reading
+	ADC0_INTCTRL = ADC_RESRDY_bm;
+
+	// Start the first scan now, so the results are ready before the
+	// first frame ends.  The timer is not running yet, so it cannot
+	// overlap a scan started by the edge ISR.  The results read 0 until
+	// the first scan is complete, about 3ms after interrupts are
+	// enabled.
+	memset(filteredResults, 0, sizeof(filteredResults));
+	filteredIdx = 0;
+	scanSeq = 0;
 	adcChannel = 0;
 	ADC0_MUXPOS = adcChannel;
 	ADC0_COMMAND = ADC_STCONV_bm;
 }
 
-void adc_update(void)
+//*********************************************************************
+// Return the filtered result for one channel, at 10 bit scale.
+//*********************************************************************
+uint16_t adc_read_filtered(uint8_t channel)
 {
-	uint16_t adcResult;
-	
-	// Cycle through the ADC pins, taking readings in sequence
-	
-	// If conversion in progress, return
-	if ((ADC0_COMMAND & ADC_STCONV_bm) != 0)
-	{
-		return;
-	}
+	uint16_t seq;
+	uint16_t result;
 
-	// Clear result ready flag from the previous conversion
-	ADC0_INTFLAGS = ADC_RESRDY_bm;
-	
-	// Get result from the previous conversion, filter, and store.
-	// Use filter equation
-	//   newFiltered = 0.75 * prevFiltered + 0.25 * latestConversion
-	//               = ((3 * prevFiltered) + latestConversion) / 4
-	adcResult = ADC0_RES;
-	filteredResults[adcChannel] = ((filteredResults[adcChannel] * 3) + adcResult) / 4;
-	
-	// Increment channel number, wrapping if needed
-	++adcChannel;
-	if (adcChannel >= NUM_ADC_CHANNELS)
+	do 
 	{
-		adcChannel = 0;
-	}
-	
-	// Start next conversion
-	ADC0_MUXPOS = adcChannel;
-	ADC0_COMMAND = ADC_STCONV_bm;
-	
+		seq = scanSeq;
+		result = filteredResults[filteredIdx][channel];
+	} while (seq != scanSeq);
+	return result / ADC_NUM_SAMPLES;
 }
 
-uint16_t adc_read_immediate(uint8_t channel)
+//*********************************************************************
+// Copy the filtered results for all NUM_ADC_CHANNELS channels, at 10 bit
+// scale, from the last complete scan.  Returns the scan sequence
+// number, which changes when a new scan is complete.
+//*********************************************************************
+uint16_t adc_snapshot(uint16_t * results)
 {
-	uint16_t adcVoltage;
-	
-	// Set channel (ADC0-ADC15)
-	ADC0_MUXPOS = channel;
-	// Start conversion
-	ADC0_COMMAND = ADC_STCONV_bm;
-	// Wait for conversion to complete
-	while((ADC0_INTFLAGS & ADC_RESRDY_bm) == 0);
-	// Clear result ready flag
-	ADC0_INTFLAGS = ADC_RESRDY_bm;
-	// Read result
-	adcVoltage = ADC0_RES;
-	// Return result
-	return adcVoltage;
+	uint16_t seq;
+
+	do 
+	{
+		seq = scanSeq;
+		const uint16_t * filtered = filteredResults[filteredIdx];
+		for (uint8_t channel = 0; channel < NUM_ADC_CHANNELS; ++channel)
+		{
+			results[channel] = filtered[channel] / ADC_NUM_SAMPLES;
+		}
+	} while (seq != scanSeq);
+	return seq;
 }
 
+//*********************************************************************
+// Convert an ADC result to the voltage at the pin in mV.  ADC of 1024
+// corresponds to the supply voltage of 3.3V = 3300 mV, so the scale is
+// 3300/1024 = 3.22265625 = 3 + 57/256 exactly.  This takes only 16 bit
+// multiplies for a 10 bit result.
+//*********************************************************************
+uint16_t adc_to_millivolts(uint16_t adcResult)
+{
+	return (adcResult * 3) + ((adcResult * 57) >> 8);
+}
 
-uint16_t adc_read_filtered(uint8_t channel)
+//*********************************************************************
+// Convert a battery voltage ADC result to the battery voltage in mV.
+// ADC of 1024 corresponds to a battery voltage of 12639 mV, so the scale
+// is 12639/1024 = 12.3427734375 = 12 + 351/1024 exactly.
+// The fraction needs a 16x16 bit multiply with a 32 bit result, which
+// is much cheaper than a 32x32 bit multiply on the AVR.
+//*********************************************************************
+uint16_t adc_to_battery_millivolts(uint16_t adcResult)
 {
-	return filteredResults[channel];
+	return (adcResult * 12) + (uint16_t)(((uint32_t)adcResult * 351) >> 10);
 }
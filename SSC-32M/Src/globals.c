@@ -16,7 +16,10 @@
 * Pin definition array for servo output pins.  Each entry contains 
 * pointers to the registers to set the pin, clear the pin, and
 * set the pin to output; and the bitmask that needs to be written
-* to the registers.  The array is indexed by servo number 0-11.
+* to the registers.  The array is indexed by servo number 0 to
+* NUM_SERVOS - 1.  Each servo count adds pins to the layout of the one
+* below it, see the I/O map in globals.h.  The servos on PB1 and PB2 are
+* the ones with hardware pulses (HW_PULSE_OFFLOAD).
 **********************************************************************/
 const PinDef_t ServoPinDefs[NUM_SERVOS] =
 {
@@ -28,20 +31,80 @@ const PinDef_t ServoPinDefs[NUM_SERVOS] =
 	{&PORTB_OUTSET,&PORTB_OUTCLR,&PORTB_DIRSET,_BV(3)},	// Servo5 = PB3
 	{&PORTB_OUTSET,&PORTB_OUTCLR,&PORTB_DIRSET,_BV(4)},	// Servo6 = PB4
 	{&PORTB_OUTSET,&PORTB_OUTCLR,&PORTB_DIRSET,_BV(5)},	// Servo7 = PB5
+#if (NUM_SERVOS > 8)
 	{&PORTC_OUTSET,&PORTC_OUTCLR,&PORTC_DIRSET,_BV(0)},	// Servo8 = PC0
 	{&PORTC_OUTSET,&PORTC_OUTCLR,&PORTC_DIRSET,_BV(1)},	// Servo9 = PC1
 	{&PORTC_OUTSET,&PORTC_OUTCLR,&PORTC_DIRSET,_BV(2)},	// Servo10 = PC2
 	{&PORTC_OUTSET,&PORTC_OUTCLR,&PORTC_DIRSET,_BV(3)},	// Servo11 = PC3
+#endif
+#if (NUM_SERVOS > 12)
+	{&PORTC_OUTSET,&PORTC_OUTCLR,&PORTC_DIRSET,_BV(6)},	// Servo12 = PC6
+	{&PORTC_OUTSET,&PORTC_OUTCLR,&PORTC_DIRSET,_BV(7)},	// Servo13 = PC7
+	{&PORTA_OUTSET,&PORTA_OUTCLR,&PORTA_DIRSET,_BV(0)},	// Servo14 = PA0
+	{&PORTA_OUTSET,&PORTA_OUTCLR,&PORTA_DIRSET,_BV(1)},	// Servo15 = PA1
+#endif
+#if (NUM_SERVOS > 16)
+	{&PORTF_OUTSET,&PORTF_OUTCLR,&PORTF_DIRSET,_BV(0)},	// Servo16 = PF0
+	{&PORTF_OUTSET,&PORTF_OUTCLR,&PORTF_DIRSET,_BV(1)},	// Servo17 = PF1
+	{&PORTF_OUTSET,&PORTF_OUTCLR,&PORTF_DIRSET,_BV(3)},	// Servo18 = PF3
+	{&PORTF_OUTSET,&PORTF_OUTCLR,&PORTF_DIRSET,_BV(4)},	// Servo19 = PF4
+	{&PORTE_OUTSET,&PORTE_OUTCLR,&PORTE_DIRSET,_BV(0)},	// Servo20 = PE0
+	{&PORTE_OUTSET,&PORTE_OUTCLR,&PORTE_DIRSET,_BV(1)},	// Servo21 = PE1
+	{&PORTE_OUTSET,&PORTE_OUTCLR,&PORTE_DIRSET,_BV(2)},	// Servo22 = PE2
+	{&PORTE_OUTSET,&PORTE_OUTCLR,&PORTE_DIRSET,_BV(3)},	// Servo23 = PE3
+#endif
 };
 
 /**********************************************************************
-* Edge array for servo output pulses.  Defines the rising and falling
-* edges for each pulse.
+* Edge arrays for servo output pulses.  Define the rising and falling
+* edges for each pulse.  Edges on the same port at the same time are
+* coalesced, so there are at most 2 * NUM_SERVOS edges.  The last edge
+* of a frame has a nextEdge of 0.
 *
-* Also define a global for the current index into the array.
+* There are two edge arrays.  The ISR outputs the active array, while
+* the main loop builds the next frame in the other one.  When the next
+* frame is ready, the main loop sets the pending index, and the ISR
+* switches to the pending array after the last edge of the frame.
+*
+* The TCA0 compare values for the servos with hardware pulses
+* (HW_PULSE_OFFLOAD) go with each edge array, and the ISR loads them
+* into the compare buffer registers when it switches arrays, so they
+* change on the same frame as the other servos.  HwPulseServos gives the
+* servo on each TCA0 output pin, found in ServoPinDefs at init.
+*
+* Also define a global for the count of frames output.  The ISR's
+* cursor into the active array is kept in timer.c.
+**********************************************************************/
+EdgeDef_t ServoPulseEdges[2][2 * NUM_SERVOS];
+uint8_t HwPulseServos[NUM_HW_PULSES];
+uint16_t HwPulseCompare[2][NUM_HW_PULSES];
+volatile uint8_t EdgeBufferActive;
+volatile uint8_t EdgeBufferPending = EDGE_BUFFER_NONE;
+volatile uint8_t FrameCount;
+
+/**********************************************************************
+* Edge timing statistics, updated by the edge ISR when
+* EDGE_TIMING_STATS is set.  Each edge slot records the minimum and
+* maximum lateness and a histogram of lateness.  The counters record
+* edges that were stacked behind another interrupt, and edges whose
+* time had already passed when the compare register was written (these
+* are output one timer period late).
 **********************************************************************/
-EdgeDef_t ServoPulseEdges[2 * NUM_SERVOS];
-uint8_t EdgeIndex;
+#if (EDGE_TIMING_STATS)
+EdgeTiming_t EdgeTiming[2 * NUM_SERVOS];
+uint16_t EdgeStackedCount;
+uint16_t EdgeMissedCount;
+#endif
+
+/**********************************************************************
+* Frame build statistics, updated by servo_pulse_update().  Only the
+* groups whose pulse widths changed are rebuilt, and a frame where
+* nothing changed is not rebuilt at all, so GroupRebuildCount divided
+* by FrameTotalCount is the average number of groups rebuilt per frame.
+**********************************************************************/
+uint16_t FrameTotalCount;
+uint16_t FrameBuildCount;
+uint16_t GroupRebuildCount;
 
 /**********************************************************************
 * Pulse array for servo output pulses.  Defines the current and
@@ -55,6 +118,18 @@ uint8_t EdgeIndex;
 **********************************************************************/
 PulseDef_t ServoPulseDefs[NUM_SERVOS];
 
+/**********************************************************************
+* Acceleration settings for each servo, set by the AA, AD and AS
+* commands.  All 0 (no acceleration limit) at reset.
+**********************************************************************/
+ServoAccel_t ServoAccelDefs[NUM_SERVOS];
+
+/**********************************************************************
+* Closed-loop position control for each servo, set by the CL, CPL, CPH,
+* KP, KI and KD commands.  Off and not calibrated at reset.
+**********************************************************************/
+ServoControl_t ServoControlDefs[NUM_SERVOS];
+
 /**********************************************************************
 * Array of commanded servo moves, indexed by servo number.  Each
 * contains a flag indicating whether the servo is part of the
@@ -67,11 +142,43 @@ ServoCmdMoveTime_t ServoCmdMoveTime;
 // A flag indicating whether there is a command waiting to be
 // processed.
 bool ServoCmdWaiting;
+// A flag indicating that the command being parsed should wait until
+// the previous move is done ("SEQ").
+bool ServoCmdSequenced;
+
+/**********************************************************************
+* Queue of parsed commands waiting to be executed.  Complete commands
+* are moved from ServoCmdArray to the tail of the queue, and taken from
+* the head either right away or, for sequenced commands, when the move
+* in progress is done.
+**********************************************************************/
+ServoCmdEntry_t ServoCmdQueue[CMD_QUEUE_DEPTH];
+// Index of the oldest command in the queue
+uint8_t ServoCmdQueueHead;
+// Number of commands in the queue
+uint8_t ServoCmdQueueCount;
+
+
+/**********************************************************************
+* Serial RX statistics, updated by the RX ISR.  Bytes dropped because
+* the RX queue was full, bytes lost in the USART receive buffer (the
+* RX ISR was held off for too long), and the most bytes seen waiting in
+* the RX queue.
+**********************************************************************/
+uint16_t UartRxOverflowCount;
+uint16_t UartRxHwOverflowCount;
+uint8_t UartRxMaxFill;
+// Count of replies dropped because there was no space for them in the
+// TX queue.
+uint16_t UartTxDropCount;
 
+// Count of binary command frames dropped because of a bad length, CRC
+// or opcode.
+uint16_t BinaryFrameErrorCount;
 
 /**********************************************************************
-* Counter of 20ms loops.  Incremented after all edges for a loop 
-* are output.
+* Counter of frames (SERVO_PULSE_PERIOD_MS loops).  Incremented after
+* all edges for a loop are output.
 **********************************************************************/
 uint64_t LoopCount;
 
@@ -16,6 +16,7 @@
 #include "../Include/servo_calculations.h"
 #include "../Include/adc.h"
 #include "../Include/servo_current.h"
+#include "../Include/servo_control.h"
 #include "../Include/unit_test.h"
 
 
@@ -27,13 +28,16 @@ int main(void)
 	// Init the clock to EXTCLK, no prescaler
 	//	_PROTECTED_WRITE(CLKCTRL_MCLKCTRLA, CLKCTRL_CLKSEL_EXTCLK_gc);
 	//	_PROTECTED_WRITE(CLKCTRL_MCLKCTRLB, 0);
-	// For testing, use internal clock set to 8MHz (note that the FREQSEL fuse must be set to 16MHz)
+	// For testing, use internal clock set to 8MHz (note that the FREQSEL fuse must be set to 16MHz).
+	// F_CPU in globals.h must match.
 	_PROTECTED_WRITE(CLKCTRL_MCLKCTRLA, CLKCTRL_CLKSEL_OSC20M_gc);
 	_PROTECTED_WRITE(CLKCTRL_MCLKCTRLB, CLKCTRL_PDIV_2X_gc | CLKCTRL_PEN_bm);
 	
 	// Init libraries
 	uart_init();
 	adc_init();
+	servo_current_init();
+	servo_control_init();
 	// The following init functions must be called in the correct order
 	// so that the servo outputs will be initialized to the correct
 	// states (OFF = '0').
@@ -63,7 +67,7 @@ int main(void)
 		#endif
 		// Call periodic update functions
 		uart_update();
-		adc_update();
+		servo_current_update();
 		parse_commands_update();
 		servo_calculations_update();
 		servo_pulse_update();
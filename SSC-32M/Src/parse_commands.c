@@ -6,38 +6,93 @@
  */ 
 
 #include <avr/io.h>
-#include <stdlib.h>
-#include <string.h>
+#include <stddef.h>
 #include <stdbool.h>
-#include <ctype.h>
 
 #include "../Include/globals.h"
 #include "../Include/uart.h"
 #include "../Include/adc.h"
+#include "../Include/servo_current.h"
+#include "../Include/servo_control.h"
+#include "../Include/timer.h"
+#include "../Include/servo_pulse.h"
+#include "../Include/parse_commands.h"
 
-// Maximum token length.  Must be long enough to hold the longest
-// command, as well as the longest argument (65535).
-#define MAX_TOKEN_NBYTES 6
-	
 // Character type defines
 #define CHAR_TYPE_WHITESPACE	0
 #define CHAR_TYPE_DIGIT			1
 #define CHAR_TYPE_ALPHAPUNC		2
 
+// Binary frame decoder states
+#define BIN_STATE_IDLE		0	// Not in a frame, bytes are ASCII
+#define BIN_STATE_LENGTH	1	// Sync received, waiting for the length
+#define BIN_STATE_BODY		2	// Receiving the opcode and payload
+#define BIN_STATE_CRC		3	// Waiting for the CRC
+
+// Telemetry.  The largest frame, and the TX queue space left free for
+// command replies when a frame is sent.  Only servos with a position
+// input have a voltage in the frame.  uart_tx_free() is at most 255.
+#define TELEMETRY_MAX_NBYTES (6 + (3 * (UART_TX_UINT16_NBYTES + 1)) + NUM_SERVOS + \
+	(NUM_POSITION_INPUTS * (UART_TX_UINT16_NBYTES + 1)) + 1)
+#define TELEMETRY_TX_RESERVE 64
+#if ((TELEMETRY_MAX_NBYTES + TELEMETRY_TX_RESERVE) > 255)
+#error "A telemetry frame does not fit in the TX queue"
+#endif
+
+// Telemetry servo mask, bit N = servo N, sized for NUM_SERVOS.  All
+// the servos with a position input.
+#if (NUM_SERVOS <= 16)
+typedef uint16_t TelemetryMask_t;
+#elif (NUM_SERVOS <= 32)
+typedef uint32_t TelemetryMask_t;
+#else
+#error "The telemetry servo mask holds at most 32 servos"
+#endif
+#define TELEMETRY_ALL_SERVOS ((TelemetryMask_t)((1ULL << NUM_POSITION_INPUTS) - 1))
+
 // Prototpyes for the individual parsing functions
-static void parseAlpha(uint8_t * token);
-static void parseNumber(uint8_t * token);
+static void parseAlpha(uint8_t node);
+static void parseNumber(uint16_t arg);
+static void parseBinary(uint8_t ch);
+static void parseBinaryMove(void);
+static void parseBinaryQuery(void);
+static uint8_t servoStatus(uint8_t servo);
+static uint16_t positionMillivolts(const uint16_t * adcResults, uint8_t servo);
+static void sendTelemetry(void);
 
 static void ParseServoNum(uint16_t argument);
+static void ParseAccel(uint16_t argument);
+static void ParseDecel(uint16_t argument);
+static void ParseAccelShape(uint16_t argument);
+static void ParseBaud(uint16_t argument);
+static void ParseFlowControl(uint16_t argument);
+static void ParseClearJitter(uint16_t argument);
+static void ParseClosedLoop(uint16_t argument);
+static void ParseCalHigh(uint16_t argument);
+static void ParseCalLow(uint16_t argument);
 static void ParseServoHold(uint16_t argument);
+static void ParseGainD(uint16_t argument);
+static void ParseGainI(uint16_t argument);
+static void ParseGainP(uint16_t argument);
 static void ParseServoLimp(uint16_t argument);
 static void ParseServoPW(uint16_t argument);
 static void ParseQCurrent(uint16_t argument);
+static void ParseQFree(uint16_t argument);
+static void ParseQBuild(uint16_t argument);
+#if (EDGE_TIMING_STATS)
+static void ParseQJitter(uint16_t argument);
+#endif
 static void ParseQPos(uint16_t argument);
+static void ParseQPosRange(uint16_t argument);
+static void ParseQUart(uint16_t argument);
 static void ParseQStatus(uint16_t argument);
+static void ParseQStatusRange(uint16_t argument);
 static void ParseQVoltage(uint16_t argument);
 static void ParseServoSpeed(uint16_t argument);
+static void ParseSequence(uint16_t argument);
 static void ParseMoveTime(uint16_t argument);
+static void ParseTelemetryChannels(uint16_t argument);
+static void ParseTelemetry(uint16_t argument);
 static void ParseVer(uint16_t argument);
 
 // Structure for command parsing
@@ -54,19 +109,98 @@ typedef struct ParseTable_s ParseTable_t;
 static const ParseTable_t ParseTable[] =
 {
 	{"#", ParseServoNum, true},		// Set servo number
+	{"AA", ParseAccel, true},		// Set servo acceleration in 10 us/sec^2, 0 = no limit
+	{"AD", ParseDecel, true},		// Set servo deceleration in 10 us/sec^2, 0 = no limit
+	{"AS", ParseAccelShape, true},	// Set servo acceleration shape, 0 = trapezoid, 1 = S-curve
+	{"CB", ParseBaud, true},		// Change baud rate to argument * 100, see ParseBaud()
+	{"CF", ParseFlowControl, true},	// Set flow control, 0 = none, 1 = RTS pin, 2 = XON/XOFF
+	{"CJ", ParseClearJitter, false},	// Clear edge timing (jitter), frame build and serial statistics
+	{"CL", ParseClosedLoop, true},	// Set closed-loop position control, 0 = off, 1 = on
+	{"CPH", ParseCalHigh, true},	// Calibrate the high feedback point, the servo is at the argument pulse width
+	{"CPL", ParseCalLow, true},		// Calibrate the low feedback point, the servo is at the argument pulse width
 	{"H", ParseServoHold, false},	// Hold servo position
+	{"KD", ParseGainD, true},		// Set closed-loop derivative gain, 256 = 1
+	{"KI", ParseGainI, true},		// Set closed-loop integral gain, 256 = 1
+	{"KP", ParseGainP, true},		// Set closed-loop proportional gain, 256 = 1
 	{"L", ParseServoLimp, false},	// Turn off pulses for a servo, i.e. set output to logic '0'
 	{"P", ParseServoPW, true},		// Set the Pulse Width in microseconds
 	{"Q", ParseQStatus, false},		// Return servo status as an integer 0-10
+	{"QB", ParseQBuild, false},		// Returns frame build statistics
 	{"QC", ParseQCurrent, false},	// Returns servo current in milliamps
+	{"QF", ParseQFree, false},		// Returns number of free command queue slots
+#if (EDGE_TIMING_STATS)
+	{"QJ", ParseQJitter, false},	// Returns edge timing (jitter) statistics in microseconds
+#else
+	{"QJ", NULL, false},			// Not built, the entry keeps the trie the same
+#endif
 	{"QP", ParseQPos, false},		// Returns feedback voltage in millivolts
+	{"QPR", ParseQPosRange, true},	// Returns feedback voltages from this servo to the argument servo
+	{"QSR", ParseQStatusRange, true},	// Returns status and feedback voltage from this servo to the argument servo
+	{"QU", ParseQUart, false},		// Returns serial RX error counts
 	{"QV", ParseQVoltage, false},	// Returns battery voltage in millivolts
 	{"S", ParseServoSpeed, true},	// Set servo speed in us/sec
+	{"SEQ", ParseSequence, false},	// Start this command when the previous move is done
 	{"T", ParseMoveTime, true},		// Set total move time in ms
+	{"TLC", ParseTelemetryChannels, true},	// Set the servos in telemetry frames, bit N = servo #+N
+	{"TLM", ParseTelemetry, true},	// Send a telemetry frame every argument frames, 0 = off
 	{"VER", ParseVer, false},		// Return firmware version
 	{NULL, NULL},	// Sentinel must be last entry in table
 };
 
+// Command trie, generated from ParseTable by the host bench, which
+// fails and prints the new trie if it no longer matches the table (see
+// bench_trie_check()).  There is one node for each distinct prefix of
+// the commands, and node 0 is the root.  On the ATmega4809 const data
+// stays in flash and is read through the data space, so the trie takes
+// no SRAM.
+static const TrieNode_t parseTrie[] =
+{
+	{{0x0B, 0x19, 0x5B, 0x00}, 1, PARSE_TRIE_NONE},	// Root
+	{{0x00, 0x00, 0x00, 0x00}, 0, 0},	// #
+	{{0x12, 0x00, 0x08, 0x00}, 12, PARSE_TRIE_NONE},	// A
+	{{0x44, 0x14, 0x01, 0x00}, 15, PARSE_TRIE_NONE},	// C
+	{{0x00, 0x00, 0x00, 0x00}, 0, 10},	// H
+	{{0x10, 0x02, 0x01, 0x00}, 22, PARSE_TRIE_NONE},	// K
+	{{0x00, 0x00, 0x00, 0x00}, 0, 14},	// L
+	{{0x00, 0x00, 0x00, 0x00}, 0, 15},	// P
+	{{0x4C, 0x04, 0x69, 0x00}, 25, 16},	// Q
+	{{0x20, 0x00, 0x00, 0x00}, 35, 26},	// S
+	{{0x00, 0x10, 0x00, 0x00}, 37, 28},	// T
+	{{0x20, 0x00, 0x00, 0x00}, 40, PARSE_TRIE_NONE},	// V
+	{{0x00, 0x00, 0x00, 0x00}, 0, 1},	// AA
+	{{0x00, 0x00, 0x00, 0x00}, 0, 2},	// AD
+	{{0x00, 0x00, 0x00, 0x00}, 0, 3},	// AS
+	{{0x00, 0x00, 0x00, 0x00}, 0, 4},	// CB
+	{{0x00, 0x00, 0x00, 0x00}, 0, 5},	// CF
+	{{0x00, 0x00, 0x00, 0x00}, 0, 6},	// CJ
+	{{0x00, 0x00, 0x00, 0x00}, 0, 7},	// CL
+	{{0x00, 0x11, 0x00, 0x00}, 20, PARSE_TRIE_NONE},	// CP
+	{{0x00, 0x00, 0x00, 0x00}, 0, 8},	// CPH
+	{{0x00, 0x00, 0x00, 0x00}, 0, 9},	// CPL
+	{{0x00, 0x00, 0x00, 0x00}, 0, 11},	// KD
+	{{0x00, 0x00, 0x00, 0x00}, 0, 12},	// KI
+	{{0x00, 0x00, 0x00, 0x00}, 0, 13},	// KP
+	{{0x00, 0x00, 0x00, 0x00}, 0, 17},	// QB
+	{{0x00, 0x00, 0x00, 0x00}, 0, 18},	// QC
+	{{0x00, 0x00, 0x00, 0x00}, 0, 19},	// QF
+	{{0x00, 0x00, 0x00, 0x00}, 0, 20},	// QJ
+	{{0x00, 0x00, 0x04, 0x00}, 33, 21},	// QP
+	{{0x00, 0x00, 0x04, 0x00}, 34, PARSE_TRIE_NONE},	// QS
+	{{0x00, 0x00, 0x00, 0x00}, 0, 24},	// QU
+	{{0x00, 0x00, 0x00, 0x00}, 0, 25},	// QV
+	{{0x00, 0x00, 0x00, 0x00}, 0, 22},	// QPR
+	{{0x00, 0x00, 0x00, 0x00}, 0, 23},	// QSR
+	{{0x00, 0x00, 0x02, 0x00}, 36, PARSE_TRIE_NONE},	// SE
+	{{0x00, 0x00, 0x00, 0x00}, 0, 27},	// SEQ
+	{{0x08, 0x20, 0x00, 0x00}, 38, PARSE_TRIE_NONE},	// TL
+	{{0x00, 0x00, 0x00, 0x00}, 0, 29},	// TLC
+	{{0x00, 0x00, 0x00, 0x00}, 0, 30},	// TLM
+	{{0x00, 0x00, 0x04, 0x00}, 41, PARSE_TRIE_NONE},	// VE
+	{{0x00, 0x00, 0x00, 0x00}, 0, 31},	// VER
+};
+_Static_assert((sizeof(parseTrie) / sizeof(parseTrie[0])) < PARSE_TRIE_NONE,
+	"Trie node indexes are 8 bits");
+
 // Pointer to function for parsed command
 static void (* pCmdFunc)(uint16_t);
 // Flag indicating whether the current function requires an argument
@@ -74,6 +208,89 @@ static bool argumentRequired;
 // Servo number specified with '#'
 static uint8_t servoNum = 255;	// Default to invalid servo number
 
+// Binary frame decoder state, number of opcode and payload bytes in the
+// frame, index of the next byte, running CRC, and the opcode and payload
+static uint8_t binState = BIN_STATE_IDLE;
+static uint8_t binNBytes;
+static uint8_t binIdx;
+static uint8_t binCrc;
+static uint8_t binBuf[1 + BIN_MAX_PAYLOAD_NBYTES];
+
+// Flags indicating that the first byte of the current alpha token, or
+// of the current binary frame, was received after the last baud rate
+// change, so the command may confirm the change
+static bool alphaNewRate;
+static bool binNewRate;
+
+// Telemetry period in frames (0 = off), servos whose feedback is sent,
+// and low 16 bits of LoopCount when the last frame was sent
+static uint16_t telemetryPeriod;
+static TelemetryMask_t telemetryServos;
+static uint16_t telemetryLoop;
+
+/**********************************************************************
+* Return the trie symbol for a command character: '#' = 0, 'A' to 'Z'
+* = 1 to 26, in the same order as the characters, or PARSE_TRIE_NONE
+* if the character is not used in commands.
+**********************************************************************/
+static uint8_t trieSymbol(uint8_t ch)
+{
+	if (ch == '#')
+	{
+		return 0;
+	}
+	ch -= 'A' - 1;
+	return ((uint8_t)(ch - 1) < 26) ? ch : PARSE_TRIE_NONE;
+}
+
+/**********************************************************************
+* Return the trie node reached from a node by a character, or
+* PARSE_TRIE_NONE.  Takes the same time for any table size.
+**********************************************************************/
+static uint8_t trieStep(uint8_t node, uint8_t ch)
+{
+	// Number of set bits in each value of a 4 bit nibble
+	static const uint8_t nibbleBits[16] = {0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
+
+	uint8_t symbol = trieSymbol(ch);
+	if ((node == PARSE_TRIE_NONE) || (symbol == PARSE_TRIE_NONE))
+	{
+		return PARSE_TRIE_NONE;
+	}
+	const TrieNode_t *trieNode = &parseTrie[node];
+	uint8_t byteIdx = symbol >> 3;
+	uint8_t bit = 1 << (symbol & 7);
+	if (!(trieNode->symbols[byteIdx] & bit))
+	{
+		return PARSE_TRIE_NONE;
+	}
+	// Count the children for lower symbols
+	uint8_t lower = trieNode->symbols[byteIdx] & (bit - 1);
+	uint8_t child = trieNode->firstChild + nibbleBits[lower & 0x0F] + nibbleBits[lower >> 4];
+	for (uint8_t i = 0; i < byteIdx; ++i)
+	{
+		child += nibbleBits[trieNode->symbols[i] & 0x0F] + nibbleBits[trieNode->symbols[i] >> 4];
+	}
+	return child;
+}
+
+#if (PARSE_TRIE_CHECK)
+/**********************************************************************
+* Host build only: the command string at a ParseTable index (NULL at the
+* sentinel), and the command trie, for the bench to check the trie.
+**********************************************************************/
+const char * parse_commands_string(uint8_t cmdIdx)
+{
+	return ParseTable[cmdIdx].pCmdstr;
+}
+
+const TrieNode_t * parse_commands_trie(uint8_t * nNodes)
+{
+	*nNodes = sizeof(parseTrie) / sizeof(parseTrie[0]);
+	return parseTrie;
+}
+#endif
+
 /**********************************************************************
 * Initialize the ServoCmdArray and related global data.
 **********************************************************************/
@@ -86,8 +303,20 @@ void parse_commands_init(void)
 		ServoCmdArray[servoNum].isCommanded = true;
 		ServoCmdArray[servoNum].targetPW = 0;
 		ServoCmdArray[servoNum].targetSpeed = 0;
+		// No acceleration limit
+		ServoAccelDefs[servoNum].accel = 0;
+		ServoAccelDefs[servoNum].decel = 0;
+		ServoAccelDefs[servoNum].sCurve = false;
 	}
 	ServoCmdMoveTime = 0;
+	ServoCmdSequenced = false;
+	// Empty the command queue
+	ServoCmdQueueHead = 0;
+	ServoCmdQueueCount = 0;
+	binState = BIN_STATE_IDLE;
+	// No telemetry until requested
+	telemetryPeriod = 0;
+	telemetryServos = TELEMETRY_ALL_SERVOS;
 	ServoCmdWaiting = true;		// Trigger calculations
 }
 
@@ -100,62 +329,80 @@ void parse_commands_init(void)
 void parse_commands_update(void)
 {
 	static uint8_t prevCharType = CHAR_TYPE_WHITESPACE;
-	static uint8_t tokenIdx = 0;	// Index of next character to be added to the token
-	static uint8_t token[MAX_TOKEN_NBYTES + 1];	// 1 extra for ASCIIZ zero byte
+	static uint8_t trieNode;	// Trie node for the alpha token so far
+	static uint16_t number;		// Value of the number token so far
 	uint8_t charType;	// Space, digit, or alpha/punctuation
 
 	// Loop until no characters in the RX queue or a complete command
-	// is parsed.  Read bytes from the serial port and collect into a "token".
-	// When a token is complete, then look it up and call the handler.
+	// is parsed.  Read bytes from the serial port and follow them through
+	// the command trie (alpha) or add them to the value (digits).  When a
+	// token is complete, call the handler.  The work per byte does not
+	// depend on the number of commands.
 	while (!ServoCmdWaiting)
 	{
 		uint8_t ch;
 		bool charReturned = uart_rx_get_char(&ch);
 		if (!charReturned) break;	// Nothing in queue? Quit loop
 		
+		// Binary frames start with a sync byte, which is never part of an
+		// ASCII command.  A partial ASCII token before the frame is dropped.
+		if ((binState != BIN_STATE_IDLE) || (ch == BIN_FRAME_SYNC))
+		{
+			prevCharType = CHAR_TYPE_WHITESPACE;
+			parseBinary(ch);
+			continue;
+		}
+
 		// At this point, we have a character from the queue.
-		// Determine which type of character it is.
-		if (isspace(ch))
+		// Determine which type of character it is.  Same as isspace(),
+		// isdigit() and toupper(), without the library calls.
+		if ((ch == ' ') || ((uint8_t)(ch - '\t') <= ('\r' - '\t')))
 		{
 			charType = CHAR_TYPE_WHITESPACE;
 		}
-		else if (isdigit(ch))
+		else if ((uint8_t)(ch - '0') <= 9)
 		{
 			charType = CHAR_TYPE_DIGIT;
 		}
 		else
 		{
 			charType = CHAR_TYPE_ALPHAPUNC;
-			ch = toupper(ch);
+			if ((uint8_t)(ch - 'a') <= ('z' - 'a'))
+			{
+				ch -= 'a' - 'A';
+			}
 		}
 		
 		// Is it the same character type as the last character?
 		if (charType != prevCharType)
 		{
-			// Add zero to end of token for ASCIIZ string
-			token[tokenIdx] = 0;
 			// Change in character type.  Process token.
 			switch (prevCharType)
 			{
 				case CHAR_TYPE_ALPHAPUNC:
 					// Token is alpha or punctuation
-					parseAlpha(token);
+					parseAlpha(trieNode);
 					break;
 				case CHAR_TYPE_DIGIT:
 					// Token is a number
-					parseNumber(token);
+					parseNumber(number);
 					break;
 				// Otherwise must be white space; do nothing
 			}
-			tokenIdx = 0;	// Start new token
+			trieNode = 0;	// Start new token
+			number = 0;
 			prevCharType = charType;
+			alphaNewRate = uart_rx_new_rate();
 		}
 
-		// If not whitespace and there is space, then add to token
-		if ((charType != CHAR_TYPE_WHITESPACE) && (tokenIdx < MAX_TOKEN_NBYTES))
+		// Add to the token
+		if (charType == CHAR_TYPE_DIGIT)
+		{
+			number = (number * 10) + (ch - '0');
+		}
+		else if (charType == CHAR_TYPE_ALPHAPUNC)
 		{
-			token[tokenIdx] = ch;
-			++tokenIdx;
+			trieNode = trieStep(trieNode, ch);
 		}
 		
 		// Special handling for carriage return.
@@ -171,43 +418,405 @@ void parse_commands_update(void)
 			argumentRequired = false;
 		}
 	}	
+
+	// Send a telemetry frame if one is due
+	if ((telemetryPeriod != 0) && ((uint16_t)((uint16_t)LoopCount - telemetryLoop) >= telemetryPeriod))
+	{
+		sendTelemetry();
+	}
 }
 
-static void parseAlpha(uint8_t * token)
+static void parseAlpha(uint8_t node)
 {
-	// Search the table for the token.  Linear search for now, since
-	// the table is small.
-	for (uint8_t i = 0; ParseTable[i].pCmdstr != NULL; ++i)
+	// The token is a command if it ended on a trie node for a command
+	// that is built
+	if ((node == PARSE_TRIE_NONE) || (parseTrie[node].cmdIdx == PARSE_TRIE_NONE))
 	{
-		if (strcmp((const char *)ParseTable[i].pCmdstr,(const char *)token) == 0)
-		{
-			// If token found, then save the function for later use.
-			// Also save the flag indicating whether an argument is required.
-			pCmdFunc = ParseTable[i].pFunction;
-			argumentRequired = ParseTable[i].argumentRequired;
-			// If no argument is required, then call the function now.
-			if (!ParseTable[i].argumentRequired)
+		return;
+	}
+	const ParseTable_t *entry = &ParseTable[parseTrie[node].cmdIdx];
+	if (entry->pFunction == NULL)
+	{
+		return;
+	}
+	// A recognized command confirms a baud rate change, if it was sent
+	// at the new rate.  Bytes still queued from before the change, such
+	// as a command sent right after "CB", do not.
+	if (alphaNewRate)
+	{
+		uart_baud_confirm();
+	}
+	// Save the function for later use.  Also save the flag indicating
+	// whether an argument is required.
+	pCmdFunc = entry->pFunction;
+	argumentRequired = entry->argumentRequired;
+	// If no argument is required, then call the function now.
+	if (!entry->argumentRequired)
+	{
+		pCmdFunc(0);	// Dummy argument
+	}
+}
+
+/**********************************************************************
+* Update a CRC-8 (polynomial 0x07) with one byte.
+**********************************************************************/
+static uint8_t crc8Update(uint8_t crc, uint8_t data)
+{
+	crc ^= data;
+	for (uint8_t i = 0; i < 8; ++i)
+	{
+		crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+	}
+	return crc;
+}
+
+/**********************************************************************
+* Binary frame decoder.  Called with each byte of a frame, starting
+* with the sync byte.  When a complete frame with a good CRC has been
+* received, the command is decoded.
+**********************************************************************/
+static void parseBinary(uint8_t ch)
+{
+	switch (binState)
+	{
+		case BIN_STATE_IDLE:
+			// Sync byte
+			binState = BIN_STATE_LENGTH;
+			binNewRate = uart_rx_new_rate();
+			break;
+		case BIN_STATE_LENGTH:
+			if (ch > BIN_MAX_PAYLOAD_NBYTES)
+			{
+				// Too long for any command, so not a frame
+				++BinaryFrameErrorCount;
+				binState = BIN_STATE_IDLE;
+				break;
+			}
+			binNBytes = ch + 1;		// Opcode and payload
+			binIdx = 0;
+			binCrc = crc8Update(0, ch);
+			binState = BIN_STATE_BODY;
+			break;
+		case BIN_STATE_BODY:
+			binBuf[binIdx] = ch;
+			++binIdx;
+			binCrc = crc8Update(binCrc, ch);
+			if (binIdx >= binNBytes)
 			{
-				pCmdFunc(0);	// Dummy argument
+				binState = BIN_STATE_CRC;
 			}
-			break;	// No need to continue search
+			break;
+		default:
+			binState = BIN_STATE_IDLE;
+			if (ch != binCrc)
+			{
+				++BinaryFrameErrorCount;
+			}
+			else if (binBuf[0] == BIN_OP_MOVE)
+			{
+				parseBinaryMove();
+			}
+			else if (binBuf[0] == BIN_OP_QUERY)
+			{
+				parseBinaryQuery();
+			}
+			else
+			{
+				++BinaryFrameErrorCount;
+			}
+			break;
+	}
+}
+
+/**********************************************************************
+* Decode a BIN_OP_MOVE frame into ServoCmdArray, the same as an ASCII
+* move command line.
+**********************************************************************/
+static void parseBinaryMove(void)
+{
+	const uint8_t * payload = &binBuf[1];
+	const uint8_t * mask = &payload[3];
+	uint8_t flags = payload[0];
+
+	// Check the length against the number of servos in the mask
+	uint8_t nServos = 0;
+	for (uint8_t i = 0; i < BIN_MASK_NBYTES; ++i)
+	{
+		for (uint8_t bits = mask[i]; bits != 0; bits &= bits - 1)
+		{
+			++nServos;
+		}
+	}
+	uint8_t nBytes = 3 + BIN_MASK_NBYTES + (2 * nServos);
+	if (flags & BIN_MOVE_SPEED)
+	{
+		nBytes += 2 * nServos;
+	}
+	if (nBytes != (binNBytes - 1))
+	{
+		++BinaryFrameErrorCount;
+		return;
+	}
+
+	// Pulse widths, then speeds, in servo order
+	const uint8_t * pw = &mask[BIN_MASK_NBYTES];
+	const uint8_t * speed = &pw[2 * nServos];
+	for (uint8_t servo = 0; servo < NUM_SERVOS; ++servo)
+	{
+		if (!(mask[servo >> 3] & (1 << (servo & 7))))
+			continue;
+		uint16_t argument = pw[0] | ((uint16_t)pw[1] << 8);
+		pw += 2;
+		if ((argument == 0) || ((argument >= MINIMUM_PW) && (argument <= MAXIMUM_PW)))
+		{
+			ServoCmdArray[servo].isCommanded = true;
+			ServoCmdArray[servo].targetPW = argument;
+		}
+		if (flags & BIN_MOVE_SPEED)
+		{
+			ServoCmdArray[servo].targetSpeed = speed[0] | ((uint16_t)speed[1] << 8);
+			speed += 2;
+		}
+	}
+	ServoCmdMoveTime = payload[1] | ((uint16_t)payload[2] << 8);
+	ServoCmdSequenced = (flags & BIN_MOVE_SEQ) != 0;
+
+	// The frame is a complete command, as for a carriage return
+	if (binNewRate)
+	{
+		uart_baud_confirm();
+	}
+	ServoCmdWaiting = true;
+	pCmdFunc = NULL;
+	servoNum = 255;			// Invalid servo number
+	argumentRequired = false;
+}
+
+/**********************************************************************
+* Decode a BIN_OP_QUERY frame and reply with a BIN_OP_QUERY frame
+* holding the feedback voltages (and status) of the servos in the mask.
+* The positions all come from the same ADC scan.
+**********************************************************************/
+static void parseBinaryQuery(void)
+{
+	const uint8_t * payload = &binBuf[1];
+	const uint8_t * mask = &payload[1];
+	uint8_t flags = payload[0];
+	uint16_t adcResults[NUM_ADC_CHANNELS];
+
+	if ((binNBytes - 1) != (1 + BIN_MASK_NBYTES))
+	{
+		++BinaryFrameErrorCount;
+		return;
+	}
+
+	// Reply length, from the number of servos in the mask.  Mask bits
+	// above the last servo are ignored.
+	uint8_t nServos = 0;
+	for (uint8_t servo = 0; servo < NUM_SERVOS; ++servo)
+	{
+		if (mask[servo >> 3] & (1 << (servo & 7)))
+		{
+			++nServos;
+		}
+	}
+	uint8_t nBytes = 1 + BIN_MASK_NBYTES + (((flags & BIN_QUERY_STATUS) ? 3 : 2) * nServos);
+	if (!uart_tx_begin(4 + nBytes))
+		return;
+	adc_snapshot(adcResults);
+
+	// The frame is built directly in the TX queue, with the CRC
+	// computed as it goes
+	uart_tx_put(BIN_FRAME_SYNC);
+	uart_tx_put(nBytes);
+	uint8_t crc = crc8Update(0, nBytes);
+	uart_tx_put(BIN_OP_QUERY);
+	crc = crc8Update(crc, BIN_OP_QUERY);
+	uart_tx_put(flags);
+	crc = crc8Update(crc, flags);
+	for (uint8_t i = 0; i < BIN_MASK_NBYTES; ++i)
+	{
+		uint8_t maskByte = (i == (BIN_MASK_NBYTES - 1)) ? (mask[i] & BIN_MASK_LAST_gm) : mask[i];
+		uart_tx_put(maskByte);
+		crc = crc8Update(crc, maskByte);
+	}
+	for (uint8_t servo = 0; servo < NUM_SERVOS; ++servo)
+	{
+		if (!(mask[servo >> 3] & (1 << (servo & 7))))
+			continue;
+		uint16_t milliVolts = positionMillivolts(adcResults, servo);
+		uart_tx_put(milliVolts & 0xFF);
+		crc = crc8Update(crc, milliVolts & 0xFF);
+		uart_tx_put(milliVolts >> 8);
+		crc = crc8Update(crc, milliVolts >> 8);
+		if (flags & BIN_QUERY_STATUS)
+		{
+			uint8_t status = servoStatus(servo);
+			uart_tx_put(status);
+			crc = crc8Update(crc, status);
 		}
 	}
+	uart_tx_put(crc);
+	uart_tx_end();
 }
 
-static void parseNumber(uint8_t * token)
+/**********************************************************************
+* Send a telemetry frame:
+* "*TLM<frame> <ms remaining> <battery mV> <status>... <mV> <mV>...\r"
+* - frame: low 16 bits of LoopCount, so the host can see skipped frames
+* - ms remaining: MillisRemainingInCommand, up to 65535
+* - status: one digit for each servo, see servoStatus()
+* - mV: feedback voltage of each servo selected by "TLC", in servo order.
+*   Only servos with a position input (NUM_POSITION_INPUTS) can be
+*   selected.
+* The frame is only sent if it fits in the TX queue with
+* TELEMETRY_TX_RESERVE bytes to spare, so it only uses spare TX
+* bandwidth and never delays a command reply.  Otherwise it is sent on
+* a later pass, when there is space.
+**********************************************************************/
+static void sendTelemetry(void)
+{
+	uint16_t adcResults[NUM_ADC_CHANNELS];
+
+	if (uart_tx_free() < (TELEMETRY_MAX_NBYTES + TELEMETRY_TX_RESERVE))
+	{
+		return;
+	}
+	uint16_t loop = (uint16_t)LoopCount;
+	telemetryLoop = loop;
+	uart_tx_begin(TELEMETRY_MAX_NBYTES);
+	adc_snapshot(adcResults);
+	uart_tx_put('*');
+	uart_tx_put('T');
+	uart_tx_put('L');
+	uart_tx_put('M');
+	uart_tx_put_uint16(loop);
+	uart_tx_put(' ');
+	uart_tx_put_uint16((MillisRemainingInCommand > 0xFFFF) ? 0xFFFF : (uint16_t)MillisRemainingInCommand);
+	uart_tx_put(' ');
+	// The ADC channel for battery voltage is 12
+	uart_tx_put_uint16(adc_to_battery_millivolts(adcResults[12]));
+	uart_tx_put(' ');
+	for (uint8_t servo = 0; servo < NUM_SERVOS; ++servo)
+	{
+		uart_tx_put('0' + servoStatus(servo));
+	}
+	for (uint8_t servo = 0; servo < NUM_SERVOS; ++servo)
+	{
+		if (telemetryServos & ((TelemetryMask_t)1 << servo))
+		{
+			uart_tx_put(' ');
+			uart_tx_put_uint16(positionMillivolts(adcResults, servo));
+		}
+	}
+	// Write final carriage return
+	uart_tx_put('\r');
+	uart_tx_end();
+}
+
+static void parseNumber(uint16_t arg)
 {
-	// Convert the token to integer and pass to the parsing
-	// function for the command.
-	uint16_t arg = atoi((const char *)token);
 	// Call the function if valid and if an argument is required.
 	// (If an argument is not required, then the function was already called.)
+	// The argument is the value of the digits, modulo 65536.
 	if ((pCmdFunc != NULL) && argumentRequired)
 	{
 		pCmdFunc(arg);
 	}
 }
 
+/**********************************************************************
+* Write the servo (or edge) number for a reply, 1 or 2 digits, into the
+* TX space reserved with uart_tx_begin().
+**********************************************************************/
+static void putServoNum(void)
+{
+	if (servoNum >= 10)
+	{
+		uart_tx_put((servoNum / 10) + '0');	// Tens digit;
+	}
+	uart_tx_put((servoNum % 10) + '0');		// Ones digit;
+}
+
+/**********************************************************************
+* Return the status of a servo, one of:
+* - 1 = Limp (output to servo is logic '0')
+* - 4 = Traveling (moving at a stable speed)
+* - 6 = Holding (keeping current position)
+* These values are a subset of the status values supported by the LSS
+* protocol.
+**********************************************************************/
+static uint8_t servoStatus(uint8_t servo)
+{
+	if (ServoPulseDefs[servo].currentPW_l16 == 0)
+	{
+		// PW of 0 indicates no pulse (output constant '0')
+		return 1;
+	}
+	else if (ServoPulseDefs[servo].currentPW_l16 != ((uint32_t)ServoPulseDefs[servo].targetPW << 16))
+	{
+		// Current PW not equal to target PW indicates servo moving
+		return 4;
+	}
+	// Otherwise servo holding
+	return 6;
+}
+
+/**********************************************************************
+* Return the position feedback voltage of a servo in millivolts, from
+* an ADC snapshot.  The ADC channel number matches the servo number.
+* Servos with no position input (see NUM_POSITION_INPUTS) read 0.
+**********************************************************************/
+static uint16_t positionMillivolts(const uint16_t * adcResults, uint8_t servo)
+{
+	return (servo < NUM_POSITION_INPUTS) ? adc_to_millivolts(adcResults[servo]) : 0;
+}
+
+/**********************************************************************
+* Write the feedback voltages, and optionally the status, of the servos
+* from servoNum to lastServo, for "QPR" and "QSR":
+* "*<first>QPR<mV> <mV> ...\r" or "*<first>QSR<status>,<mV> ...\r".
+* The positions all come from the same ADC scan.
+**********************************************************************/
+static void putRange(uint16_t lastServo, bool withStatus)
+{
+	uint16_t adcResults[NUM_ADC_CHANNELS];
+
+	if (lastServo >= NUM_SERVOS)
+	{
+		lastServo = NUM_SERVOS - 1;
+	}
+	if ((servoNum >= NUM_SERVOS) || (lastServo < servoNum))
+	{
+		return;
+	}
+	uint8_t nServos = lastServo - servoNum + 1;
+	if (!uart_tx_begin(7 + (nServos * (UART_TX_UINT16_NBYTES + 3))))
+		return;
+	adc_snapshot(adcResults);
+	uart_tx_put('*');
+	putServoNum();
+	uart_tx_put('Q');
+	uart_tx_put(withStatus ? 'S' : 'P');
+	uart_tx_put('R');
+	for (uint8_t servo = servoNum; servo <= lastServo; ++servo)
+	{
+		if (servo != servoNum)
+		{
+			uart_tx_put(' ');
+		}
+		if (withStatus)
+		{
+			uart_tx_put('0' + servoStatus(servo));
+			uart_tx_put(',');
+		}
+		uart_tx_put_uint16(positionMillivolts(adcResults, servo));
+	}
+	// Write final carriage return
+	uart_tx_put('\r');
+	uart_tx_end();
+}
+
 /**********************************************************************
 * Parsing functions for the various commands.  The argument to these
 * functions is a pointer to an unsigned int.  Some functions do not
@@ -218,12 +827,130 @@ static void ParseServoNum(uint16_t argument)
 {
 	servoNum = argument;
 }
+static void ParseAccel(uint16_t argument)
+{
+	// The acceleration settings take effect on the next move, and are
+	// kept for later moves
+	if (servoNum < NUM_SERVOS)
+	{
+		ServoAccelDefs[servoNum].accel = argument;
+	}
+}
+static void ParseDecel(uint16_t argument)
+{
+	if (servoNum < NUM_SERVOS)
+	{
+		ServoAccelDefs[servoNum].decel = argument;
+	}
+}
+static void ParseAccelShape(uint16_t argument)
+{
+	if (servoNum < NUM_SERVOS)
+	{
+		ServoAccelDefs[servoNum].sCurve = (argument != 0);
+	}
+}
+static void ParseBaud(uint16_t argument)
+{
+	// Change the baud rate to argument * 100, e.g. "CB10000" for
+	// 1000000 baud.  Writes "*CB<argument>" at the old rate, then
+	// changes the rate, or writes "*CB0" if the rate is not possible.
+	// The host must then send a command at the new rate within
+	// UART_BAUD_CONFIRM_FRAMES frames, or the old rate is restored.
+	if (!uart_baud_request((uint32_t)argument * 100))
+	{
+		argument = 0;
+	}
+	if (!uart_tx_begin(4 + UART_TX_UINT16_NBYTES))
+		return;
+	uart_tx_put('*');
+	uart_tx_put('C');
+	uart_tx_put('B');
+	uart_tx_put_uint16(argument);
+	// Write final carriage return
+	uart_tx_put('\r');
+	uart_tx_end();
+}
+static void ParseFlowControl(uint16_t argument)
+{
+	// Writes "*CF<mode>", or "*CF255" if the mode is not valid
+	if (!uart_flow_control(argument))
+	{
+		argument = 255;
+	}
+	if (!uart_tx_begin(4 + UART_TX_UINT16_NBYTES))
+		return;
+	uart_tx_put('*');
+	uart_tx_put('C');
+	uart_tx_put('F');
+	uart_tx_put_uint16(argument);
+	// Write final carriage return
+	uart_tx_put('\r');
+	uart_tx_end();
+}
+static void ParseClearJitter(uint16_t argument)
+{
+#if (EDGE_TIMING_STATS)
+	timer_stats_clear();
+#endif
+	servo_pulse_stats_clear();
+	uart_stats_clear();
+}
+static void ParseClosedLoop(uint16_t argument)
+{
+	// Closed-loop control has no effect until the servo is calibrated
+	if (servoNum < NUM_SERVOS)
+	{
+		ServoControlDefs[servoNum].enabled = (argument != 0);
+	}
+}
+static void ParseCalHigh(uint16_t argument)
+{
+	// Record the feedback with the servo at the argument pulse width,
+	// e.g. "#0P2000", wait for the servo to stop, then "#0CPH2000"
+	if ((servoNum < NUM_SERVOS) && (argument >= MINIMUM_PW) && (argument <= MAXIMUM_PW))
+	{
+		servo_control_calibrate(servoNum, CONTROL_CAL_HIGH, argument);
+	}
+}
+static void ParseCalLow(uint16_t argument)
+{
+	if ((servoNum < NUM_SERVOS) && (argument >= MINIMUM_PW) && (argument <= MAXIMUM_PW))
+	{
+		servo_control_calibrate(servoNum, CONTROL_CAL_LOW, argument);
+	}
+}
 static void ParseServoHold(uint16_t argument)
 {
 	// Set current pulse width to target pulse width
 	if (servoNum < NUM_SERVOS)
 	{
 		ServoPulseDefs[servoNum].currentPW_l16 = (uint32_t)ServoPulseDefs[servoNum].targetPW << 16;
+		ServoPulseDefs[servoNum].deltaPW_l16 = 0;
+		ServoPulseDefs[servoNum].framesRemaining = 0;
+		ServoPulseDefs[servoNum].phase = PROFILE_NONE;
+		servo_pulse_changed(servoNum);
+	}
+}
+static void ParseGainD(uint16_t argument)
+{
+	if (servoNum < NUM_SERVOS)
+	{
+		ServoControlDefs[servoNum].kd = argument;
+	}
+}
+static void ParseGainI(uint16_t argument)
+{
+	if (servoNum < NUM_SERVOS)
+	{
+		ServoControlDefs[servoNum].ki = argument;
+	}
+}
+static void ParseGainP(uint16_t argument)
+{
+	if (servoNum < NUM_SERVOS)
+	{
+		ServoControlDefs[servoNum].kp = argument;
 	}
 }
 static void ParseServoLimp(uint16_t argument)
@@ -247,8 +974,109 @@ static void ParseServoPW(uint16_t argument)
 }
 static void ParseQCurrent(uint16_t argument)
 {
-	
+	// Return the latest current reading for a servo in milliamps,
+	// "*NQC<mA>", where N = servo number.  The readings are refreshed
+	// every frame by servo_current_update().
+	if (servoNum < NUM_SERVOS)
+	{
+		if (!uart_tx_begin(6 + UART_TX_UINT16_NBYTES))
+			return;
+		uart_tx_put('*');
+		putServoNum();
+		uart_tx_put('Q');
+		uart_tx_put('C');
+		uart_tx_put_uint16(servo_current_read(servoNum));
+		// Write final carriage return
+		uart_tx_put('\r');
+		uart_tx_end();
+	}
+}
+static void ParseQFree(uint16_t argument)
+{
+	// Return the number of free command queue slots: "*QF<free>".  The
+	// host can send this many more move commands without the parser
+	// having to wait for a slot.
+	uint8_t freeSlots = CMD_QUEUE_DEPTH - ServoCmdQueueCount;
+	if (!uart_tx_begin(4 + UART_TX_UINT16_NBYTES))
+		return;
+	uart_tx_put('*');
+	uart_tx_put('Q');
+	uart_tx_put('F');
+	uart_tx_put_uint16(freeSlots);
+	// Write final carriage return
+	uart_tx_put('\r');
+	uart_tx_end();
+}
+static void ParseQBuild(uint16_t argument)
+{
+	// Return frame build statistics since the last "CJ":
+	// "*QB<frames> <frames built> <groups rebuilt>".  Frames where no
+	// servo moved or was commanded are not built.
+	if (!uart_tx_begin(4 + (3 * (UART_TX_UINT16_NBYTES + 1))))
+		return;
+	uart_tx_put('*');
+	uart_tx_put('Q');
+	uart_tx_put('B');
+	uart_tx_put_uint16(FrameTotalCount);
+	uart_tx_put(' ');
+	uart_tx_put_uint16(FrameBuildCount);
+	uart_tx_put(' ');
+	uart_tx_put_uint16(GroupRebuildCount);
+	// Write final carriage return
+	uart_tx_put('\r');
+	uart_tx_end();
+}
+#if (EDGE_TIMING_STATS)
+static void ParseQJitter(uint16_t argument)
+{
+	// Return edge timing statistics.  The '#' number selects an edge
+	// slot in the edge array rather than a servo.
+	// - "#NQJ" writes "*NQJ<min> <max> <hist0> ... <histN>" for edge slot N
+	// - "QJ" writes "*QJ<max> <stacked> <missed>" for all edges
+	// Lateness values are in microseconds.  Without EDGE_TIMING_STATS
+	// there are no statistics, and "QJ" is not a command.
+	if (!uart_tx_begin(6 + ((EDGE_LATE_NBINS + 2) * (UART_TX_UINT16_NBYTES + 1))))
+		return;
+	uart_tx_put('*');
+	if (servoNum < (2 * NUM_SERVOS))
+	{
+		EdgeTiming_t *timing = &EdgeTiming[servoNum];
+		putServoNum();
+		uart_tx_put('Q');
+		uart_tx_put('J');
+		// Minimum is 0xFFFF until the first edge is recorded
+		uart_tx_put_uint16((timing->minLate == 0xFFFF) ? 0 : timing->minLate);
+		uart_tx_put(' ');
+		uart_tx_put_uint16(timing->maxLate);
+		for (uint8_t bin = 0; bin < EDGE_LATE_NBINS; ++bin)
+		{
+			uart_tx_put(' ');
+			uart_tx_put_uint16(timing->lateHist[bin]);
+		}
+	}
+	else
+	{
+		uint16_t maxLate = 0;
+		for (uint8_t edgeNum = 0; edgeNum < (2 * NUM_SERVOS); ++edgeNum)
+		{
+			if (EdgeTiming[edgeNum].maxLate > maxLate)
+			{
+				maxLate = EdgeTiming[edgeNum].maxLate;
+			}
+		}
+		uart_tx_put('Q');
+		uart_tx_put('J');
+		uart_tx_put_uint16(maxLate);
+		uart_tx_put(' ');
+		uart_tx_put_uint16(EdgeStackedCount);
+		uart_tx_put(' ');
+		uart_tx_put_uint16(EdgeMissedCount);
+	}
+	// Write final carriage return
+	uart_tx_put('\r');
+	uart_tx_end();
 }
+#endif	// EDGE_TIMING_STATS
 static void ParseQPos(uint16_t argument)
 {
 	// Return a string with position feedback voltage in millivolts
@@ -257,65 +1085,75 @@ static void ParseQPos(uint16_t argument)
 	if (servoNum < NUM_SERVOS)
 	{
 		// The ADC channel number matches the servo number, so no
-		// conversion required.
-		adcResult = adc_read_filtered(servoNum);
+		// conversion required.  Servos with no position input read 0.
+		adcResult = (servoNum < NUM_POSITION_INPUTS) ? adc_read_filtered(servoNum) : 0;
 		// Write "*NQP", where N = servo number
-		uart_tx_put_char('*');
-		if (servoNum >= 10)
-		{
-			uart_tx_put_char((servoNum / 10) + '0');	// Tens digit;
-		}
-		uart_tx_put_char((servoNum % 10) + '0');		// Ones digit;
-		uart_tx_put_char('Q');
-		uart_tx_put_char('P');
-		// Convert to voltage at pin in mV.  ADC of 1024 corresponds
-		// to the supply voltage of 3.3V = 3300 mV.
-		// 211200 = (3300/1024) * 65536
-		uint32_t voltageMilliVolts = (uint32_t)adcResult * 211200UL / 65536UL;
-		// Write voltage in millivolts.
-		uart_tx_uint16(voltageMilliVolts);
+		if (!uart_tx_begin(6 + UART_TX_UINT16_NBYTES))
+			return;
+		uart_tx_put('*');
+		putServoNum();
+		uart_tx_put('Q');
+		uart_tx_put('P');
+		// Write voltage at pin in millivolts.
+		uart_tx_put_uint16(adc_to_millivolts(adcResult));
 		// Write final carriage return
-		uart_tx_put_char('\r');
+		uart_tx_put('\r');
+		uart_tx_end();
 	}
 }
+static void ParseQPosRange(uint16_t argument)
+{
+	// Return the feedback voltages in millivolts of the servos from
+	// this servo to the argument servo, e.g. "#0QPR11"
+	putRange(argument, false);
+}
+static void ParseQUart(uint16_t argument)
+{
+	// Return serial RX statistics since the last "CJ":
+	// "*QU<RX queue overflows> <USART overflows> <bad binary frames> <max RX queue fill>
+	// <TX replies dropped>".  Overflows are counted in bytes lost.
+	if (!uart_tx_begin(4 + (5 * (UART_TX_UINT16_NBYTES + 1))))
+		return;
+	uart_tx_put('*');
+	uart_tx_put('Q');
+	uart_tx_put('U');
+	uart_tx_put_uint16(UartRxOverflowCount);
+	uart_tx_put(' ');
+	uart_tx_put_uint16(UartRxHwOverflowCount);
+	uart_tx_put(' ');
+	uart_tx_put_uint16(BinaryFrameErrorCount);
+	uart_tx_put(' ');
+	uart_tx_put_uint16(UartRxMaxFill);
+	uart_tx_put(' ');
+	uart_tx_put_uint16(UartTxDropCount);
+	// Write final carriage return
+	uart_tx_put('\r');
+	uart_tx_end();
+}
 static void ParseQStatus(uint16_t argument)
 {
-	// Write status value for a servo, one of:
-	// - 1 = Limp (output to servo is logic '0')
-	// - 4 = Traveling (moving at a stable speed)
-	// - 6 = Holding (keeping current position)
-	// These values are a subset of the status values supported by the LSS protocol
-	
+	// Write status value for a servo, see servoStatus()
 	if (servoNum < NUM_SERVOS)
 	{
 		// Write "*NQ", where N = servo number
-		uart_tx_put_char('*');
-		if (servoNum >= 10)
-		{
-			uart_tx_put_char((servoNum / 10) + '0');	// Tens digit;
-		}
-		uart_tx_put_char((servoNum % 10) + '0');		// Ones digit;
-		uart_tx_put_char('Q');
+		if (!uart_tx_begin(6))
+			return;
+		uart_tx_put('*');
+		putServoNum();
+		uart_tx_put('Q');
 		// Write the code corresponding to the servo status
-		if (ServoPulseDefs[servoNum].currentPW_l16 == 0)
-		{
-			// PW of 0 indicates no pulse (output constant '0')
-			uart_tx_put_char('1');
-		}
-		else if (ServoPulseDefs[servoNum].currentPW_l16 != ((uint32_t)ServoPulseDefs[servoNum].targetPW << 16))
-		{
-			// Current PW not equal to target PW indicates servo moving
-			uart_tx_put_char('4');
-		}
-		else
-		{
-			// Otherwise servo holding
-			uart_tx_put_char('6');
-		}
+		uart_tx_put('0' + servoStatus(servoNum));
 		// Write final carriage return
-		uart_tx_put_char('\r');
+		uart_tx_put('\r');
+		uart_tx_end();
 	}
 }
+static void ParseQStatusRange(uint16_t argument)
+{
+	// Return the status and feedback voltage in millivolts of the
+	// servos from this servo to the argument servo, e.g. "#0QSR11"
+	putRange(argument, true);
+}
 static void ParseQVoltage(uint16_t argument)
 {
 	// Return a string with battery voltage in millivolts
@@ -324,17 +1162,16 @@ static void ParseQVoltage(uint16_t argument)
 	// The ADC channel for battery voltage is 12
 	adcResult = adc_read_filtered(12);
 	// Write "*QV"
-	uart_tx_put_char('*');
-	uart_tx_put_char('Q');
-	uart_tx_put_char('V');
-	// Convert to voltage at pin in mV.  ADC of 1024 corresponds
-	// to a battery voltage of 12639mV.
-	// 808896 = (12639/1024) * 65536
-	uint32_t voltageMilliVolts = (uint32_t)adcResult * 808896UL / 65536UL;
-	// Write voltage in millivolts.
-	uart_tx_uint16(voltageMilliVolts);
+	if (!uart_tx_begin(4 + UART_TX_UINT16_NBYTES))
+		return;
+	uart_tx_put('*');
+	uart_tx_put('Q');
+	uart_tx_put('V');
+	// Write battery voltage in millivolts.
+	uart_tx_put_uint16(adc_to_battery_millivolts(adcResult));
 	// Write final carriage return
-	uart_tx_put_char('\r');
+	uart_tx_put('\r');
+	uart_tx_end();
 }
 static void ParseServoSpeed(uint16_t argument)
 {
@@ -346,10 +1183,33 @@ static void ParseServoSpeed(uint16_t argument)
 		ServoCmdArray[servoNum].targetSpeed = argument;
 	}
 }
+static void ParseSequence(uint16_t argument)
+{
+	// Queue this command behind the move in progress instead of
+	// starting it right away
+	ServoCmdSequenced = true;
+}
 static void ParseMoveTime(uint16_t argument)
 {
 	ServoCmdMoveTime = argument;
 }
+static void ParseTelemetryChannels(uint16_t argument)
+{
+	// Select the servos whose feedback voltage is in the telemetry
+	// frames, bit N = servo N.  The argument holds 16 servos, so
+	// "#<first>TLC" sets the bits of servos first to first + 15 and
+	// keeps the others.
+	uint8_t first = (servoNum < NUM_SERVOS) ? servoNum : 0;
+	TelemetryMask_t bits = (TelemetryMask_t)0xFFFF << first;
+	telemetryServos = ((telemetryServos & ~bits) | ((TelemetryMask_t)argument << first)) & TELEMETRY_ALL_SERVOS;
+}
+static void ParseTelemetry(uint16_t argument)
+{
+	// Send a telemetry frame every argument frames, starting with the
+	// next pass.  0 = off.
+	telemetryPeriod = argument;
+	telemetryLoop = (uint16_t)LoopCount - argument;
+}
 static void ParseVer(uint16_t argument)
 {
 	uart_tx_string(VERSION);
@@ -5,10 +5,12 @@
  * Author : Mike Dvorsky
  */ 
 
+#include <stdint.h>
 #include <stdbool.h>
 
 #include "../Include/globals.h"
 #include "../Include/servo_calculations.h"
+#include "../Include/servo_pulse.h"
 
 void servo_calculations_init(void)
 {
@@ -20,33 +22,276 @@ void servo_calculations_init(void)
 }
 
 /**********************************************************************
-* If there is a command waiting to be processed, then process it.
-* Inputs: ServoCmdArray, ServoCmdMoveTime, ServoCmdWaiting, ServoPulseDefs
-* Output: ServoCmdWaiting, ServoPulseDefs
+* Multiply x by a 16 bit reciprocal and shift right by 16 + shift.  The
+* 48 bit product is formed from two 16 x 16 bit multiplies, which the
+* AVR does with its hardware multiplier, rather than a 64 bit multiply.
 **********************************************************************/
-void servo_calculations_update(void)
+static inline uint32_t mulRecip(uint32_t x, uint16_t recip, uint8_t shift)
+{
+	uint32_t high = (uint32_t)(uint16_t)(x >> 16) * recip;
+	uint32_t low = (uint32_t)(uint16_t)x * recip;
+	return (high + (low >> 16)) >> shift;
+}
+
+/**********************************************************************
+* Divide a distance (less than 2^31) by the move time, using the move
+* time's reciprocal normalized to 16 bits:
+*   recip = floor((2^(16 + shift) - 1) / moveTime)
+* where shift is the bit number of the highest '1' bit of moveTime.  The
+* first estimate is short of the exact quotient by less than about
+* quotient / 2^14 + 2.  A second estimate from the remainder is short by
+* at most 2, so a short correction loop gives the exact quotient.
+**********************************************************************/
+static uint32_t divideByMoveTime(uint32_t distance, uint16_t recip, uint8_t shift, uint16_t moveTime)
 {
-	// If there is no command waiting, then leave
-	if (!ServoCmdWaiting)
+	uint32_t quotient = mulRecip(distance, recip, shift);
+	uint32_t remainder = distance - (quotient * moveTime);
+	uint32_t more = mulRecip(remainder, recip, shift);
+	quotient += more;
+	remainder -= more * moveTime;
+	while (remainder >= moveTime)
 	{
-		return;
+		++quotient;
+		remainder -= moveTime;
 	}
-	
-	// Clear the flag
-	ServoCmdWaiting = false;
-	
+	return quotient;
+}
+
+/**********************************************************************
+* Integer square root, rounded down.
+**********************************************************************/
+static uint16_t isqrt32(uint32_t x)
+{
+	uint32_t root = 0;
+	uint32_t bit = 1UL << 30;
+
+	while (bit > x)
+	{
+		bit >>= 2;
+	}
+	while (bit != 0)
+	{
+		if (x >= (root + bit))
+		{
+			x -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else
+		{
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+	return (uint16_t)root;
+}
+
+/**********************************************************************
+* Convert an acceleration in ACCEL_UNIT_US_PER_S2 to a change in
+* deltaPW_l16 per frame.
+**********************************************************************/
+static inline uint32_t accelToL16(uint16_t accel)
+{
+	return ((uint32_t)accel * (uint32_t)ACCEL_L16_PER_UNIT_SCALED) >> ACCEL_L16_SHIFT;
+}
+
+/**********************************************************************
+* Return the acceleration used to plan the ramps.  The end ramp's
+* velocity change is set from the distance remaining (see
+* servo_pulse.c), which may differ from the plan by a few units, so the
+* plan leaves that margin below the limit.
+**********************************************************************/
+static uint32_t accelPlanL16(uint16_t accel)
+{
+	uint32_t accel_L16 = accelToL16(accel);
+	uint32_t margin = (accel_L16 >> 8) + 2;
+	return (accel_L16 > margin) ? (accel_L16 - margin) : 1;
+}
+
+/**********************************************************************
+* Motion profile timing.  With ramps of n1 and n3 frames at the start
+* and end of a move of N frames, reaching velocity v:
+*   distance = v * (N - (n1 + n3) / 2)
+* This holds for both the trapezoid and the S-curve, since each ramp is
+* symmetric about its midpoint.  The trapezoid ramp takes v / a frames;
+* the S-curve ramp has a peak acceleration of 2v / n, so it takes 2v / a
+* frames.  Writing the ramp frames as v * k, where k = (1 / a) + (1 / d)
+* for the trapezoid (twice that for the S-curve):
+*   k * v^2 - 2 * N * v + 2 * distance = 0
+*   v = 2 * distance / (N + sqrt(N^2 - 2 * k * distance))
+* The shortest move is N = sqrt(2 * k * distance), with no cruise phase.
+*
+* Return 2 * k * distance, in frames^2.
+**********************************************************************/
+static uint32_t rampFramesSquared(uint32_t distance_L16, const ServoAccel_t * accelDef)
+{
+	uint8_t shift = accelDef->sCurve ? 2 : 1;
+	uint32_t framesSquared = 0;
+
+	if (accelDef->accel != 0)
+	{
+		framesSquared += (distance_L16 / accelPlanL16(accelDef->accel)) << shift;
+	}
+	if (accelDef->decel != 0)
+	{
+		framesSquared += (distance_L16 / accelPlanL16(accelDef->decel)) << shift;
+	}
+	return framesSquared;
+}
+
+/**********************************************************************
+* Return the minimum number of frames for a move with acceleration.
+* Each ramp is rounded up to whole frames (pairs of frames for the
+* S-curve), so allow for that.
+**********************************************************************/
+static uint16_t profileMinFrames(uint32_t distance_L16, const ServoAccel_t * accelDef)
+{
+	uint32_t framesSquared = rampFramesSquared(distance_L16, accelDef);
+	uint16_t frames = isqrt32(framesSquared);
+	if (((uint32_t)frames * frames) < framesSquared)
+	{
+		++frames;
+	}
+	return frames + (accelDef->sCurve ? 4 : 2);
+}
+
+/**********************************************************************
+* Return the number of frames in the ramp to reach a velocity with an
+* acceleration: v / a for the trapezoid and 2v / a for the S-curve,
+* rounded up (to an even number for the S-curve).  0 if no limit.
+**********************************************************************/
+static uint16_t rampFrames(uint32_t velocity_L16, uint16_t accel, bool sCurve)
+{
+	if (accel == 0)
+	{
+		return 0;
+	}
+	uint32_t accel_L16 = accelPlanL16(accel);
+	uint32_t frames = (velocity_L16 + accel_L16 - 1) / accel_L16;
+	if (frames > 0x7FFF)
+	{
+		frames = 0x7FFF;
+	}
+	return sCurve ? (2 * frames) : frames;
+}
+
+/**********************************************************************
+* Set up the motion profile for a move with acceleration.  The move
+* takes the same number of frames as a constant velocity move over the
+* move time, so servos with and without acceleration finish together.
+* The velocity is evaluated each frame in servo_pulse.c; the position is
+* set to the target on the last frame, as for constant velocity.
+*
+* In whole frames, the start ramp of n1 frames covers v * (n1 + 1) / 2
+* and the end ramp covers v * (n3 - 1) / 2 before the last frame, so
+*   2 * distance = v * W, W = (n1 + 1) + 2 * cruise + (n3 - 1)
+* Rounding the ramps up to whole frames raises the cruise velocity,
+* which may need longer ramps, so repeat until the ramps are long enough
+* for the velocity (one or two passes in practice).
+*
+* Unlike the constant velocity delta, the plan uses ordinary 32 bit
+* divides: two in rampFramesSquared() and up to three in each pass, so
+* about 10 for each servo with acceleration when a move starts.  Each
+* phase of the profile adds one or two more when it starts (see
+* servo_pulse.c).  None are in the per-frame update.
+**********************************************************************/
+static void setProfile(PulseDef_t * pulseDef, int32_t servoPwDelta_L16, uint16_t moveTime_ms,
+	const ServoAccel_t * accelDef)
+{
+	uint32_t distance_L16 = (servoPwDelta_L16 < 0) ? -servoPwDelta_L16 : servoPwDelta_L16;
+	bool negative = (servoPwDelta_L16 < 0);
+	bool sCurve = accelDef->sCurve;
+	uint16_t frames = (moveTime_ms + SERVO_PULSE_PERIOD_MS - 1) / SERVO_PULSE_PERIOD_MS;
+
+	// Estimate the cruise velocity from the continuous profile
+	uint32_t framesSquared = (uint32_t)frames * frames;
+	uint32_t rampSquared = rampFramesSquared(distance_L16, accelDef);
+	uint16_t root = (framesSquared > rampSquared) ? isqrt32(framesSquared - rampSquared) : 0;
+	uint32_t cruise_L16 = (distance_L16 / (frames + root)) * 2;
+	uint16_t upFrames = 0;
+	uint16_t downFrames = 0;
+
+	for (uint8_t pass = 0; pass < PROFILE_PLAN_PASSES; ++pass)
+	{
+		// Round the ramps to whole frames.  If the ramps do not fit (the
+		// move time is shorter than the minimum), then share the frames
+		// between them.
+		upFrames = rampFrames(cruise_L16, accelDef->accel, sCurve);
+		downFrames = rampFrames(cruise_L16, accelDef->decel, sCurve);
+		if ((uint32_t)upFrames + downFrames > frames)
+		{
+			upFrames = ((uint32_t)frames * upFrames) / (upFrames + downFrames);
+			if (sCurve)
+			{
+				upFrames &= ~1;
+			}
+			downFrames = (accelDef->decel == 0) ? 0 : (frames - upFrames);
+			if (sCurve)
+			{
+				downFrames &= ~1;
+			}
+		}
+
+		// Cruise velocity for the rounded ramps, from the distance formula
+		uint32_t weight = (2 * (uint32_t)(frames - upFrames - downFrames))
+			+ ((upFrames != 0) ? (upFrames + 1) : 0) + ((downFrames != 0) ? (downFrames - 1) : 0);
+		if (weight == 0)
+		{
+			weight = 1;
+		}
+		uint32_t newCruise_L16 = (distance_L16 * 2) / weight;
+		bool done = (newCruise_L16 <= cruise_L16);
+		cruise_L16 = newCruise_L16;
+		if (done)
+		{
+			break;
+		}
+	}
+
+	pulseDef->sCurve = sCurve;
+	pulseDef->accelFrames = sCurve ? (upFrames / 2) : upFrames;
+	pulseDef->decelFrames = sCurve ? (downFrames / 2) : downFrames;
+	pulseDef->cruiseFrames = frames - upFrames - downFrames;
+	pulseDef->cruisePW_l16 = negative ? -(int32_t)cruise_L16 : (int32_t)cruise_L16;
+	pulseDef->deltaPW_l16 = (upFrames == 0) ? pulseDef->cruisePW_l16 : 0;
+	pulseDef->phaseDiv = 1;
+	pulseDef->currentFrac = 0;
+	pulseDef->deltaFrac = 0;
+	pulseDef->accel_l16 = 0;
+	pulseDef->accelFrac = 0;
+	pulseDef->jerk_l16 = 0;
+	pulseDef->jerkFrac = 0;
+	pulseDef->phase = PROFILE_START;
+	pulseDef->phaseFrames = 0;
+	pulseDef->framesRemaining = frames;
+}
+
+/**********************************************************************
+* Start a command: calculate the move time, then the delta (or motion
+* profile) for each commanded servo, and store in ServoPulseDefs.
+* Inputs: cmd, ServoPulseDefs, ServoAccelDefs
+* Output: ServoPulseDefs, MillisRemainingInCommand
+**********************************************************************/
+static void startCommand(ServoCmdEntry_t * cmd)
+{
 	// Find the total move time.  This is based on the commanded total
 	// and the move time calculated for each servo based on the speed
 	// and the change in pulse width.  The final move time will be
 	// the MAXIMUM of all the times specified in the command.
-	uint16_t moveTime_ms = ServoCmdMoveTime;	// Start with commanded time in milliseconds
+	//
+	// The speed limited move time for a servo is 1000 * distance / speed.
+	// Rather than divide for every servo, find the servo with the largest
+	// distance / speed by cross multiplying (16 x 16 bit products), then
+	// divide once for that servo.  The result is exactly the maximum of
+	// the per-servo times.
+	uint16_t moveTime_ms = cmd->moveTime;	// Start with commanded time in milliseconds
+	uint16_t maxDistance = 0;
+	uint16_t maxSpeed = 1;
 	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
 	{
-		uint32_t servoMoveTime;
 		int16_t servoPwDelta;
 		
 		// If this servo is not part of the command, then skip
-		if (!ServoCmdArray[servoNum].isCommanded)
+		if (!cmd->servos[servoNum].isCommanded)
 			continue;
 			
 		// If this servo is commanded to '0' or '1', then skip.  These commands
@@ -56,23 +301,54 @@ void servo_calculations_update(void)
 		// does not make sense when going from solid '0' or '1' to a pulse
 		// width, so don't take this into account for move time calculation.
 		//  '0' and '1' are indicated by pulse widths of 0 and 0xFFFF.
-		if ((ServoCmdArray[servoNum].targetPW == 0) || (ServoCmdArray[servoNum].targetPW == 0xFFFF)
+		if ((cmd->servos[servoNum].targetPW == 0) || (cmd->servos[servoNum].targetPW == 0xFFFF)
 			|| (ServoPulseDefs[servoNum].targetPW == 0) || (ServoPulseDefs[servoNum].targetPW == 0xFFFF))
 			continue;
 		
 		// Calculate the magnitude of the change in pulse width in microseconds
-		servoPwDelta = ServoCmdArray[servoNum].targetPW - (uint16_t)(ServoPulseDefs[servoNum].currentPW_l16 >> 16);
+		servoPwDelta = cmd->servos[servoNum].targetPW - (uint16_t)(ServoPulseDefs[servoNum].currentPW_l16 >> 16);
 		if (servoPwDelta < 0)
 			servoPwDelta = -servoPwDelta;
-		// Calculate the move time for this servo in milliseconds
-		if (ServoCmdArray[servoNum].targetSpeed == 0)	// Prevent divide by 0
-			ServoCmdArray[servoNum].targetSpeed = 1;
-		servoMoveTime = (1000UL * servoPwDelta) / ServoCmdArray[servoNum].targetSpeed;
-		if (servoMoveTime > 0xFFFF)		// Clip to 16 bits
-			servoMoveTime = 0xFFFF;
-		if (servoMoveTime > moveTime_ms)	// New maximum?
-			moveTime_ms = (uint16_t)servoMoveTime;
+		if (cmd->servos[servoNum].targetSpeed == 0)	// Prevent divide by 0
+			cmd->servos[servoNum].targetSpeed = 1;
+		// New maximum distance / speed?
+		if (((uint32_t)(uint16_t)servoPwDelta * maxSpeed) > ((uint32_t)maxDistance * cmd->servos[servoNum].targetSpeed))
+		{
+			maxDistance = servoPwDelta;
+			maxSpeed = cmd->servos[servoNum].targetSpeed;
+		}
+		// With an acceleration limit, the move needs enough frames for
+		// the ramps
+		const ServoAccel_t *accelDef = &ServoAccelDefs[servoNum];
+		if ((accelDef->accel != 0) || (accelDef->decel != 0))
+		{
+			int32_t distance_L16 = ((uint32_t)cmd->servos[servoNum].targetPW << 16) - ServoPulseDefs[servoNum].currentPW_l16;
+			uint32_t rampTime = (uint32_t)profileMinFrames((distance_L16 < 0) ? -distance_L16 : distance_L16, accelDef)
+				* SERVO_PULSE_PERIOD_MS;
+			if (rampTime > 0xFFFF)		// Clip to 16 bits
+				rampTime = 0xFFFF;
+			if (rampTime > moveTime_ms)	// New maximum?
+				moveTime_ms = (uint16_t)rampTime;
+		}
 	}
+	// Calculate the move time for the slowest servo in milliseconds
+	uint32_t servoMoveTime = (1000UL * maxDistance) / maxSpeed;
+	if (servoMoveTime > 0xFFFF)		// Clip to 16 bits
+		servoMoveTime = 0xFFFF;
+	if (servoMoveTime > moveTime_ms)	// New maximum?
+		moveTime_ms = (uint16_t)servoMoveTime;
+
+	// Each servo's delta is its distance divided by the move time.  Take
+	// the reciprocal of the move time once, and divide by multiplying
+	// (see divideByMoveTime()).  A move time of 0 is treated as 1 ms, so
+	// the move is done in one frame.
+	uint16_t divisor = (moveTime_ms == 0) ? 1 : moveTime_ms;
+	uint8_t divisorShift = 0;
+	while ((divisor >> divisorShift) > 1)
+	{
+		++divisorShift;
+	}
+	uint16_t divisorRecip = ((1UL << (16 + divisorShift)) - 1) / divisor;
 	
 	// Now that we have the move time, we can recalculate the speeds and
 	// store in the ServoPulseDefs array
@@ -81,31 +357,93 @@ void servo_calculations_update(void)
 		int32_t servoPwDelta_L16;
 
 		// If this servo is not part of the command, then skip
-		if (!ServoCmdArray[servoNum].isCommanded)
+		if (!cmd->servos[servoNum].isCommanded)
 			continue;
+
+		// The pulse widths are about to change, so the servo's group
+		// must be rebuilt
+		servo_pulse_changed(servoNum);
 		
 		// If this servo is commanded to or is currently '0' or '1', then store in
 		// ServoPulseDefs with no speed.
-		if ((ServoCmdArray[servoNum].targetPW == 0) || (ServoCmdArray[servoNum].targetPW == 0xFFFF)
+		if ((cmd->servos[servoNum].targetPW == 0) || (cmd->servos[servoNum].targetPW == 0xFFFF)
 			|| (ServoPulseDefs[servoNum].targetPW == 0) || (ServoPulseDefs[servoNum].targetPW == 0xFFFF))
 		{
-			ServoPulseDefs[servoNum].targetPW = ServoCmdArray[servoNum].targetPW;
-			ServoPulseDefs[servoNum].currentPW_l16 = (uint32_t)ServoCmdArray[servoNum].targetPW << 16;
+			ServoPulseDefs[servoNum].targetPW = cmd->servos[servoNum].targetPW;
+			ServoPulseDefs[servoNum].currentPW_l16 = (uint32_t)cmd->servos[servoNum].targetPW << 16;
 			ServoPulseDefs[servoNum].deltaPW_l16 = 0;
+			ServoPulseDefs[servoNum].framesRemaining = 0;
+			ServoPulseDefs[servoNum].phase = PROFILE_NONE;
 			continue;
 		}
 
 		// Store the target PW
-		ServoPulseDefs[servoNum].targetPW = ServoCmdArray[servoNum].targetPW;
+		ServoPulseDefs[servoNum].targetPW = cmd->servos[servoNum].targetPW;
 
-		// Store the calculated deltaPW per loop, left shifted 16
+		// Store the calculated deltaPW per loop, left shifted 16.  This is
+		// SERVO_PULSE_PERIOD_MS * (distance / move time), with the division
+		// rounded toward 0.
 		servoPwDelta_L16 = ((uint32_t)ServoPulseDefs[servoNum].targetPW << 16) - ServoPulseDefs[servoNum].currentPW_l16;
-		ServoPulseDefs[servoNum].deltaPW_l16 = SERVO_PULSE_PERIOD_MS * (servoPwDelta_L16 / moveTime_ms);
+		uint32_t distance_L16 = (servoPwDelta_L16 < 0) ? -servoPwDelta_L16 : servoPwDelta_L16;
+		uint32_t quotient_L16 = divideByMoveTime(distance_L16, divisorRecip, divisorShift, divisor);
+		uint32_t step_L16 = SERVO_PULSE_PERIOD_MS * quotient_L16;
+		ServoPulseDefs[servoNum].deltaPW_l16 = (servoPwDelta_L16 < 0) ? -(int32_t)step_L16 : (int32_t)step_L16;
+
+		// The move takes the move time in whole frames, rounded up.  The
+		// delta is rounded down, so the servo does not pass the target
+		// before the last frame, which sets it to the target.  All servos
+		// in the command finish on the same frame.
+		ServoPulseDefs[servoNum].framesRemaining = (distance_L16 == 0) ? 0
+			: ((divisor + SERVO_PULSE_PERIOD_MS - 1) / SERVO_PULSE_PERIOD_MS);
+
+		// With an acceleration limit, replace the constant velocity with
+		// a motion profile that ends on the same frame
+		ServoPulseDefs[servoNum].phase = PROFILE_NONE;
+		if ((ServoAccelDefs[servoNum].accel != 0) || (ServoAccelDefs[servoNum].decel != 0))
+		{
+			setProfile(&ServoPulseDefs[servoNum], servoPwDelta_L16, divisor, &ServoAccelDefs[servoNum]);
+		}
 		
 		// Save the move time in this command in the global so we can track when it is done
 		MillisRemainingInCommand = moveTime_ms;
 	}
-	
+}
+
+/**********************************************************************
+* Move the command in ServoCmdArray to the tail of the command queue,
+* then clear ServoCmdArray for the next command.  Commands that do not
+* move any servo (queries, acceleration settings) are not queued.  A
+* command that is not sequenced replaces any commands in the queue, as
+* it replaces the move in progress.
+* Inputs: ServoCmdArray, ServoCmdMoveTime, ServoCmdSequenced
+* Output: ServoCmdQueue, ServoCmdWaiting
+**********************************************************************/
+static void queueCommand(void)
+{
+	bool isCommanded = false;
+	for (uint8_t i = 0; i < NUM_SERVOS; ++i)
+	{
+		isCommanded |= ServoCmdArray[i].isCommanded;
+	}
+	if (isCommanded)
+	{
+		if (!ServoCmdSequenced)
+		{
+			ServoCmdQueueCount = 0;
+		}
+		uint8_t tail = ServoCmdQueueHead + ServoCmdQueueCount;
+		if (tail >= CMD_QUEUE_DEPTH)
+			tail -= CMD_QUEUE_DEPTH;
+		ServoCmdEntry_t *cmd = &ServoCmdQueue[tail];
+		for (uint8_t i = 0; i < NUM_SERVOS; ++i)
+		{
+			cmd->servos[i] = ServoCmdArray[i];
+		}
+		cmd->moveTime = ServoCmdMoveTime;
+		cmd->sequenced = ServoCmdSequenced;
+		++ServoCmdQueueCount;
+	}
+
 	// Prepare for the next command by initializing all of the globals that
 	// are used for command storage.
 	// Clear servo command array to not commanded, and speed = max.
@@ -117,7 +455,48 @@ void servo_calculations_update(void)
 	}
 	// Clear the flag indicating that a command is waiting.
 	ServoCmdWaiting = false;
-	// Set the move time to 0 (default) for the next command
+	// Set the move time to 0 (default) and start immediately for the
+	// next command
 	ServoCmdMoveTime = 0;
+	ServoCmdSequenced = false;
+}
+
+/**********************************************************************
+* If there is a command waiting to be processed, then add it to the
+* command queue.  Then start the command at the head of the queue if it
+* is not sequenced, or if the move in progress is done.  A command that
+* is not sequenced starts right away, cutting short the move in
+* progress.
+* Inputs: ServoCmdArray, ServoCmdMoveTime, ServoCmdWaiting,
+*	ServoCmdQueue, MillisRemainingInCommand
+* Output: ServoCmdWaiting, ServoCmdQueue, ServoPulseDefs
+**********************************************************************/
+void servo_calculations_update(void)
+{
+	// If the queue is full, then the command stays in ServoCmdArray
+	// with the flag set, and the parser stops reading until there is
+	// a free slot.
+	if (ServoCmdWaiting && (ServoCmdQueueCount < CMD_QUEUE_DEPTH))
+	{
+		queueCommand();
+	}
+
+	// If there is no command in the queue, or the command at the head
+	// must wait for the move in progress, then leave
+	if (ServoCmdQueueCount == 0)
+	{
+		return;
+	}
+	ServoCmdEntry_t *cmd = &ServoCmdQueue[ServoCmdQueueHead];
+	if (cmd->sequenced && (MillisRemainingInCommand > 0))
+	{
+		return;
+	}
 
+	// Remove the command from the queue.  The entry is not reused until
+	// the next call, so it can be used in place.
+	if (++ServoCmdQueueHead >= CMD_QUEUE_DEPTH)
+		ServoCmdQueueHead = 0;
+	--ServoCmdQueueCount;
+	startCommand(cmd);
 }
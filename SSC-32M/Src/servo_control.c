@@ -0,0 +1,181 @@
+/*
+ * servo_control.c
+ *
+ * Closed-loop position control for the DeskPet servo controller.
+ */ 
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <avr/io.h>
+
+#include "../Include/globals.h"
+#include "../Include/adc.h"
+#include "../Include/servo_pulse.h"
+#include "../Include/servo_control.h"
+
+/**********************************************************************
+* Optional closed-loop position control.  For each servo with control
+* on, the position feedback is converted to a pulse width using two
+* calibration points, and a PID loop trims the pulse width output so
+* that the measured position follows the pulse width of the motion
+* profile.  This makes up for a servo that stops short under load.
+*
+* The loop runs once per frame, from servo_pulse_update(), with the
+* ADC scan taken in the quiet time at the end of the previous frame.
+* The trim is added to the pulse width when the edges are planned, so
+* the motion profile itself is not changed.  Servos that are off, held
+* at '0' or '1', or not calibrated have no trim.
+*
+* All arithmetic is 16/32 bit integer.  The gains are Q8, and the
+* integral and derivative terms are per frame.
+**********************************************************************/
+
+// Sequence number of the last ADC scan used
+static uint16_t prevScanSeq;
+
+static int16_t controlStep(ServoControl_t * control, uint16_t pw, uint16_t adcResult);
+
+/**********************************************************************
+* Init closed-loop control: off, not calibrated, default gains.
+**********************************************************************/
+void servo_control_init(void)
+{
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		ServoControl_t * control = &ServoControlDefs[servoNum];
+		control->enabled = false;
+		control->kp = CONTROL_KP_DEFAULT;
+		control->ki = CONTROL_KI_DEFAULT;
+		control->kd = CONTROL_KD_DEFAULT;
+		control->calPW[CONTROL_CAL_LOW] = 0;
+		control->calPW[CONTROL_CAL_HIGH] = 0;
+		control->slope_q12 = 0;
+		control->integral = 0;
+		control->prevError = 0;
+		control->trim = 0;
+	}
+	prevScanSeq = 0;
+}
+
+/**********************************************************************
+* Run one step of the control loop for every servo, if there is a new
+* ADC scan.  Called once per frame.  Groups with a changed trim are
+* marked for rebuilding.
+* Inputs: ADC snapshot, ServoPulseDefs, ServoControlDefs
+* Outputs: ServoControlDefs
+**********************************************************************/
+void servo_control_update(void)
+{
+	uint16_t results[NUM_ADC_CHANNELS];
+	uint16_t seq = adc_snapshot(results);
+	if (seq == prevScanSeq)
+	{
+		return;
+	}
+	prevScanSeq = seq;
+
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		ServoControl_t * control = &ServoControlDefs[servoNum];
+		uint16_t pw = ServoPulseDefs[servoNum].currentPW_l16 >> 16;
+		int16_t trim = 0;
+		if (control->enabled && (control->slope_q12 != 0) && (pw >= MINIMUM_PW) && (pw <= MAXIMUM_PW))
+		{
+			// The ADC channel number matches the servo number
+			trim = controlStep(control, pw, results[servoNum]);
+		}
+		else
+		{
+			control->integral = 0;
+			control->prevError = 0;
+		}
+		if (trim != control->trim)
+		{
+			control->trim = trim;
+			servo_pulse_changed(servoNum);
+		}
+	}
+}
+
+/**********************************************************************
+* One PID step for one servo.  Returns the trim for a servo whose
+* profile is at pulse width pw, and whose feedback is adcResult.  The
+* integral is held while the trim is at its limit, so that it does not
+* wind up while the servo is stalled.
+**********************************************************************/
+static int16_t controlStep(ServoControl_t * control, uint16_t pw, uint16_t adcResult)
+{
+	// Measured position as a pulse width, from the calibration line
+	int32_t measured = control->calPW[CONTROL_CAL_LOW] +
+		((((int32_t)adcResult - control->calAdc[CONTROL_CAL_LOW]) * control->slope_q12) >> CONTROL_SLOPE_SHIFT);
+	int32_t error = (int32_t)pw - measured;
+	if (error > MAXIMUM_PW)
+	{
+		error = MAXIMUM_PW;
+	}
+	else if (error < -MAXIMUM_PW)
+	{
+		error = -MAXIMUM_PW;
+	}
+
+	int16_t integral = control->integral + (int16_t)error;
+	if (integral > CONTROL_INTEGRAL_MAX)
+	{
+		integral = CONTROL_INTEGRAL_MAX;
+	}
+	else if (integral < -CONTROL_INTEGRAL_MAX)
+	{
+		integral = -CONTROL_INTEGRAL_MAX;
+	}
+
+	int32_t trim = ((int32_t)control->kp * error) + ((int32_t)control->ki * integral) +
+		((int32_t)control->kd * (error - control->prevError));
+	trim >>= CONTROL_GAIN_SHIFT;
+	control->prevError = error;
+	if (trim > CONTROL_TRIM_MAX)
+	{
+		trim = CONTROL_TRIM_MAX;
+	}
+	else if (trim < -CONTROL_TRIM_MAX)
+	{
+		trim = -CONTROL_TRIM_MAX;
+	}
+	else
+	{
+		control->integral = integral;
+	}
+	return trim;
+}
+
+/**********************************************************************
+* Record a calibration point for a servo: the servo is at pulse width
+* pw, and the feedback is the latest filtered ADC result.  When both
+* points are set, and far enough apart, the slope is calculated and
+* the servo is calibrated.  The servo must be still, and not under
+* closed-loop control, when a point is recorded.
+* Inputs: filtered ADC result
+* Outputs: ServoControlDefs
+**********************************************************************/
+void servo_control_calibrate(uint8_t servoNum, uint8_t point, uint16_t pw)
+{
+	ServoControl_t * control = &ServoControlDefs[servoNum];
+	if (servoNum >= NUM_POSITION_INPUTS)
+	{
+		// No position input, so the servo is never calibrated
+		return;
+	}
+	control->calPW[point] = pw;
+	control->calAdc[point] = adc_read_filtered(servoNum);
+	control->integral = 0;
+	control->prevError = 0;
+
+	int16_t adcSpan = (int16_t)control->calAdc[CONTROL_CAL_HIGH] - (int16_t)control->calAdc[CONTROL_CAL_LOW];
+	int16_t pwSpan = (int16_t)control->calPW[CONTROL_CAL_HIGH] - (int16_t)control->calPW[CONTROL_CAL_LOW];
+	control->slope_q12 = 0;
+	if ((control->calPW[CONTROL_CAL_LOW] != 0) && (control->calPW[CONTROL_CAL_HIGH] != 0) &&
+		(pwSpan != 0) && (abs(adcSpan) >= CONTROL_CAL_MIN_ADC))
+	{
+		control->slope_q12 = ((int32_t)pwSpan << CONTROL_SLOPE_SHIFT) / adcSpan;
+	}
+}
@@ -4,3 +4,215 @@
  * Servo current feedback for the DeskPet servo controller.
  * Author : Mike Dvorsky
  */ 
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "../Include/globals.h"
+#include "../Include/uart.h"
+#include "../Include/servo_current.h"
+
+/**********************************************************************
+* Reads the servo currents from the current sense device on UART1 (see
+* servo_current.h), and keeps the latest reading for each servo, so
+* that "QC" is answered without waiting for the device.
+*
+* A sweep of all servos is started every servo frame (or every few
+* frames, if the frame is short, see CURRENT_SWEEP_FRAMES).  Up to
+* CURRENT_MAX_IN_FLIGHT requests are sent ahead of the replies, so the
+* link is kept busy while the device turns each request around.  At
+* CURRENT_BAUD, the 36 reply bytes of a sweep take about 3ms.  Requests
+* still unanswered at the start of the next frame are abandoned, so a
+* lost reply does not stall the sweeps.  Late replies to an abandoned
+* sweep carry the other sweep bit, and are ignored: they are neither
+* stored nor counted against the requests of the current sweep, which
+* would let more than CURRENT_MAX_IN_FLIGHT of those be sent.
+*
+* UART1 is interrupt driven for both transmit and receive, with its own
+* buffers, at the same low priority as UART0.
+**********************************************************************/
+
+// RX and TX buffer sizes.  Must be powers of 2.  The TX buffer holds
+// no more than CURRENT_MAX_IN_FLIGHT requests, plus as many again if
+// late replies to the last sweep come in after a new sweep starts.
+#define CURRENT_RXQ_NBYTES 32
+#define CURRENT_TXQ_NBYTES 16
+
+// RX and TX buffers
+static uint8_t rxQueue[CURRENT_RXQ_NBYTES];
+static volatile uint8_t rxAddIdx;
+static uint8_t rxRemoveIdx;
+
+static uint8_t txQueue[CURRENT_TXQ_NBYTES];
+static uint8_t txAddIdx;
+static volatile uint8_t txRemoveIdx;
+
+// Latest current for each servo in milliamps
+static uint16_t currents[NUM_SERVOS];
+
+// Next servo to request in the sweep (NUM_SERVOS = all requested),
+// number of requests waiting for replies, low byte of LoopCount when
+// the sweep started, and sweep bit of its requests (0 or
+// CURRENT_SWEEP_bm)
+static uint8_t nextServo;
+static uint8_t inFlight;
+static uint8_t sweepLoop;
+static uint8_t sweepBit;
+
+// Reply being received: servo number, bytes received so far (0 = none),
+// and current bits 0-6
+static uint8_t replyServo;
+static uint8_t replyNBytes;
+static uint8_t replyLow;
+
+//*********************************************************************
+// UART1 RX ISR.  Places received bytes in the RX queue.  Bytes that do
+// not fit are dropped, and the reply they belong to is found to be bad
+// by the reply decoder.
+//*********************************************************************
+ISR(USART1_RXC_vect)
+{
+	uint8_t rxByte = USART1_RXDATAL;
+	uint8_t addIdx = rxAddIdx;
+	uint8_t nextIdx = (addIdx + 1) & (CURRENT_RXQ_NBYTES - 1);
+	if (nextIdx != rxRemoveIdx)
+	{
+		rxQueue[addIdx] = rxByte;
+		rxAddIdx = nextIdx;
+	}
+}
+
+//*********************************************************************
+// UART1 TX ISR.  Sends the next request, or disables itself when there
+// are none.
+//*********************************************************************
+ISR(USART1_DRE_vect)
+{
+	uint8_t removeIdx = txRemoveIdx;
+	if (removeIdx == txAddIdx)
+	{
+		// Queue empty, disable the interrupt
+		USART1_CTRLA = USART_RXCIE_bm;	// RXC interrupt is always enabled
+	}
+	else
+	{
+		USART1_TXDATAL = txQueue[removeIdx];
+		txRemoveIdx = (removeIdx + 1) & (CURRENT_TXQ_NBYTES - 1);
+	}
+}
+
+//*********************************************************************
+// Put a request on the TX queue.  The queue is not normally full (see
+// CURRENT_TXQ_NBYTES), but if it is, the request is dropped and treated
+// as lost.
+//*********************************************************************
+static void sendRequest(uint8_t servoNum)
+{
+	uint8_t nextIdx = (txAddIdx + 1) & (CURRENT_TXQ_NBYTES - 1);
+	if (nextIdx == txRemoveIdx)
+	{
+		return;
+	}
+	txQueue[txAddIdx] = CURRENT_REQUEST | sweepBit | servoNum;
+	MEMORY_BARRIER();		// Byte in the queue before the index
+	txAddIdx = nextIdx;
+	USART1_CTRLA = USART_RXCIE_bm | USART_DREIE_bm;	// RXC interrupt is always enabled
+}
+
+void servo_current_init(void)
+{
+	for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+	{
+		currents[servoNum] = 0;
+	}
+	rxAddIdx = 0;
+	rxRemoveIdx = 0;
+	txAddIdx = 0;
+	txRemoveIdx = 0;
+	replyNBytes = 0;
+	inFlight = 0;
+	nextServo = 0;
+	sweepLoop = (uint8_t)LoopCount;
+	sweepBit = 0;
+
+	// Select the alternate pins (PC4/PC5) for UART1
+	PORTMUX_USARTROUTEA = (PORTMUX_USARTROUTEA & ~PORTMUX_USART1_gm) | PORTMUX_USART1_ALT1_gc;
+	USART1_BAUD = UART_BAUD_REG(CURRENT_BAUD);
+
+	// Define the port pin directions.
+	PORTC_DIRSET = _BV(4);
+	PORTC_DIRCLR = _BV(5);
+
+	// Enable TX and RX, set modes, etc.
+	// Asynchronous, normal speed, no parity, 1 stop bit, 8 data bits
+	USART1_CTRLC = USART_CMODE_ASYNCHRONOUS_gc | USART_PMODE_DISABLED_gc | USART_SBMODE_1BIT_gc | USART_CHSIZE_8BIT_gc;
+	USART1_CTRLB = USART_RXEN_bm | USART_TXEN_bm | USART_RXMODE_NORMAL_gc;
+
+	// Enable the RX ISR.  The TX ISR will be enabled only if there is
+	// a request to send.
+	USART1_CTRLA = USART_RXCIE_bm;
+}
+
+//*********************************************************************
+// Decode the replies received, then start a sweep if a new frame has
+// started, and send requests until CURRENT_MAX_IN_FLIGHT are waiting.
+//*********************************************************************
+void servo_current_update(void)
+{
+	while (rxRemoveIdx != rxAddIdx)
+	{
+		uint8_t rxByte = rxQueue[rxRemoveIdx];
+		rxRemoveIdx = (rxRemoveIdx + 1) & (CURRENT_RXQ_NBYTES - 1);
+		if (rxByte & CURRENT_REQUEST)
+		{
+			// First byte of a reply.  Replies to an earlier sweep are
+			// skipped.
+			replyServo = rxByte & CURRENT_SERVO_gm;
+			replyNBytes = ((replyServo < NUM_SERVOS) && ((rxByte & CURRENT_SWEEP_bm) == sweepBit)) ? 1 : 0;
+		}
+		else if (replyNBytes == 1)
+		{
+			replyLow = rxByte;
+			replyNBytes = 2;
+		}
+		else if (replyNBytes == 2)
+		{
+			currents[replyServo] = replyLow | ((uint16_t)rxByte << 7);
+			replyNBytes = 0;
+			if (inFlight != 0)
+			{
+				--inFlight;
+			}
+		}
+	}
+
+	// Start a new sweep every CURRENT_SWEEP_FRAMES frames.  Requests
+	// not answered by now are abandoned, along with any reply partly
+	// received.
+	if ((uint8_t)((uint8_t)LoopCount - sweepLoop) >= CURRENT_SWEEP_FRAMES)
+	{
+		sweepLoop = (uint8_t)LoopCount;
+		sweepBit ^= CURRENT_SWEEP_bm;
+		nextServo = 0;
+		inFlight = 0;
+		replyNBytes = 0;
+	}
+
+	// Keep the requests in flight
+	while ((nextServo < NUM_SERVOS) && (inFlight < CURRENT_MAX_IN_FLIGHT))
+	{
+		sendRequest(nextServo);
+		++nextServo;
+		++inFlight;
+	}
+}
+
+//*********************************************************************
+// Return the latest current for a servo in milliamps.
+//*********************************************************************
+uint16_t servo_current_read(uint8_t servoNum)
+{
+	return currents[servoNum];
+}
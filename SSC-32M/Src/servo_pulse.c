@@ -6,10 +6,14 @@
  */ 
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
 #include <avr/io.h>
 
 #include "../Include/globals.h"
 #include "../Include/servo_pulse.h"
+#include "../Include/servo_control.h"
 
 // Array of pulse widths for each servo
 struct pulseWidth_s
@@ -18,7 +22,58 @@ struct pulseWidth_s
 	uint16_t pw;
 };
 typedef struct pulseWidth_s pulseWidth_t;
-static pulseWidth_t pulseWidths[3];	// Hard coded for 3 servos per group
+static pulseWidth_t pulseWidths[SERVOS_PER_GROUP];
+
+// Number of servos in the last group, which is smaller than the others
+// if NUM_SERVOS is not a multiple of SERVOS_PER_GROUP.  The unused
+// entries of pulseWidths[] (including those left by servos with hardware
+// pulses) are filled with PAD_PW so they sort last.
+#define LAST_GROUP_SIZE (NUM_SERVOS - ((NUM_SERVO_GROUPS - 1) * SERVOS_PER_GROUP))
+#define PAD_PW 0xFFFF
+
+// Compare and exchange two entries of pulseWidths[], so that the entry
+// with the smaller pulse width is first.  One element of a sorting
+// network.
+#define SORT_PAIR(a, b) \
+	if (pulseWidths[b].pw < pulseWidths[a].pw) \
+	{ \
+		pulseWidth_t temp = pulseWidths[a]; \
+		pulseWidths[a] = pulseWidths[b]; \
+		pulseWidths[b] = temp; \
+	}
+
+// Edges planned for a group before they are written to the edge array.
+// Each planned edge is one ISR, and may switch several pins on the same
+// port at once.
+struct groupEdge_s
+{
+	volatile uint8_t * regAddr;	// Pointer to the OUTSET or OUTCLR register for the edge
+	uint8_t bitMap;		// Bit map with '1' bit for each pin switched by the edge
+	uint16_t time;		// Timer value for the edge
+};
+typedef struct groupEdge_s groupEdge_t;
+static groupEdge_t risingEdges[SERVOS_PER_GROUP];	// Edges at the start of the group, in time order
+static groupEdge_t fallingEdges[SERVOS_PER_GROUP];	// Edges at the end of the pulses, in time order
+static uint8_t numRisingEdges;
+static uint8_t numFallingEdges;
+
+// Edge arrays that are out of date for each group.  Bit N is set if
+// edge array N must be rebuilt for the group.  A group is marked out of
+// date in both edge arrays whenever one of its pulse widths changes.
+#define STALE_BOTH 0x03
+static uint8_t groupStale[NUM_SERVO_GROUPS];
+
+// Number of edges written for each group in each edge array.  The groups
+// are packed in order, so a group starts at the sum of the counts before it.
+static uint8_t groupNumEdges[2][NUM_SERVO_GROUPS];
+
+// Value of FrameCount at the last update, and at the last motion step
+// of a timed command
+static uint8_t prevFrameCount;
+static uint8_t stepFrameCount;
+
+static void advancePulses(void);
+static uint8_t buildFrame(uint8_t buffer);
 
 /**********************************************************************
 * Initialize the servo output pins and the array of servo edges.
@@ -32,171 +87,816 @@ void servo_pulse_init(void)
 		*ServoPinDefs[servoNum].dirsetRegAddr = ServoPinDefs[servoNum].bitMap;	// Configure the pin as output
 	}
 
-	// Init the ServoPulseEdges[] array.  This must be called after
+#if (HW_PULSE_OFFLOAD)
+	// Find the servos on the TCA0 WO1 and WO2 pins, PB1 and PB2
+	for (uint8_t hwNum = 0; hwNum < NUM_HW_PULSES; ++hwNum)
+	{
+		HwPulseServos[hwNum] = HW_PULSE_SERVO_NONE;
+		for (uint8_t servoNum = 0; servoNum < NUM_SERVOS; ++servoNum)
+		{
+			if ((ServoPinDefs[servoNum].outsetRegAddr == &PORTB_OUTSET)
+				&& (ServoPinDefs[servoNum].bitMap == _BV(hwNum + 1)))
+			{
+				HwPulseServos[hwNum] = servoNum;
+			}
+		}
+	}
+#endif
+
+	// Init the ServoPulseEdges[] arrays.  This must be called after
 	// the ServoPulseDefs[] array has been initialized to the
-	// starting values.
-	EdgeIndex = 2 * NUM_SERVOS;
-	servo_pulse_update();
+	// starting values.  The timer is not running yet, so build the
+	// first frame directly into edge array 0 and make it active.  All
+	// groups are left out of date in edge array 1, so the next call to
+	// servo_pulse_update() builds the whole frame there.
+	for (uint8_t groupNum = 0; groupNum < NUM_SERVO_GROUPS; ++groupNum)
+	{
+		groupStale[groupNum] = STALE_BOTH;
+		groupNumEdges[0][groupNum] = 0;
+		groupNumEdges[1][groupNum] = 0;
+	}
+	buildFrame(0);
+	EdgeBufferActive = 0;
+	EdgeBufferPending = EDGE_BUFFER_NONE;
+	prevFrameCount = FrameCount;
+	stepFrameCount = FrameCount - 1;
+	servo_pulse_stats_clear();
 }
 
 /**********************************************************************
-* Update the pulse and edge arrays.
-* NOTE: this function is hard coded for 12 servos total (4 groups of 3 servos
-* per group).  If the number of servos changes, then the function must be changed.
-* Inputs: EdgeIndex, ServoPulseDefs, ServoPinDefs
-* Outputs: EdgeIndex, ServoPulseEdges
+* Mark a servo's group out of date in both edge arrays.  Must be called
+* whenever the target or current pulse width in ServoPulseDefs is
+* changed outside this file.
 **********************************************************************/
-void servo_pulse_update(void)
+void servo_pulse_changed(uint8_t servoNum)
 {
-	// Test for all edges output.
-	// When this happens, update the servo pulses and edges for next time.
-	if ( EdgeIndex < (2 * NUM_SERVOS))
+	if (servoNum < NUM_SERVOS)
 	{
-		// Return if still outputting edges.
-		return;
+		groupStale[servoNum / SERVOS_PER_GROUP] = STALE_BOTH;
 	}
-	
-	// Clear the edge index for next time
-	EdgeIndex = 0;
+}
 
-	// Increment the loop counter every 20ms (i.e. every time all of
-	// the edges have been output for a loop)
-	++LoopCount;
-	
-	// Update the time remaining in the latest command
-	MillisRemainingInCommand -= SERVO_PULSE_PERIOD_MS;
-	if (MillisRemainingInCommand < 0)
+/**********************************************************************
+* Clear the frame build statistics.
+**********************************************************************/
+void servo_pulse_stats_clear(void)
+{
+	FrameTotalCount = 0;
+	FrameBuildCount = 0;
+	GroupRebuildCount = 0;
+}
+
+/**********************************************************************
+* Add a planned edge to a list of edges, keeping the list in time order.
+**********************************************************************/
+static void addPlannedEdge(groupEdge_t * edges, uint8_t * numEdges,
+	volatile uint8_t * regAddr, uint8_t bitMap, uint16_t time)
+{
+	uint8_t i = *numEdges;
+	while ((i > 0) && (edges[i - 1].time > time))
 	{
-		MillisRemainingInCommand = 0;
+		edges[i] = edges[i - 1];
+		--i;
 	}
+	edges[i].regAddr = regAddr;
+	edges[i].bitMap = bitMap;
+	edges[i].time = time;
+	++*numEdges;
+}
 
-	// Update the global pulse array by adding the delta to each pulse
-	// width, then clipping to the target.  Work one group at a time.
-	for (uint8_t groupNum = 0; groupNum < 4; ++groupNum)
+/**********************************************************************
+* Plan the edges for a pulsing pin.  Must be called in order of
+* increasing pulse width.
+*
+* First try to share a rising edge already planned on the same port.
+* This works if the resulting falling edge either lands within
+* EDGE_COALESCE_TOLERANCE of a planned falling edge on the same port (the
+* two are merged), or is at least RISING_EDGE_SPACING away from every
+* planned falling edge.  Otherwise, add a new rising edge
+* RISING_EDGE_SPACING after the last one.  Because the pulse widths are
+* in increasing order, the new falling edge is then at least
+* RISING_EDGE_SPACING after every planned falling edge.
+**********************************************************************/
+static void planPulse(const PinDef_t * pin, uint16_t pw, uint16_t groupStartTime)
+{
+	for (uint8_t risingNum = 0; risingNum < numRisingEdges; ++risingNum)
 	{
-		// Loop through the servos in the group, updating the pulse widths
-		for (uint8_t offsetInGroup = 0; offsetInGroup < 3; ++offsetInGroup)
+		groupEdge_t *rising = &risingEdges[risingNum];
+		if (rising->regAddr != pin->outsetRegAddr)
 		{
-			uint8_t servoNum = (groupNum * 3) + offsetInGroup;
-			// Get a pointer to the pulse
-			PulseDef_t *pulseDef = &ServoPulseDefs[servoNum];
-			// Add the delta to the current PW.  If overshoot, then clip.
-			pulseDef->currentPW_l16 += pulseDef->deltaPW_l16;
-			if (((pulseDef->deltaPW_l16 > 0) && (pulseDef->currentPW_l16 > ((uint32_t)(pulseDef->targetPW) << 16)))
-			|| ((pulseDef->deltaPW_l16 < 0) && (pulseDef->currentPW_l16 < ((uint32_t)(pulseDef->targetPW) << 16))))
-			{
-				pulseDef->currentPW_l16 = (uint32_t)(pulseDef->targetPW) << 16;
-			}
-			// Store the resulting pulse width in the pulseWidths array for later use.
-			pulseWidths[offsetInGroup].servoNum = servoNum;
-			pulseWidths[offsetInGroup].pw = pulseDef->currentPW_l16 >> 16;
-			// If the pulse width is outside the range, then force it to 1 beyond the range.
-			// This ensures that all such pulse widths sort correctly in the next step.
-			if (pulseWidths[offsetInGroup].pw < MINIMUM_PW)
+			continue;
+		}
+		uint16_t fallingTime = rising->time + pw;
+		groupEdge_t *mergeEdge = NULL;
+		bool spaced = true;
+		for (uint8_t fallingNum = 0; fallingNum < numFallingEdges; ++fallingNum)
+		{
+			groupEdge_t *falling = &fallingEdges[fallingNum];
+			uint16_t diff = (fallingTime > falling->time) ? (fallingTime - falling->time) : (falling->time - fallingTime);
+			if ((diff <= EDGE_COALESCE_TOLERANCE) && (falling->regAddr == pin->outclrRegAddr))
 			{
-				pulseWidths[offsetInGroup].pw = MINIMUM_PW - 1;
+				mergeEdge = falling;
 			}
-			else if (pulseWidths[offsetInGroup].pw > MAXIMUM_PW)
+			else if (diff < RISING_EDGE_SPACING)
 			{
-				pulseWidths[offsetInGroup].pw = MAXIMUM_PW + 1;
+				spaced = false;
 			}
 		}
-			
-		// At this point, the pulseWidths array has been written with the servo
-		// number and pulse width for each servo in the group.  Sort the
-		// pulseWidths array by pulse width, from smallest to largest.
-		// Insertion sort
-		for (uint8_t i = 0; i < 2; ++i)	// Hard coded for 3 pulse per group
+		if (mergeEdge != NULL)
 		{
-			uint16_t minPW = pulseWidths[i].pw;
-			uint8_t minIdx = i;
-			for (uint8_t j = i+1; j < 3; ++j)
-			{
-				if (pulseWidths[j].pw < minPW)
+			// Share both the rising and the falling edge
+			rising->bitMap |= pin->bitMap;
+			mergeEdge->bitMap |= pin->bitMap;
+			return;
+		}
+		if (spaced)
+		{
+			// Share the rising edge, new falling edge
+			rising->bitMap |= pin->bitMap;
+			addPlannedEdge(fallingEdges, &numFallingEdges, pin->outclrRegAddr, pin->bitMap, fallingTime);
+			return;
+		}
+	}
+
+	// New rising edge.  Each rising edge is offset RISING_EDGE_SPACING from the previous.
+	uint16_t risingTime = groupStartTime + (numRisingEdges * RISING_EDGE_SPACING);
+	addPlannedEdge(risingEdges, &numRisingEdges, pin->outsetRegAddr, pin->bitMap, risingTime);
+	addPlannedEdge(fallingEdges, &numFallingEdges, pin->outclrRegAddr, pin->bitMap, risingTime + pw);
+}
+
+/**********************************************************************
+* Plan the edge for a pin held at a constant '0' (regAddr = OUTCLR) or
+* '1' (regAddr = OUTSET).  The pin is merged into any planned edge that
+* writes the same register.  Otherwise, a new edge is added in the next
+* rising edge slot.
+**********************************************************************/
+static void planConstant(volatile uint8_t * regAddr, uint8_t bitMap, uint16_t groupStartTime)
+{
+	for (uint8_t i = 0; i < numRisingEdges; ++i)
+	{
+		if (risingEdges[i].regAddr == regAddr)
+		{
+			risingEdges[i].bitMap |= bitMap;
+			return;
+		}
+	}
+	for (uint8_t i = 0; i < numFallingEdges; ++i)
+	{
+		if (fallingEdges[i].regAddr == regAddr)
+		{
+			fallingEdges[i].bitMap |= bitMap;
+			return;
+		}
+	}
+	uint16_t time = groupStartTime + (numRisingEdges * RISING_EDGE_SPACING);
+	addPlannedEdge(risingEdges, &numRisingEdges, regAddr, bitMap, time);
+}
+
+/**********************************************************************
+* Update the pulse and edge arrays.
+*
+* The edge arrays are double buffered.  While the ISR outputs the
+* active array, the next frame is built in the other array, which is
+* then handed to the ISR by setting EdgeBufferPending.  The ISR switches
+* to it after the last edge of the current frame.  A new frame is built
+* as soon as the previous one has been switched in, so the main loop
+* has most of a frame period to build each frame.  If the main loop is
+* late, then the ISR outputs the active array again, and the motion
+* resumes one frame later.
+*
+* Only the groups whose pulse widths have changed are rebuilt.  If no
+* group is out of date, then both edge arrays already hold the current
+* frame, and nothing is handed to the ISR.
+*
+* The time remaining in the command counts down with the motion steps,
+* in the same frames as framesRemaining, so a sequenced command starts
+* on the frame after the last step of the move before it, even if the
+* main loop was late.  A timed command that moves no servo hands no
+* frame to the ISR, so its steps are held to one per frame output.
+* Inputs: FrameCount, EdgeBufferActive, EdgeBufferPending, ServoPulseDefs,
+*         ServoControlDefs
+* Outputs: LoopCount, MillisRemainingInCommand, EdgeBufferPending,
+*          ServoPulseEdges, ServoPulseDefs, frame build statistics
+**********************************************************************/
+void servo_pulse_update(void)
+{
+	// Increment the loop counter every frame (i.e. every time all of
+	// the edges have been output for a loop)
+	uint8_t frameCount = FrameCount;
+	uint8_t framesElapsed = frameCount - prevFrameCount;
+	prevFrameCount = frameCount;
+	if (framesElapsed != 0)
+	{
+		LoopCount += framesElapsed;
+		FrameTotalCount += framesElapsed;
+		// Once per frame, update the closed-loop trims
+		servo_control_update();
+	}
+
+	// Return if the ISR has not yet switched to the last frame built.
+	if (EdgeBufferPending != EDGE_BUFFER_NONE)
+	{
+		return;
+	}
+
+	// Update the time remaining in the command with the motion step,
+	// at most once per frame
+	if (MillisRemainingInCommand > 0)
+	{
+		if (frameCount == stepFrameCount)
+		{
+			return;
+		}
+		stepFrameCount = frameCount;
+		MillisRemainingInCommand -= SERVO_PULSE_PERIOD_MS;
+		if (MillisRemainingInCommand < 0)
+		{
+			MillisRemainingInCommand = 0;
+		}
+	}
+
+	// Move the pulse widths of the moving servos one step toward their
+	// targets.  This marks their groups out of date.
+	advancePulses();
+
+	// Rebuild the out of date groups in the edge array not being
+	// output, and hand it to the ISR.  The barrier makes sure the edge
+	// array is complete before the ISR can see it.
+	uint8_t buffer = EdgeBufferActive ^ 1;
+	uint8_t groupsRebuilt = buildFrame(buffer);
+	if (groupsRebuilt == 0)
+	{
+		return;
+	}
+	++FrameBuildCount;
+	GroupRebuildCount += groupsRebuilt;
+	MEMORY_BARRIER();
+	EdgeBufferPending = buffer;
+}
+
+/**********************************************************************
+* Fractions for the motion profiles.  A value is held as a whole part,
+* rounded down, and a fraction in units of 1 / phaseDiv, from 0 to
+* phaseDiv - 1.  Within a phase all the profile values share the
+* denominator, so the velocity and the position follow the profile
+* exactly, and the pulse width is the exact position rounded down.
+**********************************************************************/
+static inline void fracAdd(int32_t * whole, uint32_t * frac, int32_t addWhole, uint32_t addFrac, uint32_t div)
+{
+	*whole += addWhole;
+	*frac += addFrac;
+	if (*frac >= div)
+	{
+		*frac -= div;
+		++*whole;
+	}
+}
+
+static inline void fracNegate(int32_t * whole, uint32_t * frac, uint32_t div)
+{
+	*whole = -*whole;
+	if (*frac != 0)
+	{
+		--*whole;
+		*frac = div - *frac;
+	}
+}
+
+// Divide x by div as a whole part (rounded down) and a fraction
+static int32_t fracDivide(int32_t x, uint32_t div, uint32_t * frac)
+{
+	uint32_t magnitude = (x < 0) ? -(uint32_t)x : (uint32_t)x;
+	uint32_t quotient = magnitude / div;
+	uint32_t remainder = magnitude - (quotient * div);
+	if (x >= 0)
+	{
+		*frac = remainder;
+		return quotient;
+	}
+	if (remainder == 0)
+	{
+		*frac = 0;
+		return -(int32_t)quotient;
+	}
+	*frac = div - remainder;
+	return -(int32_t)quotient - 1;
+}
+
+/**********************************************************************
+* Return the number of frames of the end ramp in which the servo moves.
+* On the last frame of the move the velocity would be 0, and the pulse
+* width is set to the target instead.  With no end ramp, the last frame
+* is a cruise (or start ramp) frame.
+**********************************************************************/
+static inline uint16_t decelMovingFrames(const PulseDef_t * pulseDef)
+{
+	if (pulseDef->decelFrames == 0)
+	{
+		return 0;
+	}
+	return pulseDef->sCurve ? ((2 * pulseDef->decelFrames) - 1) : (pulseDef->decelFrames - 1);
+}
+
+/**********************************************************************
+* Start a ramp that changes the velocity by 'change' over the phase (the
+* first half of an S-curve ramp and the second half together).  The
+* trapezoid ramp of n frames adds change / n each frame.  The S-curve
+* ramp of 2h frames adds jerk * (1 + 2 + ... + h) in each half, so the
+* jerk is change / (h * (h + 1)).  Either way, that is the denominator
+* for the phase.  The fraction of the current velocity is dropped.
+**********************************************************************/
+static void startRamp(PulseDef_t * pulseDef, int32_t change, uint16_t frames)
+{
+	uint32_t div = pulseDef->sCurve ? ((uint32_t)frames * (frames + 1)) : frames;
+
+	pulseDef->phaseDiv = div;
+	pulseDef->currentFrac = 0;
+	pulseDef->deltaFrac = 0;
+	if (pulseDef->sCurve)
+	{
+		pulseDef->accel_l16 = 0;
+		pulseDef->accelFrac = 0;
+		pulseDef->jerk_l16 = fracDivide(change, div, &pulseDef->jerkFrac);
+	}
+	else
+	{
+		pulseDef->accel_l16 = fracDivide(change, div, &pulseDef->accelFrac);
+		pulseDef->jerk_l16 = 0;
+		pulseDef->jerkFrac = 0;
+	}
+}
+
+/**********************************************************************
+* Start the cruise phase.  The cruise velocity is set from the distance
+* remaining, so the rounding in the plan and the start ramp is made up
+* here.  With c cruise frames and an end ramp in which the servo moves
+* for m frames, the remaining distance is v * (c + m / 2).
+**********************************************************************/
+static void startCruise(PulseDef_t * pulseDef)
+{
+	int32_t remaining_L16 = ((uint32_t)pulseDef->targetPW << 16) - pulseDef->currentPW_l16;
+	uint32_t div = (2 * (uint32_t)pulseDef->cruiseFrames) + decelMovingFrames(pulseDef);
+
+	pulseDef->phaseDiv = div;
+	pulseDef->currentFrac = 0;
+	pulseDef->deltaPW_l16 = fracDivide(2 * remaining_L16, div, &pulseDef->deltaFrac);
+	pulseDef->accel_l16 = 0;
+	pulseDef->accelFrac = 0;
+	pulseDef->jerk_l16 = 0;
+	pulseDef->jerkFrac = 0;
+}
+
+/**********************************************************************
+* Start the end ramp from the current velocity v.  A ramp that changes
+* the velocity by 'change' covers m * (v + change / 2) in the m frames
+* in which the servo moves, for both ramp shapes.  The change is set
+* from the distance remaining, so the servo arrives at the target even
+* if the velocity is not quite the planned one.  2 * distance / m is
+* rounded toward 0, so the servo stops short of the target by less than
+* m / 2 (in units of 1/65536 us), and the last frame moves it the rest
+* of the way.
+**********************************************************************/
+static void startDecel(PulseDef_t * pulseDef)
+{
+	uint16_t moving = decelMovingFrames(pulseDef);
+	if (moving == 0)
+	{
+		return;
+	}
+	int32_t remaining_L16 = ((uint32_t)pulseDef->targetPW << 16) - pulseDef->currentPW_l16;
+	int32_t change = ((2 * remaining_L16) / (int32_t)moving) - (2 * pulseDef->deltaPW_l16);
+	startRamp(pulseDef, change, pulseDef->decelFrames);
+}
+
+/**********************************************************************
+* Start the next phase of a motion profile, skipping phases with no
+* frames.  The acceleration of the second half of an S-curve ramp
+* mirrors the first half, so the ramp ends at the velocity it would
+* have reached with constant acceleration.
+**********************************************************************/
+static void nextPhase(PulseDef_t * pulseDef)
+{
+	do
+	{
+		switch (++pulseDef->phase)
+		{
+			case PROFILE_ACCEL_1:
+				pulseDef->phaseFrames = pulseDef->accelFrames;
+				if (pulseDef->phaseFrames != 0)
 				{
-					minPW = pulseWidths[j].pw;
-					minIdx = j;
+					startRamp(pulseDef, pulseDef->cruisePW_l16, pulseDef->accelFrames);
 				}
-			}
-			if (minIdx != i)
-			{
-				// Insert
-				pulseWidth_t temp = pulseWidths[minIdx];
-				for (uint8_t k = minIdx; k > i; --k)
+				break;
+			case PROFILE_ACCEL_2:
+			case PROFILE_DECEL_2:
+				// Second half of an S-curve ramp
+				pulseDef->phaseFrames = pulseDef->sCurve
+					? ((pulseDef->phase == PROFILE_ACCEL_2) ? pulseDef->accelFrames : pulseDef->decelFrames) : 0;
+				fracAdd(&pulseDef->accel_l16, &pulseDef->accelFrac, pulseDef->jerk_l16, pulseDef->jerkFrac,
+					pulseDef->phaseDiv);
+				fracNegate(&pulseDef->jerk_l16, &pulseDef->jerkFrac, pulseDef->phaseDiv);
+				break;
+			case PROFILE_CRUISE:
+				pulseDef->phaseFrames = pulseDef->cruiseFrames;
+				if (pulseDef->phaseFrames != 0)
 				{
-					pulseWidths[k] = pulseWidths[k-1];
+					startCruise(pulseDef);
 				}
-				pulseWidths[i] = temp;
-			}
+				break;
+			case PROFILE_DECEL_1:
+				pulseDef->phaseFrames = pulseDef->decelFrames;
+				if (pulseDef->phaseFrames != 0)
+				{
+					startDecel(pulseDef);
+				}
+				break;
+			default:
+				// End of the profile.  The move ends on the same frame
+				// (framesRemaining), so this is not normally reached.
+				pulseDef->phase = PROFILE_NONE;
+				pulseDef->accel_l16 = 0;
+				pulseDef->accelFrac = 0;
+				pulseDef->jerk_l16 = 0;
+				pulseDef->jerkFrac = 0;
+				return;
 		}
-		
-		// Now that the pulseWidths array has the pulses in the group sorted,
-		// write the edge array with the appropriate values.
-		uint16_t risingEdgeTime = groupNum * 3000; // Each group starts 3000 us apart
-		uint8_t risingEdgeNum = groupNum * 6;	// 6 edges per group (3 rising, 3 falling)
-		for (uint8_t offsetInGroup = 0;	offsetInGroup < 3;	++offsetInGroup)
-		{
-			uint8_t servoNum = pulseWidths[offsetInGroup].servoNum;
-			uint16_t pw = pulseWidths[offsetInGroup].pw;
-			uint8_t bitMap = ServoPinDefs[servoNum].bitMap;
-
-			// Store rising edge values.  Each rising edge is offset RISING_EDGE_SPACING from the previous.
-			// For now, store the edge time for this edge.  It will adjusted later.
-			ServoPulseEdges[risingEdgeNum].nextEdge = risingEdgeTime + (offsetInGroup * RISING_EDGE_SPACING);
-			ServoPulseEdges[risingEdgeNum].bitMap = bitMap;
-			// Set rising edge register address
-			if (pw < MINIMUM_PW)
-			{
-				// Pulse width less than minimum indicates pin should stay at logic '0', so no rising edge.
-				ServoPulseEdges[risingEdgeNum].regAddr = ServoPinDefs[servoNum].outclrRegAddr;
-			}
-			else
+	} while (pulseDef->phaseFrames == 0);
+}
+
+/**********************************************************************
+* Advance a motion profile one frame.  The velocity is updated with
+* forward differences: jerk is added to the acceleration, and the
+* acceleration to the velocity.  The fraction of the velocity is added
+* to the fraction of the position here, and the whole part by the
+* caller.
+**********************************************************************/
+static inline void advanceProfile(PulseDef_t * pulseDef)
+{
+	if (pulseDef->phaseFrames == 0)
+	{
+		nextPhase(pulseDef);
+	}
+	--pulseDef->phaseFrames;
+	uint32_t div = pulseDef->phaseDiv;
+	fracAdd(&pulseDef->accel_l16, &pulseDef->accelFrac, pulseDef->jerk_l16, pulseDef->jerkFrac, div);
+	fracAdd(&pulseDef->deltaPW_l16, &pulseDef->deltaFrac, pulseDef->accel_l16, pulseDef->accelFrac, div);
+	pulseDef->currentFrac += pulseDef->deltaFrac;
+	if (pulseDef->currentFrac >= div)
+	{
+		pulseDef->currentFrac -= div;
+		++pulseDef->currentPW_l16;
+	}
+}
+
+/**********************************************************************
+* Advance each moving servo one frame.  The frame count for the move is
+* set when the move is calculated, so each frame only needs a 16 bit
+* count down and the add of the delta.  On the last frame the pulse
+* width is set to the target, which is where clipping to the target put
+* it before.  Servos that are not moving (framesRemaining = 0) are
+* skipped.  Servos with a motion profile also update their velocity.
+* The group of each moving servo is marked out of date.
+* Inputs: ServoPulseDefs
+* Outputs: ServoPulseDefs, groupStale
+**********************************************************************/
+static void advancePulses(void)
+{
+	uint8_t servoNum = 0;
+	for (uint8_t groupNum = 0; groupNum < NUM_SERVO_GROUPS; ++groupNum)
+	{
+		uint8_t servosInGroup = (groupNum < (NUM_SERVO_GROUPS - 1)) ? SERVOS_PER_GROUP : LAST_GROUP_SIZE;
+		for (uint8_t offsetInGroup = 0; offsetInGroup < servosInGroup; ++offsetInGroup, ++servoNum)
+		{
+			PulseDef_t *pulseDef = &ServoPulseDefs[servoNum];
+			if (pulseDef->framesRemaining == 0)
 			{
-				// Pulse width greater than minimum indicates rising edge (or constant '1') needed.
-				ServoPulseEdges[risingEdgeNum].regAddr = ServoPinDefs[servoNum].outsetRegAddr;
+				continue;
 			}
-
-			// Store falling edge values.  The falling edge time is just PW later than the rising edge.
-			uint8_t fallingEdgeNum = risingEdgeNum + 3;
-			uint16_t fallingEdgeTime = ServoPulseEdges[risingEdgeNum].nextEdge + pw;
-			// For now, store the edge time for this edge.  It will adjusted later.
-			ServoPulseEdges[fallingEdgeNum].nextEdge = fallingEdgeTime;
-			ServoPulseEdges[fallingEdgeNum].bitMap = bitMap;
-			// Set falling edge register address
-			if (pw > MAXIMUM_PW)
+			if (--pulseDef->framesRemaining == 0)
 			{
-				// Pulse width greater than maximum indicates pin should stay at logic '1', so no falling edge.
-				ServoPulseEdges[fallingEdgeNum].regAddr = ServoPinDefs[servoNum].outsetRegAddr;
+				// Last frame of the move
+				pulseDef->currentPW_l16 = (uint32_t)(pulseDef->targetPW) << 16;
+				pulseDef->deltaPW_l16 = 0;
 			}
 			else
 			{
-				// Pulse width greater than minimum indicates falling edge (or constant '0') needed.
-				ServoPulseEdges[fallingEdgeNum].regAddr = ServoPinDefs[servoNum].outclrRegAddr;
+				if (pulseDef->phase != PROFILE_NONE)
+				{
+					advanceProfile(pulseDef);
+				}
+				pulseDef->currentPW_l16 += pulseDef->deltaPW_l16;
 			}
-			
-			// Increment risingEdgeNum for next loop
-			++risingEdgeNum;
+			groupStale[groupNum] = STALE_BOTH;
 		}
-	
-		// At this point, the "nextEdge" entry for ServoPulseEdges is set to the current edge.  Loop
-		// through and adjust this.  Only loop through the first 5 edges.  The last one will be
-		// set separately to the start of the next group.
-		uint8_t edgeNum = groupNum * 6;
-		for (uint8_t i = 0; i < 5; ++i)
+	}
+}
+
+/**********************************************************************
+* Sort the pulseWidths array by pulse width, from smallest to largest.
+* The sort is selected at compile time for the group size: a sorting
+* network (fixed sequence of compare/exchange steps, no loops) for the
+* common group sizes, and an insertion sort for any other size.
+**********************************************************************/
+static inline void sortGroup(void)
+{
+#if (SERVOS_PER_GROUP == 1)
+	// Nothing to sort
+#elif (SERVOS_PER_GROUP == 2)
+	SORT_PAIR(0, 1);
+#elif (SERVOS_PER_GROUP == 3)
+	SORT_PAIR(1, 2);
+	SORT_PAIR(0, 2);
+	SORT_PAIR(0, 1);
+#elif (SERVOS_PER_GROUP == 4)
+	SORT_PAIR(0, 1);
+	SORT_PAIR(2, 3);
+	SORT_PAIR(0, 2);
+	SORT_PAIR(1, 3);
+	SORT_PAIR(1, 2);
+#elif (SERVOS_PER_GROUP == 5)
+	SORT_PAIR(0, 1);
+	SORT_PAIR(3, 4);
+	SORT_PAIR(2, 4);
+	SORT_PAIR(2, 3);
+	SORT_PAIR(0, 3);
+	SORT_PAIR(0, 2);
+	SORT_PAIR(1, 4);
+	SORT_PAIR(1, 3);
+	SORT_PAIR(1, 2);
+#elif (SERVOS_PER_GROUP == 6)
+	SORT_PAIR(1, 2);
+	SORT_PAIR(4, 5);
+	SORT_PAIR(0, 2);
+	SORT_PAIR(3, 5);
+	SORT_PAIR(0, 1);
+	SORT_PAIR(3, 4);
+	SORT_PAIR(2, 5);
+	SORT_PAIR(0, 3);
+	SORT_PAIR(1, 4);
+	SORT_PAIR(2, 4);
+	SORT_PAIR(1, 3);
+	SORT_PAIR(2, 3);
+#else
+	// Insertion sort
+	for (uint8_t i = 1; i < SERVOS_PER_GROUP; ++i)
+	{
+		pulseWidth_t temp = pulseWidths[i];
+		uint8_t k = i;
+		while ((k > 0) && (pulseWidths[k - 1].pw > temp.pw))
 		{
-			// Set each nextEdge to the edge time for the next edge
-			ServoPulseEdges[edgeNum + i].nextEdge = ServoPulseEdges[edgeNum + i + 1].nextEdge;
+			pulseWidths[k] = pulseWidths[k - 1];
+			--k;
 		}
-		// Last entry should be the first edge of the next group
-		if (risingEdgeTime < 9000)
+		pulseWidths[k] = temp;
+	}
+#endif
+}
+
+/**********************************************************************
+* Return the pulse width to output for a servo: the current pulse width
+* plus the closed-loop trim, kept in range.  A pulse width outside the
+* range is forced to 1 beyond it, so that all such pulse widths sort
+* after (or before) the pulsing servos.
+* Inputs: ServoPulseDefs, ServoControlDefs
+**********************************************************************/
+static uint16_t outputPW(uint8_t servoNum)
+{
+	uint16_t pw = ServoPulseDefs[servoNum].currentPW_l16 >> 16;
+	if (pw < MINIMUM_PW)
+	{
+		return MINIMUM_PW - 1;
+	}
+	if (pw > MAXIMUM_PW)
+	{
+		return MAXIMUM_PW + 1;
+	}
+	int16_t trimmed = pw + ServoControlDefs[servoNum].trim;
+	if (trimmed < MINIMUM_PW)
+	{
+		trimmed = MINIMUM_PW;
+	}
+	else if (trimmed > MAXIMUM_PW)
+	{
+		trimmed = MAXIMUM_PW;
+	}
+	return trimmed;
+}
+
+#if (HW_PULSE_OFFLOAD)
+/**********************************************************************
+* Return the TCA0 compare value for a servo with hardware pulses.  In
+* single slope PWM mode, a compare value of 0 holds the pin at '0', and
+* a value above the timer period holds it at '1'.
+**********************************************************************/
+static uint16_t hwCompare(uint8_t servoNum)
+{
+	if (servoNum == HW_PULSE_SERVO_NONE)
+	{
+		return 0;
+	}
+	uint16_t pw = outputPW(servoNum);
+	if (pw < MINIMUM_PW)
+	{
+		return 0;
+	}
+	if (pw > MAXIMUM_PW)
+	{
+		return 0xFFFF;
+	}
+	return pw;
+}
+#endif
+
+/**********************************************************************
+* Plan the edges for one group from the current pulse widths, leaving
+* them in risingEdges[] and fallingEdges[].
+*
+* Edges that switch pins on the same port at the same time are coalesced
+* into one edge (one ISR) with the bit maps OR-ed together.  Servos on the
+* same port in a group share a rising edge where possible, and servos
+* with equal pulse widths then share a falling edge.  Separate edges are
+* always at least RISING_EDGE_SPACING apart.  Servos with hardware pulses
+* (HW_PULSE_OFFLOAD) have no edges, and a group with no other servos
+* gets one edge that sets no pins.
+* Inputs: ServoPulseDefs, ServoControlDefs, ServoPinDefs
+* Outputs: risingEdges, fallingEdges, numRisingEdges, numFallingEdges
+**********************************************************************/
+static void planGroup(uint8_t groupNum)
+{
+	uint8_t servosInGroup = (groupNum < (NUM_SERVO_GROUPS - 1)) ? SERVOS_PER_GROUP : LAST_GROUP_SIZE;
+	uint8_t numPlanned = 0;
+
+	// Loop through the servos in the group, copying the pulse widths
+	for (uint8_t offsetInGroup = 0; offsetInGroup < servosInGroup; ++offsetInGroup)
+	{
+		uint8_t servoNum = (groupNum * SERVOS_PER_GROUP) + offsetInGroup;
+#if (HW_PULSE_OFFLOAD)
+		if ((servoNum == HwPulseServos[0]) || (servoNum == HwPulseServos[1]))
+		{
+			continue;
+		}
+#endif
+		// Store the pulse width in the pulseWidths array for later use.
+		pulseWidths[numPlanned].servoNum = servoNum;
+		pulseWidths[numPlanned].pw = outputPW(servoNum);
+		++numPlanned;
+	}
+#if ((LAST_GROUP_SIZE != SERVOS_PER_GROUP) || HW_PULSE_OFFLOAD)
+	for (uint8_t offsetInGroup = numPlanned; offsetInGroup < SERVOS_PER_GROUP; ++offsetInGroup)
+	{
+		pulseWidths[offsetInGroup].pw = PAD_PW;
+	}
+#endif
+
+	// At this point, the pulseWidths array has been written with the servo
+	// number and pulse width for each servo in the group.  Sort the
+	// pulseWidths array by pulse width, from smallest to largest.
+	sortGroup();
+
+	// Now that the pulseWidths array has the pulses in the group sorted,
+	// plan the edges for the group.  Pins that are pulsing are planned
+	// first, in order of increasing pulse width, then pins that are
+	// held at a constant '0' or '1' are merged into the planned edges.
+	uint16_t groupStartTime = groupNum * SERVO_GROUP_SLOT_US;
+	numRisingEdges = 0;
+	numFallingEdges = 0;
+	for (uint8_t offsetInGroup = 0;	offsetInGroup < numPlanned;	++offsetInGroup)
+	{
+		uint16_t pw = pulseWidths[offsetInGroup].pw;
+		if ((pw >= MINIMUM_PW) && (pw <= MAXIMUM_PW))
+		{
+			planPulse(&ServoPinDefs[pulseWidths[offsetInGroup].servoNum], pw, groupStartTime);
+		}
+	}
+	for (uint8_t offsetInGroup = 0;	offsetInGroup < numPlanned;	++offsetInGroup)
+	{
+		const PinDef_t *pin = &ServoPinDefs[pulseWidths[offsetInGroup].servoNum];
+		uint16_t pw = pulseWidths[offsetInGroup].pw;
+		if (pw < MINIMUM_PW)
+		{
+			// Pulse width less than minimum indicates pin should stay at logic '0'.
+			planConstant(pin->outclrRegAddr, pin->bitMap, groupStartTime);
+		}
+		else if (pw > MAXIMUM_PW)
 		{
-			// Last edge of group, next edge is the first edge of the next group
-			ServoPulseEdges[edgeNum + 5].nextEdge = risingEdgeTime + 3000;
+			// Pulse width greater than maximum indicates pin should stay at logic '1'.
+			planConstant(pin->outsetRegAddr, pin->bitMap, groupStartTime);
 		}
-		else
+	}
+
+	// A group whose servos all have hardware pulses has nothing to plan,
+	// but the ISR still needs an edge in the group to reach the next one.
+	// Plan an edge that sets no pins at the start of the group.
+	if (numRisingEdges == 0)
+	{
+		planConstant(ServoPinDefs[groupNum * SERVOS_PER_GROUP].outsetRegAddr, 0, groupStartTime);
+	}
+}
+
+/**********************************************************************
+* Write the planned edges for a group to the edge array, starting at
+* the group's first edge.  planGroup() always plans at least one edge.
+* Inputs: risingEdges, fallingEdges, numRisingEdges, numFallingEdges
+* Outputs: edges
+**********************************************************************/
+static void writeGroup(EdgeDef_t * edges, uint8_t groupNum)
+{
+	// Write the planned edges to the edge array, rising edges first.
+	// For now, store the edge time for each edge.  It will adjusted later.
+	uint8_t edgeNum = 0;
+	for (uint8_t i = 0; i < numRisingEdges; ++i)
+	{
+		edges[edgeNum].regAddr = risingEdges[i].regAddr;
+		edges[edgeNum].bitMap = risingEdges[i].bitMap;
+		edges[edgeNum].nextEdge = risingEdges[i].time;
+		++edgeNum;
+	}
+	for (uint8_t i = 0; i < numFallingEdges; ++i)
+	{
+		edges[edgeNum].regAddr = fallingEdges[i].regAddr;
+		edges[edgeNum].bitMap = fallingEdges[i].bitMap;
+		edges[edgeNum].nextEdge = fallingEdges[i].time;
+		++edgeNum;
+	}
+
+	// At this point, the "nextEdge" entry for the edges is set to the current edge.  Loop
+	// through and adjust this.  The last edge of the group will be set separately to the start
+	// of the next group.
+	for (uint8_t i = 0; i < (edgeNum - 1); ++i)
+	{
+		// Set each nextEdge to the edge time for the next edge
+		edges[i].nextEdge = edges[i + 1].nextEdge;
+	}
+	// Last entry should be the first edge of the next group
+	if (groupNum < (NUM_SERVO_GROUPS - 1))
+	{
+		// Last edge of group, next edge is the first edge of the next group
+		edges[edgeNum - 1].nextEdge = (groupNum + 1) * SERVO_GROUP_SLOT_US;
+	}
+	else
+	{
+		// Last edge of last group, next edge is at time 0 to start next cycle
+		edges[edgeNum - 1].nextEdge = 0;
+	}
+}
+
+/**********************************************************************
+* Rebuild the out of date groups in one edge array.  Returns the number
+* of groups rebuilt.
+*
+* The servos are split into NUM_SERVO_GROUPS groups of SERVOS_PER_GROUP
+* consecutive servos.  Group N starts at N * SERVO_GROUP_SLOT_US.  The
+* group layout is checked against the frame period in globals.h.
+*
+* The groups are packed in the edge array in order.  If a rebuilt group
+* has a different number of edges than before, then the edges of the
+* following groups are moved to make room.  Their timer values do not
+* change, so they do not need to be rebuilt.
+* Inputs: ServoPulseDefs, ServoPinDefs, groupStale
+* Outputs: ServoPulseEdges[buffer], HwPulseCompare[buffer], groupStale,
+*          groupNumEdges
+**********************************************************************/
+static uint8_t buildFrame(uint8_t buffer)
+{
+#if (HW_PULSE_OFFLOAD)
+	// Compare values for the servos with hardware pulses.  These are
+	// cheap, so they are set on every build.
+	HwPulseCompare[buffer][0] = hwCompare(HwPulseServos[0]);
+	HwPulseCompare[buffer][1] = hwCompare(HwPulseServos[1]);
+#endif
+
+	EdgeDef_t *edges = ServoPulseEdges[buffer];
+	uint8_t staleBit = 1 << buffer;
+	uint8_t groupsRebuilt = 0;
+	uint8_t edgeNum = 0;	// Index of the first edge of the group
+	uint8_t frameNumEdges = 0;
+
+	for (uint8_t groupNum = 0; groupNum < NUM_SERVO_GROUPS; ++groupNum)
+	{
+		frameNumEdges += groupNumEdges[buffer][groupNum];
+	}
+
+	for (uint8_t groupNum = 0; groupNum < NUM_SERVO_GROUPS; ++groupNum)
+	{
+		uint8_t oldNumEdges = groupNumEdges[buffer][groupNum];
+		if (groupStale[groupNum] & staleBit)
 		{
-			// Last edge of last group, next edge is at time 0 to start next cycle
-			ServoPulseEdges[edgeNum + 5].nextEdge = 0;
+			planGroup(groupNum);
+			uint8_t numEdges = numRisingEdges + numFallingEdges;
+			if (numEdges != oldNumEdges)
+			{
+				// Move the following groups to just after the new edges
+				uint8_t tailEdgeNum = edgeNum + oldNumEdges;
+				memmove(&edges[edgeNum + numEdges], &edges[tailEdgeNum],
+					(frameNumEdges - tailEdgeNum) * sizeof(EdgeDef_t));
+				frameNumEdges = frameNumEdges - oldNumEdges + numEdges;
+				groupNumEdges[buffer][groupNum] = numEdges;
+			}
+			writeGroup(&edges[edgeNum], groupNum);
+			groupStale[groupNum] &= ~staleBit;
+			++groupsRebuilt;
 		}
+		edgeNum += groupNumEdges[buffer][groupNum];
 	}
+	return groupsRebuilt;
 }
@@ -6,23 +6,259 @@
  */ 
 
 #include <stdint.h>
+#include <stddef.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
 
 #include "../Include/globals.h"
+#include "../Include/timer.h"
 
+#if (EDGE_TIMING_STATS)
 /**********************************************************************
-* Timer ISR to output edges.  This takes about 10us with an 8MHz clock.
-* The edges must therefore be > 10us apart.
+* Record the timing of one edge.  Called from the edge ISR after the
+* pin has been written, so it does not delay the edge itself.
+* - edgeNum: index of the edge just output
+* - late: timer ticks between the compare match and ISR entry
+* - nextEdge: compare value just written for the next edge
+**********************************************************************/
+static inline void edge_timing_record(uint8_t edgeNum, uint16_t late, uint16_t nextEdge)
+{
+	EdgeTiming_t *timing = &EdgeTiming[edgeNum];
+
+	if (late < timing->minLate)
+	{
+		timing->minLate = late;
+	}
+	if (late > timing->maxLate)
+	{
+		timing->maxLate = late;
+	}
+	uint16_t bin = late >> EDGE_LATE_BIN_SHIFT;
+	if (bin >= EDGE_LATE_NBINS)
+	{
+		bin = EDGE_LATE_NBINS - 1;
+	}
+	if (timing->lateHist[bin] != 0xFFFF)
+	{
+		++timing->lateHist[bin];
+	}
+	if ((late >= EDGE_STACKED_US) && (EdgeStackedCount != 0xFFFF))
+	{
+		++EdgeStackedCount;
+	}
+	// If the timer has already passed the next edge, then the compare
+	// match will not happen until the timer wraps.  A next edge of 0
+	// is the start of the next frame, which is reached by wrapping.
+	if ((nextEdge != 0) && (TCA0_SINGLE_CNT >= nextEdge) && (EdgeMissedCount != 0xFFFF))
+	{
+		++EdgeMissedCount;
+	}
+}
+#endif	// EDGE_TIMING_STATS
+
+#if (EDGE_ISR_ASM)
+// The assembly edge ISR reads the edges as packed records (see EdgeDef_t)
+_Static_assert((sizeof(EdgeDef_t) == 5) && (offsetof(EdgeDef_t, bitMap) == 2)
+	&& (offsetof(EdgeDef_t, nextEdge) == 3), "EdgeDef_t does not match the edge ISR");
+
+/**********************************************************************
+* The edge cursor is the address of the next edge to output.  For the
+* assembly ISR it is kept in GPIOR0 (low byte) and GPIOR1 (high byte),
+* which take one cycle each to read and write with IN and OUT.  GPIOR2
+* and GPIOR3 are scratch registers for the ISR.  No other code may use
+* the GPIORs.
+**********************************************************************/
+static inline void edge_cursor_set(EdgeDef_t *edge)
+{
+	uint16_t addr = (uint16_t)edge;
+	GPIOR0 = addr & 0xFF;
+	GPIOR1 = addr >> 8;
+}
+#else
+// Address of the next edge to output
+static EdgeDef_t *edgeCursor;
+
+static inline void edge_cursor_set(EdgeDef_t *edge)
+{
+	edgeCursor = edge;
+}
+#endif	// EDGE_ISR_ASM
+
+/**********************************************************************
+* End of frame, called from the edge ISR after the last edge of the
+* frame (nextEdge = 0).
+*
+* Start the ADC scan (see adc.c), so the feedback is sampled in the
+* quiet time before the next frame.  The ADC ISR has already selected
+* the first channel.
+*
+* Then switch to the pending edge array if the main loop has built one.
+* Otherwise the active array is output again.  The hardware pulse widths
+* that go with the pending array are loaded into the TCA0 compare
+* buffers.  The edge cursor is set to the first edge of the array.
+**********************************************************************/
+static void __attribute__((used)) edge_frame_end(void)
+{
+	ADC0_COMMAND = ADC_STCONV_bm;				// Start the ADC scan
+	if (EdgeBufferPending != EDGE_BUFFER_NONE)
+	{
+		uint8_t buffer = EdgeBufferPending;
+		EdgeBufferActive = buffer;
+		EdgeBufferPending = EDGE_BUFFER_NONE;
+#if (HW_PULSE_OFFLOAD)
+		// The buffered compare values take effect at the start of
+		// the next frame, with the new edge array
+		TCA0_SINGLE_CMP1BUF = HwPulseCompare[buffer][0];
+		TCA0_SINGLE_CMP2BUF = HwPulseCompare[buffer][1];
+#endif
+	}
+	edge_cursor_set(ServoPulseEdges[EdgeBufferActive]);
+	++FrameCount;
+}
+
+#if (EDGE_ISR_ASM)
+/**********************************************************************
+* Timer ISR to output edges, in assembly.  The edge cursor is loaded
+* from GPIOR0/1 into X, and the edge record is read with post-increment
+* loads, leaving X at the next edge to store back.  Only r24, r26, r27,
+* r30, r31 and SREG are used.  r24 and SREG are saved in GPIOR2 and
+* GPIOR3, which are quicker to restore than the stack.  Nothing
+* interrupts this level 1 ISR, so the scratch GPIORs are safe.
+*
+* Cycle counts (AVRxt core) are shown for each instruction.  For every
+* edge except the last of the frame, the ISR is 46 cycles from the
+* vector JMP to the RETI, plus about 5 cycles of interrupt response:
+* about 6.5us with the 8MHz clock, against about 10us for the C ISR.
+* The pin is written 16 cycles after entry.  The last edge of the frame
+* also saves the call-used registers and calls edge_frame_end().
+*
+* Only built with EDGE_ISR_ASM set.  The counts above are by hand; the
+* C ISR stays the default until they are measured on the part.
+**********************************************************************/
+ISR(TCA0_CMP0_vect, ISR_NAKED)
+{
+	asm volatile(
+		"out %[gpior2], r24"	"\n\t"	// 1	Save r24 and SREG
+		"in r24, __SREG__"		"\n\t"	// 1
+		"out %[gpior3], r24"	"\n\t"	// 1
+		"push r26"				"\n\t"	// 1
+		"push r27"				"\n\t"	// 1
+		"push r30"				"\n\t"	// 1
+		"push r31"				"\n\t"	// 1
+		"in r26, %[gpior0]"		"\n\t"	// 1	X = edge cursor
+		"in r27, %[gpior1]"		"\n\t"	// 1
+		"ld r30, X+"			"\n\t"	// 2	Z = regAddr
+		"ld r31, X+"			"\n\t"	// 2
+		"ld r24, X+"			"\n\t"	// 2	bitMap
+		"st Z, r24"				"\n\t"	// 1	Set pin high/low
+		"ld r24, X+"			"\n\t"	// 2	nextEdge, low byte first
+		"sts %[cmp0], r24"		"\n\t"	// 2
+		"ld r30, X+"			"\n\t"	// 2
+		"sts %[cmp0]+1, r30"	"\n\t"	// 2	Ready for next edge
+		"out %[gpior0], r26"	"\n\t"	// 1	Cursor to the next edge
+		"out %[gpior1], r27"	"\n\t"	// 1
+		"ldi r31, %[cmp0bm]"	"\n\t"	// 1	Clear the flag
+		"sts %[intflags], r31"	"\n\t"	// 2
+		"or r30, r24"			"\n\t"	// 1	nextEdge = 0 ends the frame
+		"breq 2f"				"\n\t"	// 1
+	"1:"						"\n\t"
+		"pop r31"				"\n\t"	// 2
+		"pop r30"				"\n\t"	// 2
+		"pop r27"				"\n\t"	// 2
+		"pop r26"				"\n\t"	// 2
+		"in r24, %[gpior3]"		"\n\t"	// 1
+		"out __SREG__, r24"		"\n\t"	// 1
+		"in r24, %[gpior2]"		"\n\t"	// 1
+		"reti"					"\n\t"	// 4
+	"2:"						"\n\t"	// End of frame
+		"push r0"				"\n\t"
+		"push r1"				"\n\t"
+		"clr r1"				"\n\t"
+		"push r18"				"\n\t"
+		"push r19"				"\n\t"
+		"push r20"				"\n\t"
+		"push r21"				"\n\t"
+		"push r22"				"\n\t"
+		"push r23"				"\n\t"
+		"push r25"				"\n\t"
+		"call %x[frameEnd]"		"\n\t"
+		"pop r25"				"\n\t"
+		"pop r23"				"\n\t"
+		"pop r22"				"\n\t"
+		"pop r21"				"\n\t"
+		"pop r20"				"\n\t"
+		"pop r19"				"\n\t"
+		"pop r18"				"\n\t"
+		"pop r1"				"\n\t"
+		"pop r0"				"\n\t"
+		"rjmp 1b"				"\n\t"
+		:
+		: [gpior0] "I" (_SFR_IO_ADDR(GPIOR0)),
+		  [gpior1] "I" (_SFR_IO_ADDR(GPIOR1)),
+		  [gpior2] "I" (_SFR_IO_ADDR(GPIOR2)),
+		  [gpior3] "I" (_SFR_IO_ADDR(GPIOR3)),
+		  [cmp0] "n" (_SFR_MEM_ADDR(TCA0_SINGLE_CMP0)),
+		  [intflags] "n" (_SFR_MEM_ADDR(TCA0_SINGLE_INTFLAGS)),
+		  [cmp0bm] "M" (TCA_SINGLE_CMP0_bm),
+		  [frameEnd] "i" (edge_frame_end)
+	);
+}
+#else
+/**********************************************************************
+* Timer ISR to output edges, in C.  This takes about 10us with an 8MHz
+* clock, more with the statistics.  The edges must therefore be > 10us
+* apart.
+*
+* With EDGE_TIMING_STATS set, the timer count is captured on entry and
+* compared to the compare value to measure how late the edge is.  The
+* statistics are updated after the pin is written.
 **********************************************************************/
 ISR(TCA0_CMP0_vect)
 {
+#if (EDGE_TIMING_STATS)
+	uint16_t late = TCA0_SINGLE_CNT - TCA0_SINGLE_CMP0;	// Ticks since the compare match
+#endif
 	TCA0_SINGLE_INTFLAGS = TCA_SINGLE_CMP0_bm;		// Clear the flag
-	EdgeDef_t *edge = &ServoPulseEdges[EdgeIndex];	// Pointer to the current edge
-	++EdgeIndex;									// Increment index
+	EdgeDef_t *edge = edgeCursor;					// Pointer to the current edge
 	*edge->regAddr = edge->bitMap;					// Set pin high/low
-	TCA0_SINGLE_CMP0 = edge->nextEdge;				// Ready for next edge
+	uint16_t nextEdge = edge->nextEdge;
+	TCA0_SINGLE_CMP0 = nextEdge;					// Ready for next edge
+#if (EDGE_TIMING_STATS)
+	uint8_t edgeNum = edge - ServoPulseEdges[EdgeBufferActive];
+#endif
+	if (nextEdge == 0)
+	{
+		edge_frame_end();
+	}
+	else
+	{
+		edgeCursor = edge + 1;						// Next edge
+	}
+#if (EDGE_TIMING_STATS)
+	edge_timing_record(edgeNum, late, nextEdge);
+#endif
 }
+#endif	// EDGE_ISR_ASM
+
+#if (EDGE_TIMING_STATS)
+/**********************************************************************
+* Clear the edge timing statistics.
+**********************************************************************/
+void timer_stats_clear(void)
+{
+	for (uint8_t edgeNum = 0; edgeNum < (2 * NUM_SERVOS); ++edgeNum)
+	{
+		EdgeTiming[edgeNum].minLate = 0xFFFF;
+		EdgeTiming[edgeNum].maxLate = 0;
+		for (uint8_t bin = 0; bin < EDGE_LATE_NBINS; ++bin)
+		{
+			EdgeTiming[edgeNum].lateHist[bin] = 0;
+		}
+	}
+	EdgeStackedCount = 0;
+	EdgeMissedCount = 0;
+}
+#endif	// EDGE_TIMING_STATS
 
 /**********************************************************************
 * Initialize the timer:
@@ -32,18 +268,41 @@ ISR(TCA0_CMP0_vect)
 **********************************************************************/
 void timer_init(void)
 {
+#if (EDGE_TIMING_STATS)
+	// Start with no edge timing statistics
+	timer_stats_clear();
+#endif
 	// Set the TCA count to 1 so the first interrupt won't happen right away
 	TCA0_SINGLE_CNT = 1;
-	// Set Compare Channel 0 register to 0 for the first interrupt
+	// Set Compare Channel 0 register to 0 for the first interrupt, which
+	// outputs the first edge of the active edge array
 	TCA0_SINGLE_CMP0 = 0;
-	// Init TCA to 1MHz timebase, TOP=20000 (for a 20ms period)
-	// The peripheral clock is the 8MHz main clock
+	edge_cursor_set(ServoPulseEdges[EdgeBufferActive]);
+#if (HW_PULSE_OFFLOAD)
+	// Hardware pulses for the first frame, from the active edge array
+	TCA0_SINGLE_CMP1 = HwPulseCompare[EdgeBufferActive][0];
+	TCA0_SINGLE_CMP2 = HwPulseCompare[EdgeBufferActive][1];
+#endif
+	// Init TCA to 1MHz timebase, with a period of SERVO_PULSE_PERIOD_US
+	// ticks (TOP = period - 1).  The peripheral clock is the 8MHz main
+	// clock
 	TCA0_SINGLE_CTRLA = TCA_SINGLE_CLKSEL_DIV8_gc | TCA_SINGLE_ENABLE_bm;
-	TCA0_SINGLE_PER = 20000;
+	TCA0_SINGLE_PER = SERVO_PULSE_PERIOD_US - 1;
+#if (HW_PULSE_OFFLOAD)
+	// Single slope PWM, with the WO1 and WO2 outputs on PB1 and PB2 (see
+	// HW_PULSE_OFFLOAD).  The period and the CMP0 interrupt are the same
+	// as in normal mode.  WO0 (PB0) is not enabled, so CMP0 is free for
+	// the edge ISR.  WO1 and WO2 are enabled only if a servo is on the pin.
+	PORTMUX_TCAROUTEA = PORTMUX_TCA0_PORTB_gc;
+	TCA0_SINGLE_CTRLB = TCA_SINGLE_WGMODE_SINGLESLOPE_gc
+		| ((HwPulseServos[0] != HW_PULSE_SERVO_NONE) ? TCA_SINGLE_CMP1EN_bm : 0)
+		| ((HwPulseServos[1] != HW_PULSE_SERVO_NONE) ? TCA_SINGLE_CMP2EN_bm : 0);
+#else
 	TCA0_SINGLE_CTRLB = TCA_SINGLE_WGMODE_NORMAL_gc;
+#endif
 	// Set the TCA0 CMPO interrupt to level 1 so it can interrupt USART interrupts
 	CPUINT_LVL1VEC = TCA0_CMP0_vect_num;
 	// Clear interrupt flag and enable interrupt on Compare Channel 0
 	TCA0_SINGLE_INTFLAGS = TCA_SINGLE_CMP0_bm;
 	TCA0_SINGLE_INTCTRL = TCA_SINGLE_CMP0_bm;
-}
\ No newline at end of file
+}